@@ -0,0 +1,499 @@
+/* Stream Archive I/O utility, Copyright (C) Olof Lagerkvist 2004-2022
+*
+* arcstats.cpp
+* Archive content statistics collected in one header-only pass (-t:s).
+*/
+
+#ifndef _UNICODE
+#define _UNICODE
+#endif
+#ifndef _DLL
+#define _DLL
+#endif
+#ifndef UNICODE
+#define UNICODE
+#endif
+#ifndef _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#define WIN32_NO_STATUS
+#include <windows.h>
+#include <intsafe.h>
+#undef WIN32_NO_STATUS
+#include <ntdll.h>
+
+#include <winstrct.h>
+#include <wio.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "strarc.hpp"
+
+// Extension is the part of the file name after the last dot, if any.
+bool
+ArchiveStatistics::AddExtension(PCUNICODE_STRING Path,
+    LONGLONG FileSize,
+    LONGLONG _StoredBytes)
+{
+    LPCWSTR name_end = Path->Buffer + (Path->Length / sizeof(WCHAR));
+    LPCWSTR extension = name_end;
+
+    for (LPCWSTR ptr = name_end; ptr > Path->Buffer; ptr--)
+        if (ptr[-1] == L'\\')
+            break;
+        else if (ptr[-1] == L'.')
+        {
+            extension = ptr;
+            break;
+        }
+
+    USHORT length = (USHORT)(name_end - extension);
+    DWORD dwSlot = ExtensionStatisticsItem::Hash(extension, length) &
+        (ARCHIVE_STATS_EXTENSION_SLOTS - 1);
+
+    ExtensionStatisticsItem *item;
+
+    for (item = Extensions[dwSlot]; item != NULL; item = item->GetNext())
+        if (item->Match(extension, length))
+            break;
+
+    if (item == NULL)
+    {
+        item = ExtensionStatisticsItem::NewItem(Extensions[dwSlot],
+            extension,
+            length);
+
+        if (item == NULL)
+            return false;
+
+        Extensions[dwSlot] = item;
+        ++dwExtensionCount;
+    }
+
+    ++item->Counter.Count;
+    item->Counter.Bytes += FileSize;
+    item->StoredBytes += _StoredBytes;
+
+    return true;
+}
+
+// Largest files are kept sorted by bytes in archive, largest first.
+bool
+ArchiveStatistics::AddLargestFile(PCUNICODE_STRING Path,
+    LONGLONG FileSize,
+    LONGLONG _StoredBytes)
+{
+    if ((dwLargestCount == ARCHIVE_STATS_LARGEST_FILES) &&
+        (_StoredBytes <= Largest[dwLargestCount - 1].StoredBytes))
+        return true;
+
+    PWSTR name = (PWSTR)malloc(Path->Length + sizeof(WCHAR));
+
+    if (name == NULL)
+        return false;
+
+    CopyMemory(name, Path->Buffer, Path->Length);
+
+    if (dwLargestCount == ARCHIVE_STATS_LARGEST_FILES)
+        free(Largest[--dwLargestCount].Name.Buffer);
+
+    DWORD i = dwLargestCount;
+    while ((i > 0) && (Largest[i - 1].StoredBytes < _StoredBytes))
+        --i;
+
+    MoveMemory(Largest + i + 1, Largest + i,
+        (dwLargestCount - i) * sizeof(*Largest));
+
+    Largest[i].StoredBytes = _StoredBytes;
+    Largest[i].FileSize = FileSize;
+    Largest[i].Name.Buffer = name;
+    Largest[i].Name.Length = Path->Length;
+    Largest[i].Name.MaximumLength = Path->Length + sizeof(WCHAR);
+
+    ++dwLargestCount;
+
+    return true;
+}
+
+bool
+ArchiveStatistics::AddFile(PCUNICODE_STRING Path,
+    const BY_HANDLE_FILE_INFORMATION *FileInfo,
+    LONGLONG _StoredBytes,
+    LONGLONG SparseDataBytes,
+    bool bSparse,
+    bool bDelta,
+    bool bHardLink)
+{
+    LONGLONG FileSize = ((LONGLONG)FileInfo->nFileSizeHigh << 32) |
+        FileInfo->nFileSizeLow;
+
+    StoredBytes += _StoredBytes;
+
+    for (int i = 0; i < 32; i++)
+        if (FileInfo->dwFileAttributes & (1UL << i))
+        {
+            ++Attributes[i].Count;
+            Attributes[i].Bytes += FileSize;
+        }
+
+    if (FileInfo->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+    {
+        ++DirectoryCount;
+        DirectoryStoredBytes += _StoredBytes;
+        return true;
+    }
+
+    ++Files.Count;
+    Files.Bytes += FileSize;
+    FileStoredBytes += _StoredBytes;
+
+    DWORD dwDepth = 0;
+    for (USHORT i = 0; i < Path->Length / sizeof(WCHAR); i++)
+        if (Path->Buffer[i] == L'\\')
+            ++dwDepth;
+
+    if (dwDepth >= ARCHIVE_STATS_MAX_DEPTH)
+        dwDepth = ARCHIVE_STATS_MAX_DEPTH - 1;
+
+    ++Depths[dwDepth].Count;
+    Depths[dwDepth].Bytes += FileSize;
+
+    // A hard link is stored as the name of a file earlier in archive, so
+    // none of its data is stored again.
+    if (bHardLink)
+    {
+        ++HardLinks.Count;
+        HardLinks.Bytes += FileSize;
+    }
+    else if (bDelta)
+    {
+        ++DeltaFiles.Count;
+        DeltaFiles.Bytes += FileSize;
+
+        if (FileSize > SparseDataBytes)
+            DeltaSavedBytes += FileSize - SparseDataBytes;
+    }
+    else if (bSparse)
+    {
+        ++SparseFiles.Count;
+        SparseFiles.Bytes += FileSize;
+
+        if (FileSize > SparseDataBytes)
+            SparseSavedBytes += FileSize - SparseDataBytes;
+    }
+
+    return AddExtension(Path, FileSize, _StoredBytes) &&
+        AddLargestFile(Path, FileSize, _StoredBytes);
+}
+
+static int
+__cdecl
+CompareExtensionBytes(const void *Item1, const void *Item2)
+{
+    LONGLONG Bytes1 = (*(ExtensionStatisticsItem **)Item1)->Counter.Bytes;
+    LONGLONG Bytes2 = (*(ExtensionStatisticsItem **)Item2)->Counter.Bytes;
+
+    return Bytes1 < Bytes2 ? 1 : Bytes1 > Bytes2 ? -1 : 0;
+}
+
+// This function prints tables with counts and bytes of streams, attributes,
+// directory depths and extensions, followed by the largest files. Size
+// columns hold sizes of unnamed data streams as stored in file headers, In
+// archive columns hold bytes used in archive including all stream headers
+// and data.
+void
+ArchiveStatistics::PrintReport(FILE *Stream, LONGLONG ArchiveBytes) const
+{
+    fprintf(Stream,
+        "strarc archive statistics, %I64i bytes read.\n"
+        "\n"
+        "                       Count       Size        In archive\n"
+        "%-22s %-11I64i %-11I64i %I64i\n"
+        "%-22s %-11I64i %-11s %I64i\n"
+        "%-22s %-11s %-11s %I64i\n"
+        "%-22s %-11s %-11s %I64i\n"
+        "\n"
+        "Savings                Files       Size        Not stored\n"
+        "%-22s %-11I64i %-11I64i %I64i\n"
+        "%-22s %-11I64i %-11I64i %I64i\n"
+        "%-22s %-11I64i %-11I64i %I64i\n"
+        "\n"
+        "Stream type                     Count       In archive\n",
+        ArchiveBytes,
+        "Files", Files.Count, Files.Bytes, FileStoredBytes,
+        "Directories", DirectoryCount, "", DirectoryStoredBytes,
+        "File headers", "", "", HeaderBytes,
+        "Total", "", "", StoredBytes,
+        "Hard links", HardLinks.Count, HardLinks.Bytes, HardLinks.Bytes,
+        "Sparse files", SparseFiles.Count, SparseFiles.Bytes,
+        SparseSavedBytes,
+        "Delta streams", DeltaFiles.Count, DeltaFiles.Bytes,
+        DeltaSavedBytes);
+
+    for (DWORD i = 0; i < ARCHIVE_STATS_STREAM_TYPES; i++)
+    {
+        if (Streams[i].Count == 0)
+            continue;
+
+        fprintf(Stream,
+            "%-31s %-11I64i %I64i\n",
+            GetStreamIdDescription(i),
+            Streams[i].Count,
+            Streams[i].Bytes);
+    }
+
+    for (DWORD i = 0; i < ARCHIVE_STATS_PRIVATE_STREAM_TYPES; i++)
+    {
+        if (PrivateStreams[i].Count == 0)
+            continue;
+
+        // Magics unknown to this version are displayed by value.
+        char unknown[12];
+        LPCSTR description = GetStrArcMagicDescription(STRARC_MAGIC + i);
+
+        if (description == NULL)
+        {
+            _snprintf(unknown, sizeof(unknown), "%#x", STRARC_MAGIC + i);
+            unknown[sizeof(unknown) - 1] = 0;
+            description = unknown;
+        }
+
+        fprintf(Stream,
+            "%-31s %-11I64i %I64i\n",
+            description,
+            PrivateStreams[i].Count,
+            PrivateStreams[i].Bytes);
+    }
+
+    fputs("\n"
+        "Attribute                          Count       Size\n",
+        Stream);
+
+    for (int i = 0; i < 32; i++)
+    {
+        if (Attributes[i].Count == 0)
+            continue;
+
+        fprintf(Stream,
+            "%-34s %-11I64i %I64i\n",
+            GetFileAttributesDescription(1UL << i),
+            Attributes[i].Count,
+            Attributes[i].Bytes);
+    }
+
+    fputs("\n"
+        "Depth  Files       Size\n",
+        Stream);
+
+    for (int i = 0; i < ARCHIVE_STATS_MAX_DEPTH; i++)
+    {
+        if (Depths[i].Count == 0)
+            continue;
+
+        fprintf(Stream,
+            "%-2i%-4s %-11I64i %I64i\n",
+            i,
+            i == ARCHIVE_STATS_MAX_DEPTH - 1 ? "+" : "",
+            Depths[i].Count,
+            Depths[i].Bytes);
+    }
+
+    fputs("\n"
+        "Files       Size        In archive  Extension\n",
+        Stream);
+
+    ExtensionStatisticsItem **sorted = (ExtensionStatisticsItem **)
+        malloc(dwExtensionCount * sizeof(*sorted));
+
+    if (sorted != NULL)
+    {
+        DWORD dwCount = 0;
+
+        for (int i = 0; i < ARCHIVE_STATS_EXTENSION_SLOTS; i++)
+            for (ExtensionStatisticsItem *item = Extensions[i];
+                item != NULL;
+                item = item->GetNext())
+                sorted[dwCount++] = item;
+
+        qsort(sorted, dwCount, sizeof(*sorted), CompareExtensionBytes);
+
+        ArchiveStatisticsCounter other = { 0 };
+        LONGLONG OtherStoredBytes = 0;
+
+        for (DWORD i = 0; i < dwCount; i++)
+            if (i >= ARCHIVE_STATS_EXTENSIONS_REPORTED)
+            {
+                other.Count += sorted[i]->Counter.Count;
+                other.Bytes += sorted[i]->Counter.Bytes;
+                OtherStoredBytes += sorted[i]->StoredBytes;
+            }
+            else
+            {
+                fprintf(Stream,
+                    "%-11I64i %-11I64i %-11I64i ",
+                    sorted[i]->Counter.Count,
+                    sorted[i]->Counter.Bytes,
+                    sorted[i]->StoredBytes);
+
+                if (sorted[i]->Length == 0)
+                    fputs("(none)\n", Stream);
+                else
+                    oem_printf(Stream, ".%1!.*ws!%%n",
+                        (int)sorted[i]->Length, sorted[i]->Name);
+            }
+
+        if (other.Count > 0)
+            fprintf(Stream,
+                "%-11I64i %-11I64i %-11I64i (other)\n",
+                other.Count,
+                other.Bytes,
+                OtherStoredBytes);
+
+        free(sorted);
+    }
+
+    fputs("\n"
+        "In archive  Size        Largest files\n",
+        Stream);
+
+    for (DWORD i = 0; i < dwLargestCount; i++)
+    {
+        fprintf(Stream,
+            "%-11I64i %-11I64i ",
+            Largest[i].StoredBytes,
+            Largest[i].FileSize);
+
+        oem_printf(Stream, "%1!wZ!%%n", &Largest[i].Name);
+    }
+}
+
+// This function reads only file headers and stream headers of the archive.
+// Stream names and data are skipped, by moving the file pointer when the
+// archive is a disk file, so that statistics for a large archive are
+// collected at the speed of reading its headers. Files not selected by -e
+// and -i are not counted.
+bool
+StrArc::ScanArchiveStatistics()
+{
+    if (!ReadNextFileHeader())
+        return false;
+
+    for (;;)
+    {
+        YieldSingleProcessor();
+
+        if (bCancel)
+            return false;
+
+        if (!IsValidFileHeader())
+        {
+            if (!ReadNextFileHeader())
+                return true;
+        }
+
+        DWORD dwBytesToRead = header->dwStreamNameSize + header->Size.LowPart;
+        if (dwBufferSize - HEADER_SIZE < dwBytesToRead)
+        {
+            Exception(XE_BAD_BUFFER);
+        }
+
+        if (ReadArchive(Buffer + HEADER_SIZE, dwBytesToRead) != dwBytesToRead)
+        {
+            if (!ReadNextFileHeader())
+                Exception(XE_ARCHIVE_TRUNC);
+
+            continue;
+        }
+
+        BY_HANDLE_FILE_INFORMATION FileInfo;
+        WCHAR wczShortName[14];
+
+        if (!DecodeFileHeader(dwBytesToRead, &FileInfo, wczShortName))
+        {
+            if (!ReadNextFileHeader())
+                return true;
+
+            continue;
+        }
+
+        bool bIncludeThis;
+        ExcludedString(&LastHeaderPath, &FileInfo, NULL, &bIncludeThis);
+
+        LONGLONG StoredBytes = HEADER_SIZE + dwBytesToRead;
+        LONGLONG SparseDataBytes = 0;
+        bool bSparse = false;
+        bool bDelta = false;
+        bool bHardLink = false;
+
+        if (bIncludeThis)
+            ContentStatistics->AddHeader(StoredBytes);
+
+        for (;;)
+        {
+            DWORD dwBytesRead = ReadStreamHeader();
+
+            if (dwBytesRead == 0)
+                break;
+
+            if (dwBytesRead < HEADER_SIZE)
+            {
+                fprintf(stderr,
+                    "strarc: Incomplete stream header: %u bytes missing.\n",
+                    HEADER_SIZE - dwBytesRead);
+                Exception(XE_ARCHIVE_TRUNC);
+            }
+
+            if (IsNewFileHeader())
+                break;
+
+            LARGE_INTEGER BytesToSkip;
+            BytesToSkip.QuadPart =
+                header->dwStreamNameSize + header->Size.QuadPart;
+
+            StoredBytes += HEADER_SIZE + BytesToSkip.QuadPart;
+
+            if (bIncludeThis)
+                ContentStatistics->AddStream(header->dwStreamId,
+                    header->dwStreamAttributes,
+                    HEADER_SIZE + BytesToSkip.QuadPart);
+
+            // Sparse blocks of the unnamed data stream begin with the offset
+            // of the block in the file.
+            if (header->dwStreamId == BACKUP_LINK)
+                bHardLink = true;
+            else if (IsDeltaCopyStream())
+                bDelta = true;
+            else if ((header->dwStreamId == BACKUP_SPARSE_BLOCK) &&
+                (header->dwStreamNameSize == 0))
+            {
+                bSparse = true;
+
+                if (header->Size.QuadPart > sizeof(LARGE_INTEGER))
+                    SparseDataBytes +=
+                    header->Size.QuadPart - sizeof(LARGE_INTEGER);
+            }
+
+            if (!SkipArchive(&BytesToSkip))
+                return false;
+        }
+
+        if (!bIncludeThis)
+            continue;
+
+        if (!ContentStatistics->AddFile(&LastHeaderPath,
+            &FileInfo,
+            StoredBytes,
+            SparseDataBytes,
+            bSparse,
+            bDelta,
+            bHardLink))
+            Exception(XE_NOT_ENOUGH_MEMORY);
+
+        ++FileCounter;
+    }
+}
@@ -0,0 +1,240 @@
+#include <malloc.h>
+
+// Stream ids below this value are counted separately by the -t:s archive
+// statistics, higher ids are counted together with BACKUP_INVALID.
+#define ARCHIVE_STATS_STREAM_TYPES 16
+
+// Private streams with one of the first STRARC_MAGIC_* values in the Stream
+// Attributes field are counted separately from their stream id.
+#define ARCHIVE_STATS_PRIVATE_STREAM_TYPES 8
+
+// Files at this directory depth or deeper are counted together.
+#define ARCHIVE_STATS_MAX_DEPTH 32
+
+// Number of hash slots for extensions and number of extensions reported.
+#define ARCHIVE_STATS_EXTENSION_SLOTS 256
+#define ARCHIVE_STATS_EXTENSIONS_REPORTED 30
+
+// Number of files kept in the list of largest files.
+#define ARCHIVE_STATS_LARGEST_FILES 20
+
+// Files and bytes counted for one category in archive statistics.
+struct ArchiveStatisticsCounter
+{
+  LONGLONG Count;
+  LONGLONG Bytes;
+};
+
+// This class holds counters for one file name extension, in a hash table of
+// extensions found in the archive. Extensions are compared case
+// insensitive.
+class ExtensionStatisticsItem
+{
+
+private:
+
+  ExtensionStatisticsItem *Next;
+
+  ExtensionStatisticsItem(ExtensionStatisticsItem * _Next,
+			  LPCWSTR _Name,
+			  USHORT _Length)
+    : Next(_Next),
+      Length(_Length)
+  {
+    Counter.Count = 0;
+    Counter.Bytes = 0;
+    StoredBytes = 0;
+
+    Name = (PWSTR) malloc(_Length * sizeof(WCHAR));
+
+    if (Name != NULL)
+      CopyMemory(Name, _Name, _Length * sizeof(WCHAR));
+  }
+
+  ~ExtensionStatisticsItem()
+  {
+    if (Name != NULL)
+      free(Name);
+  }
+
+public:
+
+  PWSTR Name;
+  USHORT Length;
+  ArchiveStatisticsCounter Counter;
+  LONGLONG StoredBytes;
+
+  static
+  DWORD Hash(LPCWSTR _Name, USHORT _Length)
+  {
+    DWORD hash = 2166136261UL;
+
+    for (USHORT i = 0; i < _Length; i++)
+      hash = (hash ^ towupper(_Name[i])) * 16777619UL;
+
+    return hash;
+  }
+
+  ExtensionStatisticsItem *DeleteAndGetNext()
+  {
+    ExtensionStatisticsItem *next_item = Next;
+    delete this;
+    return next_item;
+  }
+
+  static
+  ExtensionStatisticsItem *NewItem(ExtensionStatisticsItem * Next,
+				   LPCWSTR Name,
+				   USHORT Length)
+  {
+    ExtensionStatisticsItem *item =
+      new ExtensionStatisticsItem(Next, Name, Length);
+
+    if (item == NULL)
+      return NULL;
+
+    if ((item->Name == NULL) && (Length > 0))
+      {
+	delete item;
+	return NULL;
+      }
+
+    return item;
+  }
+
+  bool
+  Match(LPCWSTR _Name, USHORT _Length) const
+  {
+    return (Length == _Length) &&
+      (_wcsnicmp(Name, _Name, _Length) == 0);
+  }
+
+  ExtensionStatisticsItem *GetNext() const
+  {
+    return Next;
+  }
+};
+
+// One of the largest files found in archive.
+struct LargestFileEntry
+{
+  LONGLONG StoredBytes;
+  LONGLONG FileSize;
+  UNICODE_STRING Name;
+};
+
+// This class collects statistics about contents of an archive, scanned by
+// StrArc::ScanArchiveStatistics() with -t:s. Files are added by AddFile()
+// with the bytes their streams take in the archive. The report is printed
+// by PrintReport(), implemented in arcstats.cpp.
+class ArchiveStatistics
+{
+
+private:
+
+  ArchiveStatisticsCounter Streams[ARCHIVE_STATS_STREAM_TYPES];
+  ArchiveStatisticsCounter PrivateStreams[ARCHIVE_STATS_PRIVATE_STREAM_TYPES];
+  ArchiveStatisticsCounter Attributes[32];
+  ArchiveStatisticsCounter Depths[ARCHIVE_STATS_MAX_DEPTH];
+  ExtensionStatisticsItem *Extensions[ARCHIVE_STATS_EXTENSION_SLOTS];
+  DWORD dwExtensionCount;
+  LargestFileEntry Largest[ARCHIVE_STATS_LARGEST_FILES];
+  DWORD dwLargestCount;
+
+  // Counters for files hold sum of file sizes, while bytes in archive for
+  // files and directories are summed separately.
+  ArchiveStatisticsCounter Files;
+  LONGLONG FileStoredBytes;
+  LONGLONG DirectoryCount;
+  LONGLONG DirectoryStoredBytes;
+  LONGLONG StoredBytes;
+  LONGLONG HeaderBytes;
+
+  // Files stored as hard links to files earlier in archive, with their
+  // sizes, and bytes not stored for sparse files and delta streams.
+  ArchiveStatisticsCounter HardLinks;
+  ArchiveStatisticsCounter SparseFiles;
+  LONGLONG SparseSavedBytes;
+  ArchiveStatisticsCounter DeltaFiles;
+  LONGLONG DeltaSavedBytes;
+
+  bool
+  AddExtension(PCUNICODE_STRING Path, LONGLONG FileSize,
+	       LONGLONG _StoredBytes);
+
+  bool
+  AddLargestFile(PCUNICODE_STRING Path, LONGLONG FileSize,
+		 LONGLONG _StoredBytes);
+
+public:
+
+  ArchiveStatistics()
+    : dwExtensionCount(0),
+      dwLargestCount(0),
+      FileStoredBytes(0),
+      DirectoryCount(0),
+      DirectoryStoredBytes(0),
+      StoredBytes(0),
+      HeaderBytes(0),
+      SparseSavedBytes(0),
+      DeltaSavedBytes(0)
+  {
+    ZeroMemory(Streams, sizeof(Streams));
+    ZeroMemory(PrivateStreams, sizeof(PrivateStreams));
+    ZeroMemory(Attributes, sizeof(Attributes));
+    ZeroMemory(Depths, sizeof(Depths));
+    ZeroMemory(Extensions, sizeof(Extensions));
+    ZeroMemory(&Files, sizeof(Files));
+    ZeroMemory(&HardLinks, sizeof(HardLinks));
+    ZeroMemory(&SparseFiles, sizeof(SparseFiles));
+    ZeroMemory(&DeltaFiles, sizeof(DeltaFiles));
+  }
+
+  ~ArchiveStatistics()
+  {
+    for (int i = 0; i < ARCHIVE_STATS_EXTENSION_SLOTS; i++)
+      for (ExtensionStatisticsItem *item = Extensions[i];
+	   item != NULL;
+	   item = item->DeleteAndGetNext());
+
+    for (DWORD i = 0; i < dwLargestCount; i++)
+      free(Largest[i].Name.Buffer);
+  }
+
+  // Counts one stream with its header and name.
+  void
+  AddStream(DWORD dwStreamId, DWORD dwStreamAttributes, LONGLONG Bytes)
+  {
+    DWORD dwPrivate = dwStreamAttributes - STRARC_MAGIC;
+
+    ArchiveStatisticsCounter *counter =
+      dwPrivate < ARCHIVE_STATS_PRIVATE_STREAM_TYPES ?
+      PrivateStreams + dwPrivate :
+      Streams + (dwStreamId < ARCHIVE_STATS_STREAM_TYPES ? dwStreamId : 0);
+
+    ++counter->Count;
+    counter->Bytes += Bytes;
+  }
+
+  void
+  AddHeader(LONGLONG Bytes)
+  {
+    HeaderBytes += Bytes;
+  }
+
+  // Adds a file with bytes stored in its streams. SparseDataBytes is the
+  // file data stored in sparse block streams of the unnamed data stream,
+  // which with bDelta is the data stored as differences against a base
+  // archive. Returns false if out of memory.
+  bool
+  AddFile(PCUNICODE_STRING Path,
+	  const BY_HANDLE_FILE_INFORMATION *FileInfo,
+	  LONGLONG _StoredBytes,
+	  LONGLONG SparseDataBytes,
+	  bool bSparse,
+	  bool bDelta,
+	  bool bHardLink);
+
+  void
+  PrintReport(FILE *Stream, LONGLONG ArchiveBytes) const;
+};
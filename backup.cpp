@@ -24,16 +24,404 @@
 #include <ntdll.h>
 
 #include <winstrct.h>
+#include <winioctl.h>
 #include <wio.h>
 
+#include <stdlib.h>
+
 #include "strarc.hpp"
 
+// Returns true if a block of file data contains only zero bytes.
+static bool
+IsZeroBlock(LPCBYTE lpBlock, DWORD dwSize)
+{
+    const ULONG_PTR UNALIGNED *lpWord = (const ULONG_PTR UNALIGNED *)lpBlock;
+
+    for (; dwSize >= sizeof(ULONG_PTR); dwSize -= sizeof(ULONG_PTR))
+        if (*(lpWord++) != 0)
+            return false;
+
+    for (lpBlock = (LPCBYTE)lpWord; dwSize > 0; dwSize--)
+        if (*(lpBlock++) != 0)
+            return false;
+
+    return true;
+}
+
+// This function reads exactly the requested number of bytes from an ongoing
+// BackupRead operation. It returns false if BackupRead fails or if the backup
+// stream ends before the requested number of bytes have been read.
+bool
+StrArc::BackupReadBlock(HANDLE hFile,
+    LPBYTE lpBuf,
+    DWORD dwSize,
+    LPVOID *lpCtx)
+{
+    PerfTimer timer(Statistics, PERF_PHASE_BACKUP_READ);
+    timer.SetBytes(dwSize);
+
+    while (dwSize > 0)
+    {
+        DWORD dwBytesRead;
+        if (!BackupRead(hFile, lpBuf, dwSize, &dwBytesRead, FALSE,
+            bProcessSecurity, lpCtx))
+            return false;
+
+        if (dwBytesRead == 0)
+        {
+            SetLastError(ERROR_HANDLE_EOF);
+            return false;
+        }
+
+        dwSize -= dwBytesRead;
+        lpBuf += dwBytesRead;
+    }
+
+    return true;
+}
+
+// This function is called when the header of an unnamed data stream has just
+// been read from BackupRead into Buffer. It reads the stream data and writes
+// it to the archive as a sequence of sparse block streams, leaving out blocks
+// of SPARSE_ZERO_BLOCK_SIZE bytes that only contain zeros. The last block of
+// the stream is always stored, so that the restored file gets the correct
+// size. If the entire stream fits in one buffer and there are no zero blocks,
+// it is stored as an ordinary data stream.
+bool
+StrArc::ReadDataStreamAsSparseBlocks(PUNICODE_STRING File,
+    HANDLE hFile,
+    LPVOID *lpCtx)
+{
+    const DWORD dwRecordHeaderSize = HEADER_SIZE + sizeof(LARGE_INTEGER);
+
+    LPBYTE lpData = Buffer + dwRecordHeaderSize;
+    DWORD dwChunkSize = (dwBufferSize - dwRecordHeaderSize) &
+        ~(SPARSE_ZERO_BLOCK_SIZE - 1);
+
+    LARGE_INTEGER StreamSize = header->Size;
+    LONGLONG Offset = 0;
+
+    while (Offset < StreamSize.QuadPart)
+    {
+        YieldSingleProcessor();
+
+        if (bCancel)
+            return false;
+
+        DWORD dwChunk =
+            (StreamSize.QuadPart - Offset > (LONGLONG)dwChunkSize) ?
+            dwChunkSize : (DWORD)(StreamSize.QuadPart - Offset);
+
+        if (!BackupReadBlock(hFile, lpData, dwChunk, lpCtx))
+        {
+            WErrMsgA errmsg;
+            oem_printf(stderr,
+                "strarc: Cannot read '%1!wZ!': %2%%n",
+                File, errmsg);
+            return false;
+        }
+
+        bool bLastChunk = Offset + dwChunk == StreamSize.QuadPart;
+
+        // Find runs of blocks that are not all zeros and store each such run
+        // as a sparse block stream. There is always at least one zero block
+        // between two runs, so the stream header for a run can be built in
+        // place right before the run data.
+        DWORD dwRunStart = 0;
+        DWORD dwZeroBytes = 0;
+        for (DWORD dwPos = 0; dwPos < dwChunk; )
+        {
+            DWORD dwBlock = dwChunk - dwPos > SPARSE_ZERO_BLOCK_SIZE ?
+                SPARSE_ZERO_BLOCK_SIZE : dwChunk - dwPos;
+
+            bool bZero = IsZeroBlock(lpData + dwPos, dwBlock) &&
+                !(bLastChunk && (dwPos + dwBlock == dwChunk));
+
+            if (bZero)
+                dwZeroBytes += dwBlock;
+
+            if (bZero && (dwRunStart < dwPos))
+            {
+                LPWIN32_STREAM_ID record = (LPWIN32_STREAM_ID)
+                    (lpData + dwRunStart - dwRecordHeaderSize);
+
+                record->dwStreamId = BACKUP_SPARSE_BLOCK;
+                record->dwStreamAttributes = STREAM_SPARSE_ATTRIBUTE;
+                record->dwStreamNameSize = 0;
+                record->Size.QuadPart =
+                    sizeof(LARGE_INTEGER) + dwPos - dwRunStart;
+                ((PLARGE_INTEGER)(lpData + dwRunStart))[-1].QuadPart =
+                    Offset + dwRunStart;
+
+                if (bVerbose)
+                    fprintf(stderr, "[sparse %u bytes]", dwPos - dwRunStart);
+
+                WriteArchive((LPBYTE)record,
+                    dwRecordHeaderSize + dwPos - dwRunStart);
+            }
+
+            dwPos += dwBlock;
+
+            if (bZero)
+                dwRunStart = dwPos;
+        }
+
+        // A complete stream fitting in one chunk without any zero blocks is
+        // stored as a plain data stream. The stream header is still intact at
+        // the beginning of Buffer in that case.
+        if ((Offset == 0) && bLastChunk && (dwZeroBytes == 0))
+        {
+            if (bVerbose)
+                fprintf(stderr, "%u bytes", HEADER_SIZE + dwChunk);
+
+            MoveMemory(Buffer + HEADER_SIZE, lpData, dwChunk);
+            WriteArchive(Buffer, HEADER_SIZE + dwChunk);
+            return true;
+        }
+
+        if (dwRunStart < dwChunk)
+        {
+            LPWIN32_STREAM_ID record = (LPWIN32_STREAM_ID)
+                (lpData + dwRunStart - dwRecordHeaderSize);
+
+            record->dwStreamId = BACKUP_SPARSE_BLOCK;
+            record->dwStreamAttributes = STREAM_SPARSE_ATTRIBUTE;
+            record->dwStreamNameSize = 0;
+            record->Size.QuadPart =
+                sizeof(LARGE_INTEGER) + dwChunk - dwRunStart;
+            ((PLARGE_INTEGER)(lpData + dwRunStart))[-1].QuadPart =
+                Offset + dwRunStart;
+
+            if (bVerbose)
+                fprintf(stderr, "[sparse %u bytes]", dwChunk - dwRunStart);
+
+            WriteArchive((LPBYTE)record,
+                dwRecordHeaderSize + dwChunk - dwRunStart);
+        }
+
+        if (bVerbose && (dwZeroBytes > 0))
+            fprintf(stderr, "[%u zero bytes]", dwZeroBytes);
+
+        Offset += dwChunk;
+    }
+
+    return true;
+}
+
+// This function backs up an object (file or directory) to the archive stream,
+// reading one backup stream at a time so that each stream can be examined
+// before it is written to the archive.
+bool
+StrArc::ReadFileStreamsToArchiveByStream(PUNICODE_STRING File,
+    HANDLE hFile)
+{
+    LPVOID lpCtx = NULL;
+    for (;;)
+    {
+        YieldSingleProcessor();
+
+        if (bCancel)
+        {
+            if (bVerbose)
+                fputs(", break.\r\n", stderr);
+
+            BackupRead(NULL, NULL, 0, NULL, TRUE, FALSE, &lpCtx);
+            return false;
+        }
+
+        if (bVerbose)
+            fputs(", stream: ", stderr);
+
+        DWORD dwBytesRead;
+        if (!BackupRead(hFile, Buffer, HEADER_SIZE, &dwBytesRead, FALSE,
+            bProcessSecurity, &lpCtx) ||
+            ((dwBytesRead > 0) &&
+            !BackupReadBlock(hFile,
+                Buffer + dwBytesRead,
+                HEADER_SIZE - dwBytesRead,
+                &lpCtx)) ||
+            ((dwBytesRead > 0) &&
+            (header->dwStreamNameSize > dwBufferSize - HEADER_SIZE)) ||
+            ((dwBytesRead > 0) &&
+            !BackupReadBlock(hFile,
+                Buffer + HEADER_SIZE,
+                header->dwStreamNameSize,
+                &lpCtx)))
+        {
+            WErrMsgA errmsg;
+            oem_printf(stderr,
+                "strarc: Cannot read '%1!wZ!': %2%%n",
+                File, errmsg);
+
+            BackupRead(NULL, NULL, 0, NULL, TRUE, FALSE, &lpCtx);
+            return false;
+        }
+
+        if (dwBytesRead == 0)
+        {
+            BackupRead(NULL, NULL, 0, NULL, TRUE, FALSE, &lpCtx);
+            ++FileCounter;
+
+            if (bVerbose)
+                fputs("EOF\r\n", stderr);
+
+            return true;
+        }
+
+        if (Statistics != NULL)
+            Statistics->AddStream(header->dwStreamId, header->Size.QuadPart);
+
+        // Unnamed data streams of files that are also found in base archive
+        // are stored as differences against data in base archive.
+        BaseArchiveItem *base_file;
+        if ((BaseArchiveIndex != NULL) &&
+            (header->dwStreamId == BACKUP_DATA) &&
+            (header->dwStreamAttributes == STREAM_NORMAL_ATTRIBUTE) &&
+            (header->dwStreamNameSize == 0) &&
+            (header->Size.QuadPart >= DELTA_MIN_FILE_SIZE) &&
+            ((base_file = FindBaseArchiveFile(File)) != NULL))
+        {
+            if (!ReadDataStreamAsDelta(File, hFile, &lpCtx, base_file))
+            {
+                BackupRead(NULL, NULL, 0, NULL, TRUE, FALSE, &lpCtx);
+                return false;
+            }
+
+            continue;
+        }
+
+        // Unnamed data streams that are not already stored as sparse blocks
+        // are searched for zero blocks.
+        if (bSparseZeroBlocks &&
+            (header->dwStreamId == BACKUP_DATA) &&
+            (header->dwStreamAttributes == STREAM_NORMAL_ATTRIBUTE) &&
+            (header->dwStreamNameSize == 0) &&
+            (header->Size.QuadPart > 0))
+        {
+            if (!ReadDataStreamAsSparseBlocks(File, hFile, &lpCtx))
+            {
+                BackupRead(NULL, NULL, 0, NULL, TRUE, FALSE, &lpCtx);
+                return false;
+            }
+
+            continue;
+        }
+
+        // Security descriptors are stored once in the archive in dictionary
+        // entries. Later files with the same descriptor only get a reference
+        // to the entry.
+        if (bSecurityDictionary &&
+            (header->dwStreamId == BACKUP_SECURITY_DATA) &&
+            (header->dwStreamNameSize == 0) &&
+            (header->Size.QuadPart <=
+                (LONGLONG)(dwBufferSize - HEADER_SIZE - sizeof(DWORD))))
+        {
+            LPBYTE descriptor = Buffer + HEADER_SIZE + sizeof(DWORD);
+            DWORD dwDescriptorSize = header->Size.LowPart;
+
+            if (!BackupReadBlock(hFile,
+                descriptor,
+                dwDescriptorSize,
+                &lpCtx))
+            {
+                WErrMsgA errmsg;
+                oem_printf(stderr,
+                    "strarc: Cannot read '%1!wZ!': %2%%n",
+                    File, errmsg);
+
+                BackupRead(NULL, NULL, 0, NULL, TRUE, FALSE, &lpCtx);
+                return false;
+            }
+
+            bool bAdded;
+            SecurityDictionaryItem *item =
+                MatchSecurityDescriptor(descriptor,
+                    dwDescriptorSize,
+                    &bAdded);
+
+            *(LPDWORD)(Buffer + HEADER_SIZE) = item->GetId();
+
+            if (bAdded)
+            {
+                header->dwStreamAttributes = STRARC_MAGIC_SECURITY_ENTRY;
+                header->Size.QuadPart = sizeof(DWORD) + dwDescriptorSize;
+            }
+            else
+            {
+                header->dwStreamAttributes = STRARC_MAGIC_SECURITY_REFERENCE;
+                header->Size.QuadPart = sizeof(DWORD);
+            }
+
+            if (bVerbose)
+                fprintf(stderr, "%u bytes, security %s %u",
+                    HEADER_SIZE + header->Size.LowPart,
+                    bAdded ? "entry" : "reference",
+                    item->GetId());
+
+            WriteArchive(Buffer, HEADER_SIZE + header->Size.LowPart);
+
+            continue;
+        }
+
+        DWORD dwBlockSize = HEADER_SIZE + header->dwStreamNameSize;
+        LARGE_INTEGER BytesToRead = header->Size;
+
+        for (;;)
+        {
+            DWORD dwDataSize =
+                BytesToRead.QuadPart > (LONGLONG)(dwBufferSize - dwBlockSize) ?
+                dwBufferSize - dwBlockSize : BytesToRead.LowPart;
+
+            if (!BackupReadBlock(hFile,
+                Buffer + dwBlockSize,
+                dwDataSize,
+                &lpCtx))
+            {
+                WErrMsgA errmsg;
+                oem_printf(stderr,
+                    "strarc: Cannot read '%1!wZ!': %2%%n",
+                    File, errmsg);
+
+                BackupRead(NULL, NULL, 0, NULL, TRUE, FALSE, &lpCtx);
+                return false;
+            }
+
+            dwBlockSize += dwDataSize;
+            BytesToRead.QuadPart -= dwDataSize;
+
+            if (bVerbose)
+                fprintf(stderr, "%u bytes", dwBlockSize);
+
+            WriteArchive(Buffer, dwBlockSize);
+
+            if (BytesToRead.QuadPart == 0)
+                break;
+
+            YieldSingleProcessor();
+
+            if (bCancel)
+            {
+                BackupRead(NULL, NULL, 0, NULL, TRUE, FALSE, &lpCtx);
+                return false;
+            }
+
+            dwBlockSize = 0;
+        }
+    }
+}
+
 // This function backs up an object (file or directory) to the archive stream.
 
 bool
 StrArc::ReadFileStreamsToArchive(PUNICODE_STRING File,
 HANDLE hFile)
 {
+    // Bytes per stream type are only counted when reading one stream at a
+    // time.
+    if (bSparseZeroBlocks || bSecurityDictionary ||
+        (BaseArchiveIndex != NULL) || (Statistics != NULL))
+        return ReadFileStreamsToArchiveByStream(File, hFile);
+
     LPVOID lpCtx = NULL;
     for (;;)
     {
@@ -50,6 +438,8 @@ HANDLE hFile)
         if (bVerbose)
             fputs(", stream: ", stderr);
 
+        LONGLONG PerfStartTicks = PerfStart();
+
         DWORD dwBytesRead;
         if (!BackupRead(hFile, Buffer, dwBufferSize, &dwBytesRead, FALSE,
             bProcessSecurity, &lpCtx))
@@ -61,6 +451,8 @@ HANDLE hFile)
             return false;
         }
 
+        PerfEnd(PERF_PHASE_BACKUP_READ, PerfStartTicks, dwBytesRead);
+
         if (dwBytesRead == 0)
         {
             BackupRead(NULL, NULL, 0, NULL, TRUE, FALSE, &lpCtx);
@@ -79,16 +471,88 @@ HANDLE hFile)
     }
 }
 
+// This function returns a handle to the directory at the relative path Path,
+// for looking up short names of files in that directory. The handle is kept
+// open and returned again as long as following calls are for the same
+// directory. Callers must not close the returned handle, it is closed by
+// CloseParentDirectory().
+HANDLE
+StrArc::OpenParentDirectory(PUNICODE_STRING Path)
+{
+    if ((hParentDir != NULL) &&
+        RtlEqualUnicodeString(Path, &ParentDirPath, FALSE))
+        return hParentDir;
+
+    CloseParentDirectory();
+
+    HANDLE hDir =
+        NativeOpenFile(RootDirectory,
+            Path,
+            FILE_LIST_DIRECTORY,
+            0,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            FILE_OPEN_FOR_BACKUP_INTENT);
+
+    if (hDir == INVALID_HANDLE_VALUE)
+        return hDir;
+
+    RtlCopyUnicodeString(&ParentDirPath, Path);
+    hParentDir = hDir;
+
+    return hDir;
+}
+
 // File is the complete relative path from current directory to the object
 // to backup. ShortName is the alternate short 8.3 name to store in the backup
 // stream header. If no short name should be stored for this file, set this
 // parameter to an empty string, L"". If the short name should be stored but is
 // not known when calling this function, set this parameter to NULL.
+// If ParentDirectory is not NULL, it is an open handle to the directory where
+// the object is located and EntryName is the name of the object within that
+// directory. The object is then opened relative to that handle instead of
+// resolving the complete path again. File is still the name stored in the
+// archive.
+// KnownInfo can point to file information already known from a directory
+// listing. In that case, include/exclude filtering is done before the object
+// is opened, and the object is only queried for its number of links when
+// hard links are tracked.
 bool
 StrArc::BackupFile(PUNICODE_STRING File,
     PUNICODE_STRING ShortName,
-    bool bTraverseDirectories)
+    bool bTraverseDirectories,
+    HANDLE ParentDirectory,
+    PUNICODE_STRING EntryName,
+    const BY_HANDLE_FILE_INFORMATION *KnownInfo)
 {
+    PerfTimer timer(Statistics, PERF_PHASE_FILE, File);
+
+    HANDLE OpenRoot = RootDirectory;
+    PUNICODE_STRING OpenName = File;
+
+    if (ParentDirectory != NULL)
+    {
+        OpenRoot = ParentDirectory;
+        OpenName = EntryName;
+    }
+
+    BY_HANDLE_FILE_INFORMATION file_info;
+    bool bExcludeThis;
+    bool bIncludeThis;
+
+    if (KnownInfo != NULL)
+    {
+        file_info = *KnownInfo;
+
+        ExcludedString(File, &file_info, &bExcludeThis, &bIncludeThis);
+
+        // Directories that are not included are still opened to find
+        // included objects within them.
+        if (bExcludeThis ||
+            (!bIncludeThis &&
+            !(file_info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)))
+            return true;
+    }
+
     // This could be a directory. In that case, we do not want to skip it just
     // because it does not match any of the -i strings, but still skip if it
     // matches any of the -e strings. This is to find files and directories in
@@ -105,9 +569,11 @@ StrArc::BackupFile(PUNICODE_STRING File,
         (BackupMethod == BACKUP_METHOD_INC))
         file_access |= FILE_WRITE_ATTRIBUTES;
 
+    LONGLONG PerfStartTicks = PerfStart();
+
     HANDLE hFile =
-        NativeOpenFile(RootDirectory,
-            File,
+        NativeOpenFile(OpenRoot,
+            OpenName,
             file_access,
             0,
             FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
@@ -119,8 +585,8 @@ StrArc::BackupFile(PUNICODE_STRING File,
         (GetLastError() == ERROR_INVALID_PARAMETER))
     {
         hFile =
-            NativeOpenFile(RootDirectory,
-                File,
+            NativeOpenFile(OpenRoot,
+                OpenName,
                 file_access,
                 0,
                 FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
@@ -128,6 +594,8 @@ StrArc::BackupFile(PUNICODE_STRING File,
                 FILE_SEQUENTIAL_ONLY);
     }
 
+    PerfEnd(PERF_PHASE_OPEN, PerfStartTicks);
+
     if (hFile == INVALID_HANDLE_VALUE)
     {
         WErrMsgA errmsg;
@@ -137,24 +605,60 @@ StrArc::BackupFile(PUNICODE_STRING File,
         return false;
     }
 
-    BY_HANDLE_FILE_INFORMATION file_info;
-    if (!GetFileInformationByHandle(hFile, &file_info))
+    if (KnownInfo == NULL)
     {
-        WErrMsgA errmsg;
-        oem_printf(stderr,
-            "strarc: Cannot get file information for '%1!wZ!': %2%%n",
-            File, errmsg);
-        NtClose(hFile);
-        return false;
-    }
+        PerfStartTicks = PerfStart();
 
-    bool bExcludeThis;
-    bool bIncludeThis;
-    ExcludedString(File, &file_info, &bExcludeThis, &bIncludeThis);
-    if (bExcludeThis)
+        BOOL bInfoResult = GetFileInformationByHandle(hFile, &file_info);
+
+        PerfEnd(PERF_PHASE_QUERY, PerfStartTicks);
+
+        if (!bInfoResult)
+        {
+            WErrMsgA errmsg;
+            oem_printf(stderr,
+                "strarc: Cannot get file information for '%1!wZ!': %2%%n",
+                File, errmsg);
+            NtClose(hFile);
+            return false;
+        }
+
+        ExcludedString(File, &file_info, &bExcludeThis, &bIncludeThis);
+        if (bExcludeThis)
+        {
+            NtClose(hFile);
+            return true;
+        }
+    }
+    else if (bHardLinkSupport &&
+        !(file_info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
     {
-        NtClose(hFile);
-        return true;
+        // Number of links is not part of directory listings.
+        IO_STATUS_BLOCK io_status;
+        FILE_STANDARD_INFORMATION standard_info;
+
+        PerfStartTicks = PerfStart();
+
+        NTSTATUS status =
+            NtQueryInformationFile(hFile,
+                &io_status,
+                &standard_info,
+                sizeof(standard_info),
+                FileStandardInformation);
+
+        PerfEnd(PERF_PHASE_QUERY, PerfStartTicks);
+
+        if (!NT_SUCCESS(status))
+        {
+            WErrMsgA errmsg(RtlNtStatusToDosError(status));
+            oem_printf(stderr,
+                "strarc: Cannot get file information for '%1!wZ!': %2%%n",
+                File, errmsg);
+            NtClose(hFile);
+            return false;
+        }
+
+        file_info.nNumberOfLinks = standard_info.NumberOfLinks;
     }
 
     if (bTraverseDirectories &&
@@ -167,8 +671,8 @@ StrArc::BackupFile(PUNICODE_STRING File,
             NtClose(hFile);
 
             hFile =
-                NativeOpenFile(RootDirectory,
-                    File,
+                NativeOpenFile(OpenRoot,
+                    OpenName,
                     GENERIC_READ,
                     0,
                     FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
@@ -180,8 +684,8 @@ StrArc::BackupFile(PUNICODE_STRING File,
                 (GetLastError() == ERROR_INVALID_PARAMETER))
             {
                 hFile =
-                    NativeOpenFile(RootDirectory,
-                        File,
+                    NativeOpenFile(OpenRoot,
+                        OpenName,
                         GENERIC_READ,
                         0,
                         FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
@@ -241,29 +745,7 @@ StrArc::BackupFile(PUNICODE_STRING File,
     }
 
     if (bListFiles)
-    {
-        OEM_STRING oem_file_name;
-        NTSTATUS status =
-            RtlUnicodeStringToOemString(&oem_file_name,
-            File,
-            TRUE);
-
-        if (NT_SUCCESS(status))
-        {
-            DWORD dwIO;
-            WriteFile(GetStdHandle(STD_OUTPUT_HANDLE),
-                oem_file_name.Buffer,
-                oem_file_name.Length,
-                &dwIO,
-                NULL);
-            WriteFile(GetStdHandle(STD_OUTPUT_HANDLE),
-                "\r\n",
-                2,
-                &dwIO,
-                NULL);
-            RtlFreeOemString(&oem_file_name);
-        }
-    }
+        ListFileName(File);
 
     if (bListOnly)
     {
@@ -289,17 +771,60 @@ StrArc::BackupFile(PUNICODE_STRING File,
     }
 
     header->dwStreamId = BACKUP_INVALID;
-    header->dwStreamAttributes = STRARC_MAGIC;
     header->Size.QuadPart = sizeof BY_HANDLE_FILE_INFORMATION;
-    header->dwStreamNameSize = File->Length;
-    memcpy(header->cStreamName, File->Buffer, header->dwStreamNameSize);
-    *(PBY_HANDLE_FILE_INFORMATION)
-        (Buffer + HEADER_SIZE + header->dwStreamNameSize) = file_info;
+
+    LPBYTE header_data;
+
+    if (bFrontCodedPaths)
+    {
+        // Only store the part of the path that differs from the path in
+        // previous file header, except for a complete path now and then.
+        USHORT shared_length = 0;
+
+        if ((dwFrontCodedHeaderCount++ % FRONT_CODED_RESTART_INTERVAL) != 0)
+        {
+            USHORT max_length = (File->Length < LastHeaderPath.Length ?
+                File->Length : LastHeaderPath.Length) >> 1;
+
+            while ((shared_length < max_length) &&
+                (File->Buffer[shared_length] ==
+                    LastHeaderPath.Buffer[shared_length]))
+                ++shared_length;
+
+            shared_length <<= 1;
+        }
+
+        header->dwStreamAttributes = STRARC_MAGIC_FRONT_CODED;
+        header->Size.QuadPart += sizeof(DWORD);
+        header->dwStreamNameSize = File->Length - shared_length;
+        memcpy(header->cStreamName,
+            (LPBYTE)File->Buffer + shared_length,
+            header->dwStreamNameSize);
+        *(LPDWORD)(Buffer + HEADER_SIZE + header->dwStreamNameSize) =
+            shared_length;
+
+        header_data =
+            Buffer + HEADER_SIZE + header->dwStreamNameSize + sizeof(DWORD);
+
+        memcpy((LPBYTE)LastHeaderPath.Buffer + shared_length,
+            (LPBYTE)File->Buffer + shared_length,
+            header->dwStreamNameSize);
+        LastHeaderPath.Length = File->Length;
+    }
+    else
+    {
+        header->dwStreamAttributes = STRARC_MAGIC;
+        header->dwStreamNameSize = File->Length;
+        memcpy(header->cStreamName, File->Buffer, header->dwStreamNameSize);
+
+        header_data = Buffer + HEADER_SIZE + header->dwStreamNameSize;
+    }
+
+    *(PBY_HANDLE_FILE_INFORMATION)header_data = file_info;
 
     // Save without archive attribute in archive, unless COPY mode.
     if (BackupMethod != BACKUP_METHOD_COPY)
-        ((PBY_HANDLE_FILE_INFORMATION)
-        (Buffer + HEADER_SIZE + header->dwStreamNameSize))->
+        ((PBY_HANDLE_FILE_INFORMATION)header_data)->
         dwFileAttributes &= ~FILE_ATTRIBUTE_ARCHIVE;
 
     if (ShortName == NULL)
@@ -308,13 +833,7 @@ StrArc::BackupFile(PUNICODE_STRING File,
         UNICODE_STRING file_part;
         SplitPath(File, &parent_dir, &file_part);
 
-        HANDLE hParentDir =
-            NativeOpenFile(RootDirectory,
-            &parent_dir,
-            FILE_LIST_DIRECTORY,
-            0,
-            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
-            FILE_OPEN_FOR_BACKUP_INTENT);
+        HANDLE hParentDir = OpenParentDirectory(&parent_dir);
 
         if (hParentDir != INVALID_HANDLE_VALUE)
         {
@@ -324,8 +843,7 @@ StrArc::BackupFile(PUNICODE_STRING File,
                 header->Size.QuadPart += 26;
 
                 LPSTR shortname = (LPSTR)
-                    (Buffer + HEADER_SIZE + header->dwStreamNameSize +
-                        sizeof BY_HANDLE_FILE_INFORMATION);
+                    (header_data + sizeof BY_HANDLE_FILE_INFORMATION);
 
                 memset(shortname, 0, 26);
                 memcpy(shortname,
@@ -338,8 +856,6 @@ StrArc::BackupFile(PUNICODE_STRING File,
                         finddata.Base.ShortNameLength >> 1,
                         finddata.Base.ShortName);
             }
-
-            NtClose(hParentDir);
         }
     }
     else if ((ShortName != NULL) ? (ShortName->Length > 0) : false)
@@ -347,8 +863,7 @@ StrArc::BackupFile(PUNICODE_STRING File,
         header->Size.QuadPart += 26;
 
         LPSTR shortname = (LPSTR)
-            (Buffer + HEADER_SIZE + header->dwStreamNameSize +
-            sizeof BY_HANDLE_FILE_INFORMATION);
+            (header_data + sizeof BY_HANDLE_FILE_INFORMATION);
 
         memset(shortname, 0, 26);
         memcpy(shortname, ShortName->Buffer, ShortName->Length);
@@ -405,23 +920,347 @@ StrArc::BackupFile(PUNICODE_STRING File,
     if (bResult &&
         (BackupMethod == BACKUP_METHOD_FULL ||
             BackupMethod == BACKUP_METHOD_INC) &&
-            (file_info.dwFileAttributes & FILE_ATTRIBUTE_ARCHIVE) != 0 &&
-        !NativeSetFileAttributes(hFile,
-            file_info.dwFileAttributes &
-            ~FILE_ATTRIBUTE_ARCHIVE))
+            (file_info.dwFileAttributes & FILE_ATTRIBUTE_ARCHIVE) != 0)
     {
-        WErrMsgA errmsg;
-        oem_printf(stderr,
-            "strarc: Error resetting archive attribute on "
-            "%1!wZ!: %2%%n",
-            File, errmsg);
+        PerfStartTicks = PerfStart();
+
+        BOOL bAttributesReset = NativeSetFileAttributes(hFile,
+            file_info.dwFileAttributes &
+            ~FILE_ATTRIBUTE_ARCHIVE);
+
+        PerfEnd(PERF_PHASE_SET_ATTRIBUTES, PerfStartTicks);
+
+        if (!bAttributesReset)
+        {
+            WErrMsgA errmsg;
+            oem_printf(stderr,
+                "strarc: Error resetting archive attribute on "
+                "%1!wZ!: %2%%n",
+                File, errmsg);
+        }
     }
 
+    PerfStartTicks = PerfStart();
+
     NtClose(hFile);
 
+    PerfEnd(PERF_PHASE_CLOSE, PerfStartTicks);
+
     return bResult;
 }
 
+// This class collects directory listing entries when files in a directory
+// are to be backed up in another order than the directory order. Entries are
+// copied to one growing buffer and sorted by a key, for instance file id or
+// physical location on disk.
+class SortedDirectoryEntries
+{
+    struct SortItem
+    {
+        LONGLONG SortKey;
+        LONGLONG FileId;
+        SIZE_T Offset;
+    };
+
+    LPBYTE lpEntries;
+    SIZE_T EntriesSize;
+    SIZE_T EntriesUsed;
+
+    SortItem *Items;
+    DWORD dwItemsCount;
+    DWORD dwItemsCapacity;
+
+    static int __cdecl
+        CompareItems(const void *Item1, const void *Item2)
+    {
+        const SortItem *item1 = (const SortItem *)Item1;
+        const SortItem *item2 = (const SortItem *)Item2;
+
+        if (item1->SortKey != item2->SortKey)
+            return item1->SortKey < item2->SortKey ? -1 : 1;
+
+        if (item1->FileId != item2->FileId)
+            return item1->FileId < item2->FileId ? -1 : 1;
+
+        return 0;
+    }
+
+public:
+
+    SortedDirectoryEntries() :
+        lpEntries(NULL),
+        EntriesSize(0),
+        EntriesUsed(0),
+        Items(NULL),
+        dwItemsCount(0),
+        dwItemsCapacity(0)
+    {
+    }
+
+    ~SortedDirectoryEntries()
+    {
+        if (lpEntries != NULL)
+            LocalFree(lpEntries);
+
+        if (Items != NULL)
+            LocalFree(Items);
+    }
+
+    // Adds a copy of an entry. Returns false if there is not enough memory.
+    bool
+        Add(PFILE_ID_BOTH_DIR_INFORMATION Entry, LONGLONG SortKey)
+    {
+        SIZE_T entry_size = (FIELD_OFFSET(FILE_ID_BOTH_DIR_INFORMATION,
+            FileName) + Entry->FileNameLength + 7) & ~(SIZE_T)7;
+
+        if (EntriesUsed + entry_size > EntriesSize)
+        {
+            SIZE_T new_size = EntriesSize == 0 ?
+                DIRECTORY_LIST_BUFFER_SIZE : EntriesSize << 1;
+
+            while (EntriesUsed + entry_size > new_size)
+                new_size <<= 1;
+
+            LPBYTE new_entries = (LPBYTE)(lpEntries == NULL ?
+                LocalAlloc(LMEM_FIXED, new_size) :
+                LocalReAlloc(lpEntries, new_size, LMEM_MOVEABLE));
+
+            if (new_entries == NULL)
+                return false;
+
+            lpEntries = new_entries;
+            EntriesSize = new_size;
+        }
+
+        if (dwItemsCount == dwItemsCapacity)
+        {
+            DWORD new_capacity = dwItemsCapacity == 0 ?
+                256 : dwItemsCapacity << 1;
+
+            SortItem *new_items = (SortItem *)(Items == NULL ?
+                LocalAlloc(LMEM_FIXED, new_capacity * sizeof(SortItem)) :
+                LocalReAlloc(Items, new_capacity * sizeof(SortItem),
+                    LMEM_MOVEABLE));
+
+            if (new_items == NULL)
+                return false;
+
+            Items = new_items;
+            dwItemsCapacity = new_capacity;
+        }
+
+        memcpy(lpEntries + EntriesUsed,
+            Entry,
+            FIELD_OFFSET(FILE_ID_BOTH_DIR_INFORMATION, FileName) +
+            Entry->FileNameLength);
+
+        Items[dwItemsCount].SortKey = SortKey;
+        Items[dwItemsCount].FileId = Entry->FileId.QuadPart;
+        Items[dwItemsCount].Offset = EntriesUsed;
+        ++dwItemsCount;
+
+        EntriesUsed += entry_size;
+
+        return true;
+    }
+
+    void
+        Sort()
+    {
+        if (dwItemsCount > 1)
+            qsort(Items, dwItemsCount, sizeof(SortItem), CompareItems);
+    }
+
+    DWORD
+        Count() const
+    {
+        return dwItemsCount;
+    }
+
+    PFILE_ID_BOTH_DIR_INFORMATION
+        operator[](DWORD dwIndex) const
+    {
+        return (PFILE_ID_BOTH_DIR_INFORMATION)
+            (lpEntries + Items[dwIndex].Offset);
+    }
+};
+
+// Returns first logical cluster number of data in a file, or -1 if file has
+// no data outside of its file record, for instance small files on NTFS, or
+// if the location cannot be found.
+static LONGLONG
+GetFirstClusterNumber(HANDLE Directory, PUNICODE_STRING Name)
+{
+    HANDLE hFile = NativeOpenFile(Directory,
+        Name,
+        FILE_READ_ATTRIBUTES | SYNCHRONIZE,
+        0,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        FILE_OPEN_FOR_BACKUP_INTENT |
+        FILE_OPEN_REPARSE_POINT |
+        FILE_NON_DIRECTORY_FILE);
+
+    if (hFile == INVALID_HANDLE_VALUE)
+        return -1;
+
+    STARTING_VCN_INPUT_BUFFER starting_vcn = { 0 };
+    RETRIEVAL_POINTERS_BUFFER retrieval_pointers = { 0 };
+    DWORD dwBytesReturned;
+
+    // Only the first extent is needed, so ERROR_MORE_DATA is expected.
+    BOOL bResult = DeviceIoControl(hFile,
+        FSCTL_GET_RETRIEVAL_POINTERS,
+        &starting_vcn,
+        sizeof(starting_vcn),
+        &retrieval_pointers,
+        sizeof(retrieval_pointers),
+        &dwBytesReturned,
+        NULL);
+
+    if (!bResult && (GetLastError() != ERROR_MORE_DATA))
+        retrieval_pointers.ExtentCount = 0;
+
+    NtClose(hFile);
+
+    if (retrieval_pointers.ExtentCount == 0)
+        return -1;
+
+    return retrieval_pointers.Extents[0].Lcn.QuadPart;
+}
+
+// This function backs up one entry from a directory listing. Path is the
+// relative path of the directory, BasePath is the same path with a trailing
+// backslash, or empty if current directory, and Handle is a handle to the
+// directory.
+void
+StrArc::BackupDirectoryEntry(PUNICODE_STRING Path,
+    PUNICODE_STRING BasePath,
+    HANDLE Handle,
+    PFILE_ID_BOTH_DIR_INFORMATION Entry,
+    const FILE_FS_VOLUME_INFORMATION *VolumeInfo)
+{
+    if (Entry->FileNameLength > USHORT_MAX)
+    {
+        oem_printf(stderr,
+            "strarc: Path is too long: %1!wZ!",
+            Path);
+
+        oem_printf(stderr,
+            "\\%1!.*ws!%%n",
+            Entry->FileNameLength >> 1, Entry->FileName);
+
+        return;
+    }
+
+    UNICODE_STRING entry_name;
+    InitCountedUnicodeString(&entry_name,
+        Entry->FileName,
+        (USHORT)Entry->FileNameLength);
+
+    UNICODE_STRING name = *BasePath;
+
+    NTSTATUS status =
+        RtlAppendUnicodeStringToString(&name,
+            &entry_name);
+
+    if (!NT_SUCCESS(status))
+    {
+        oem_printf(stderr,
+            "strarc: Path is too long: %1!wZ!",
+            Path);
+
+        oem_printf(stderr,
+            "\\%1!.*ws!%%n",
+            Entry->FileNameLength >> 1, Entry->FileName);
+
+        return;
+    }
+
+    BY_HANDLE_FILE_INFORMATION file_info = { 0 };
+    file_info.dwFileAttributes = Entry->FileAttributes;
+    file_info.ftCreationTime =
+        *(LPFILETIME)&Entry->CreationTime;
+    file_info.ftLastAccessTime =
+        *(LPFILETIME)&Entry->LastAccessTime;
+    file_info.ftLastWriteTime =
+        *(LPFILETIME)&Entry->LastWriteTime;
+    file_info.nFileSizeHigh = Entry->EndOfFile.HighPart;
+    file_info.nFileSizeLow = Entry->EndOfFile.LowPart;
+    // Number of links is not part of directory listings. It is queried
+    // when the file is opened if hard links are tracked, otherwise 0 is
+    // stored as unknown.
+    file_info.nNumberOfLinks = 0;
+    file_info.nFileIndexHigh = Entry->FileId.HighPart;
+    file_info.nFileIndexLow = Entry->FileId.LowPart;
+
+    if (VolumeInfo != NULL)
+        file_info.dwVolumeSerialNumber = VolumeInfo->VolumeSerialNumber;
+
+    // Reparse points that are followed are opened and queried, because
+    // the listing returns information about the reparse point itself.
+    bool bKnownInfo = (VolumeInfo != NULL) &&
+        (bLocal ||
+        ((Entry->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0));
+
+    // In differential and incremental mode, files without archive
+    // attribute are skipped here using attributes from the directory
+    // listing, without opening them. Directories are always opened to
+    // be traversed.
+    if ((BackupMethod == BACKUP_METHOD_DIFF ||
+        BackupMethod == BACKUP_METHOD_INC) &&
+        ((Entry->FileAttributes &
+        (FILE_ATTRIBUTE_ARCHIVE | FILE_ATTRIBUTE_DIRECTORY)) == 0) &&
+        (bLocal ||
+        ((Entry->FileAttributes &
+            FILE_ATTRIBUTE_REPARSE_POINT) == 0)))
+    {
+        if (bVerbose)
+        {
+            bool bExcludeThis;
+            bool bIncludeThis;
+            ExcludedString(&name,
+                &file_info,
+                &bExcludeThis,
+                &bIncludeThis);
+
+            if (bIncludeThis && !bExcludeThis)
+                oem_printf(stderr,
+                    "%1!wZ!, attr=%2 (%3!#x!), not changed.%%n",
+                    &name,
+                    GetFileAttributesDescription(
+                        Entry->FileAttributes),
+                    Entry->FileAttributes);
+        }
+
+        return;
+    }
+
+    BYTE short_name_buffer[sizeof(Entry->ShortName)] = { 0 };
+    UNICODE_STRING short_name = { 0 };
+    short_name.MaximumLength = sizeof(short_name_buffer);
+    short_name.Buffer = (PWSTR)short_name_buffer;
+
+    if (!bSkipShortNames)
+    {
+        short_name.Length = Entry->ShortNameLength;
+        if (Entry->ShortNameLength > 0)
+        {
+            memcpy(short_name.Buffer,
+                Entry->ShortName,
+                Entry->ShortNameLength);
+        }
+    }
+
+    // The entry is opened relative to the directory handle, so that the
+    // complete path does not need to be parsed again for each entry.
+    BackupFile(&name,
+        &short_name,
+        true,
+        Handle,
+        &entry_name,
+        bKnownInfo ? &file_info : NULL);
+}
+
 void
 StrArc::BackupDirectory(PUNICODE_STRING Path, HANDLE Handle)
 {
@@ -443,97 +1282,132 @@ StrArc::BackupDirectory(PUNICODE_STRING Path, HANDLE Handle)
         }
     }
 
-    BYTE short_name_buffer[sizeof(finddata.Base.ShortName)] = { 0 };
-    UNICODE_STRING short_name = { 0 };
-    short_name.MaximumLength = sizeof(short_name_buffer);
-    short_name.Buffer = (PWSTR)short_name_buffer;
-
-    for (finddata.FindFirst(Handle);
-        ;
-        finddata.FindNext(Handle))
+    // All entries in the directory are on the same volume as the directory
+    // itself, so volume serial number is only queried once per directory.
+    IO_STATUS_BLOCK io_status;
+    FILE_FS_VOLUME_INFORMATION volume_info;
+    NTSTATUS status =
+        NtQueryVolumeInformationFile(Handle,
+            &io_status,
+            &volume_info,
+            sizeof(volume_info),
+            FileFsVolumeInformation);
+
+    const FILE_FS_VOLUME_INFORMATION *volume_info_ptr =
+        (NT_SUCCESS(status) || (status == STATUS_BUFFER_OVERFLOW)) ?
+        &volume_info : NULL;
+
+    // Entries are listed in large blocks, each with the information needed
+    // for the file header. This buffer is separate for each directory level,
+    // so entries stay valid while subdirectories are backed up.
+    WHeapMem<BYTE> dir_buffer(DIRECTORY_LIST_BUFFER_SIZE,
+        HEAP_GENERATE_EXCEPTIONS);
+
+    // With -p, entries are collected for the entire directory and then
+    // backed up in order of file id or location on disk.
+    SortedDirectoryEntries sorted_entries;
+
+    for (BOOLEAN restart_scan = TRUE; ; restart_scan = FALSE)
     {
-        YieldSingleProcessor();
+        LONGLONG PerfStartTicks = PerfStart();
 
-        if (!finddata)
-        {
-            DWORD dwLastError = finddata.GetLastWin32Error();
-            if (dwLastError == ERROR_NO_MORE_FILES)
-                break;
-            else
-            {
-                WErrMsgA errmsg(dwLastError);
-                oem_printf(stderr,
-                    "strarc: Error reading directory '%1!wZ!': %2%%n",
-                    Path, errmsg);
+        status = NtQueryDirectoryFile(Handle,
+            NULL,
+            NULL,
+            NULL,
+            &io_status,
+            dir_buffer,
+            (ULONG)dir_buffer.Count(),
+            FileIdBothDirectoryInformation,
+            FALSE,
+            NULL,
+            restart_scan);
 
-                return;
-            }
-        }
+        PerfEnd(PERF_PHASE_ENUMERATE, PerfStartTicks);
+
+        if (status == STATUS_NO_MORE_FILES)
+            break;
 
-        if ((finddata.Base.FileNameLength == 2 &&
-            finddata.FileName[0] == L'.') ||
-            (finddata.Base.FileNameLength == 4 &&
-                finddata.FileName[0] == L'.' &&
-                finddata.FileName[1] == L'.'))
+        if (!NT_SUCCESS(status))
         {
-            continue;
-        }
+            WErrMsgA errmsg(RtlNtStatusToDosError(status));
+            oem_printf(stderr,
+                "strarc: Error reading directory '%1!wZ!': %2%%n",
+                Path, errmsg);
 
-        if (bCancel)
             return;
+        }
 
-        if (finddata.Base.FileNameLength > USHORT_MAX)
-        {
-            oem_printf(stderr,
-                "strarc: Path is too long: %1!wZ!",
-                Path);
+        PFILE_ID_BOTH_DIR_INFORMATION next_entry =
+            (PFILE_ID_BOTH_DIR_INFORMATION)(LPBYTE)dir_buffer;
 
-            oem_printf(stderr,
-                "\\%1!.*ws!%%n",
-                finddata.Base.FileNameLength >> 1, finddata.FileName);
+        while (next_entry != NULL)
+        {
+            PFILE_ID_BOTH_DIR_INFORMATION entry = next_entry;
 
-            continue;
-        }
+            if (entry->NextEntryOffset != 0)
+                next_entry = (PFILE_ID_BOTH_DIR_INFORMATION)
+                ((LPBYTE)entry + entry->NextEntryOffset);
+            else
+                next_entry = NULL;
 
-        UNICODE_STRING entry_name;
-        InitCountedUnicodeString(&entry_name,
-            finddata.FileName,
-            (USHORT)finddata.Base.FileNameLength);
+            YieldSingleProcessor();
 
-        UNICODE_STRING name = base_path;
+            if ((entry->FileNameLength == 2 &&
+                entry->FileName[0] == L'.') ||
+                (entry->FileNameLength == 4 &&
+                    entry->FileName[0] == L'.' &&
+                    entry->FileName[1] == L'.'))
+            {
+                continue;
+            }
 
-        NTSTATUS status =
-            RtlAppendUnicodeStringToString(&name,
-            &entry_name);
+            if (bCancel)
+                return;
 
-        if (!NT_SUCCESS(status))
-        {
-            oem_printf(stderr,
-                "strarc: Path is too long: %1!wZ!",
-                Path);
+            if (ReadOrder == READ_ORDER_DIRECTORY)
+            {
+                BackupDirectoryEntry(Path,
+                    &base_path,
+                    Handle,
+                    entry,
+                    volume_info_ptr);
 
-            oem_printf(stderr,
-                "\\%1!.*ws!%%n",
-                finddata.Base.FileNameLength >> 1, finddata.FileName);
+                continue;
+            }
 
-            continue;
-        }
+            LONGLONG sort_key = 0;
 
-        if (bSkipShortNames)
-        {
-            short_name.Length = 0;
-        }
-        else
-        {
-            short_name.Length = finddata.Base.ShortNameLength;
-            if (finddata.Base.ShortNameLength > 0)
+            if ((ReadOrder == READ_ORDER_EXTENT) &&
+                !(entry->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+                (entry->FileNameLength <= USHORT_MAX))
             {
-                memcpy(short_name.Buffer,
-                    finddata.Base.ShortName,
-                    finddata.Base.ShortNameLength);
+                UNICODE_STRING entry_name;
+                InitCountedUnicodeString(&entry_name,
+                    entry->FileName,
+                    (USHORT)entry->FileNameLength);
+
+                sort_key = GetFirstClusterNumber(Handle, &entry_name);
             }
+
+            if (!sorted_entries.Add(entry, sort_key))
+                Exception(XE_NOT_ENOUGH_MEMORY);
         }
+    }
+
+    sorted_entries.Sort();
+
+    for (DWORD i = 0; i < sorted_entries.Count(); i++)
+    {
+        YieldSingleProcessor();
+
+        if (bCancel)
+            return;
 
-        BackupFile(&name, &short_name, true);
+        BackupDirectoryEntry(Path,
+            &base_path,
+            Handle,
+            sorted_entries[i],
+            volume_info_ptr);
     }
 }
@@ -44,6 +44,14 @@ const char *stream_ids[] = {
 
 char stream_id_unknown[12];
 
+const char *magic_ids[] = {
+    "STRARC_MAGIC",                    // 0xBAC00001 File header
+    "STRARC_MAGIC_SECURITY_ENTRY",     // 0xBAC00002 Security dictionary entry
+    "STRARC_MAGIC_SECURITY_REFERENCE", // 0xBAC00003 Security dictionary id
+    "STRARC_MAGIC_FRONT_CODED",        // 0xBAC00004 Front coded file header
+    "STRARC_MAGIC_DELTA_COPY"          // 0xBAC00005 Copy from base archive
+};
+
 LPCSTR
 GetStreamIdDescription(DWORD StreamId)
 {
@@ -58,6 +66,19 @@ GetStreamIdDescription(DWORD StreamId)
     return stream_ids[StreamId];
 }
 
+// Returns name of a strarc private stream magic in the Stream Attributes
+// field, or NULL if the value is not such a magic.
+LPCSTR
+GetStrArcMagicDescription(DWORD StreamAttributes)
+{
+    DWORD Index = StreamAttributes - 0xBAC00001;
+
+    if (Index >= (sizeof(magic_ids) / sizeof(*magic_ids)))
+        return NULL;
+
+    return magic_ids[Index];
+}
+
 const char *attrib_ids[] = {
     "STREAM_NORMAL_ATTRIBUTE", //         0x00000000
     "STREAM_MODIFIED_WHEN_READ", //       0x00000001
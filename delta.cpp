@@ -0,0 +1,876 @@
+/* Stream Archive I/O utility, Copyright (C) Olof Lagerkvist 2004-2022
+*
+* delta.cpp
+* Delta backup and restore against a base archive.
+*/
+
+#ifndef _UNICODE
+#define _UNICODE
+#endif
+#ifndef _DLL
+#define _DLL
+#endif
+#ifndef UNICODE
+#define UNICODE
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#define WIN32_NO_STATUS
+#include <windows.h>
+#include <intsafe.h>
+#include <wincrypt.h>
+#undef WIN32_NO_STATUS
+#include <ntdll.h>
+
+#include <winstrct.h>
+#include <wio.h>
+
+#include "strarc.hpp"
+
+// Signature of one block of file data in base archive. Signatures with same
+// hash slot are chained by index + 1 of next signature, zero ends the chain.
+struct DeltaBlockSignature
+{
+    DWORD dwWeak;
+    DWORD dwNext;
+    BYTE Strong[16];
+};
+
+// Weak checksum of a block of data, that can be moved forward one byte at a
+// time without reading the entire block again. This is the same kind of
+// checksum as used by rsync.
+class RollingChecksum
+{
+    DWORD a;
+    DWORD b;
+
+public:
+
+    void Init(LPCBYTE lpData, DWORD dwSize)
+    {
+        a = 0;
+        b = 0;
+
+        for (DWORD i = 0; i < dwSize; i++)
+        {
+            a += lpData[i];
+            b += (dwSize - i) * lpData[i];
+        }
+    }
+
+    void Roll(BYTE Out, BYTE In, DWORD dwSize)
+    {
+        a += In - Out;
+        b += a - dwSize * Out;
+    }
+
+    DWORD Get() const
+    {
+        return (a & 0xFFFF) | (b << 16);
+    }
+};
+
+// Calculates strong hash of a block of data, used to verify blocks with
+// matching weak checksums.
+static bool
+GetBlockHash(HCRYPTPROV hProv, LPCBYTE lpData, DWORD dwSize, LPBYTE lpHash)
+{
+    HCRYPTHASH hHash;
+    if (!CryptCreateHash(hProv, CALG_MD5, 0, 0, &hHash))
+        return false;
+
+    DWORD dwHashSize = 16;
+    bool bResult =
+        CryptHashData(hHash, lpData, dwSize, 0) &&
+        CryptGetHashParam(hHash, HP_HASHVAL, lpHash, &dwHashSize, 0);
+
+    CryptDestroyHash(hHash);
+
+    return bResult;
+}
+
+// Returns the hash slot for a weak checksum in a table of 2^dwBits slots.
+static DWORD
+GetBlockSlot(DWORD dwWeak, DWORD dwBits)
+{
+    return (dwWeak * 0x9E3779B1UL) >> (32 - dwBits);
+}
+
+// This function reads data from an archive disk file at specified position,
+// such as a base archive or an archive being merged. It returns number of
+// bytes actually read, which is less than requested only at end of archive.
+DWORD
+StrArc::ReadArchiveAt(HANDLE hFile,
+    LONGLONG Offset,
+    LPBYTE lpBuf,
+    DWORD dwSize)
+{
+    PerfTimer timer(Statistics, PERF_PHASE_ARCHIVE_READ);
+
+    DWORD dwTotalBytes = 0;
+
+    while (dwSize > 0)
+    {
+        OVERLAPPED overlapped = { 0 };
+        overlapped.Offset = (DWORD)Offset;
+        overlapped.OffsetHigh = (DWORD)(Offset >> 32);
+
+        DWORD dwBytesRead;
+        if (!ReadFile(hFile, lpBuf, dwSize, &dwBytesRead, &overlapped))
+            if (GetLastError() == ERROR_HANDLE_EOF)
+                dwBytesRead = 0;
+            else
+                Exception(XE_ARCHIVE_IO);
+
+        if (dwBytesRead == 0)
+            break;
+
+        Offset += dwBytesRead;
+        dwTotalBytes += dwBytesRead;
+        dwSize -= dwBytesRead;
+        lpBuf += dwBytesRead;
+    }
+
+    timer.SetBytes(dwTotalBytes);
+
+    return dwTotalBytes;
+}
+
+// This function adds a file found in base archive to the index, if its data
+// can be used as base for delta streams. Otherwise the item is deleted.
+static bool
+AddBaseArchiveFile(BaseArchiveItem **Index,
+    DWORD dwSlot,
+    BaseArchiveItem *Item,
+    bool bUsable)
+{
+    if (!bUsable || (Item->GetDataSize() < DELTA_MIN_FILE_SIZE))
+    {
+        Item->DeleteAndGetNext();
+        return false;
+    }
+
+    Item->SetNext(Index[dwSlot]);
+    Index[dwSlot] = Item;
+
+    return true;
+}
+
+// This function opens a base archive for delta streams and finds locations
+// of unnamed data streams for all files in it large enough to be stored as
+// delta streams. Only headers are read, stream data is skipped. Data stored
+// as sparse blocks is indexed as one extent for each block. Files stored as
+// delta streams in the base archive itself are not indexed, because their
+// data is partly in yet another archive.
+bool
+StrArc::OpenBaseArchive(LPCWSTR wczBaseArchive)
+{
+    hBaseArchive = CreateFile(wczBaseArchive,
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_FLAG_BACKUP_SEMANTICS,
+        NULL);
+
+    if (hBaseArchive == INVALID_HANDLE_VALUE)
+    {
+        hBaseArchive = NULL;
+        return false;
+    }
+
+    if (GetFileType(hBaseArchive) != FILE_TYPE_DISK)
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return false;
+    }
+
+    BaseArchiveIndex = (BaseArchiveItem **)
+        LocalAlloc(LPTR, sizeof(*BaseArchiveIndex) * BASE_ARCHIVE_INDEX_SIZE);
+
+    if (BaseArchiveIndex == NULL)
+        Exception(XE_NOT_ENOUGH_MEMORY);
+
+    if (bVerbose)
+        oem_printf(stderr, "Reading base archive '%1!ws!'...%%n",
+            wczBaseArchive);
+
+    WHeapMem<BYTE> header_buffer(HEADER_SIZE + 65536 + sizeof(DWORD) +
+        sizeof(BY_HANDLE_FILE_INFORMATION) + 26,
+        HEAP_GENERATE_EXCEPTIONS);
+
+    WHeapMem<BYTE> path_buffer(USHORT_MAX + 1, HEAP_GENERATE_EXCEPTIONS);
+
+    LPWIN32_STREAM_ID stream_header = (LPWIN32_STREAM_ID)
+        (LPBYTE)header_buffer;
+
+    UNICODE_STRING path;
+    path.Buffer = (PWSTR)(LPBYTE)path_buffer;
+    path.Length = 0;
+    path.MaximumLength = USHORT_MAX;
+
+    LONGLONG Position = 0;
+    LONGLONG IndexedFiles = 0;
+
+    // Data of current file is collected in an item that is added to the
+    // index at next file header, when all its streams have been seen.
+    BaseArchiveItem *CurrentItem = NULL;
+    DWORD dwCurrentSlot = 0;
+    bool bCurrentUsable = false;
+
+    while (ReadBaseArchive(Position, header_buffer, HEADER_SIZE) ==
+        HEADER_SIZE)
+    {
+        YieldSingleProcessor();
+
+        if (bCancel)
+        {
+            if (CurrentItem != NULL)
+                CurrentItem->DeleteAndGetNext();
+
+            return false;
+        }
+
+        Position += HEADER_SIZE;
+
+        if (IsValidFileHeader(stream_header))
+        {
+            if ((CurrentItem != NULL) &&
+                AddBaseArchiveFile(BaseArchiveIndex, dwCurrentSlot,
+                    CurrentItem, bCurrentUsable))
+                ++IndexedFiles;
+
+            CurrentItem = NULL;
+            bCurrentUsable = false;
+
+            DWORD dwBytesToRead =
+                stream_header->dwStreamNameSize +
+                stream_header->Size.LowPart;
+
+            if (ReadBaseArchive(Position,
+                header_buffer + HEADER_SIZE,
+                dwBytesToRead) != dwBytesToRead)
+                break;
+
+            Position += dwBytesToRead;
+
+            DWORD dwSharedLength = 0;
+
+            if (stream_header->dwStreamAttributes ==
+                STRARC_MAGIC_FRONT_CODED)
+                dwSharedLength = *(LPDWORD)(header_buffer + HEADER_SIZE +
+                    stream_header->dwStreamNameSize);
+
+            if ((dwSharedLength > path.Length) ||
+                (dwSharedLength + stream_header->dwStreamNameSize >
+                    USHORT_MAX))
+            {
+                path.Length = 0;
+                continue;
+            }
+
+            memcpy((LPBYTE)path.Buffer + dwSharedLength,
+                stream_header->cStreamName,
+                stream_header->dwStreamNameSize);
+            path.Length = (USHORT)
+                (dwSharedLength + stream_header->dwStreamNameSize);
+
+            bCurrentUsable = path.Length > 0;
+
+            continue;
+        }
+
+        if (stream_header->dwStreamNameSize > 65535)
+        {
+            oem_printf(stderr,
+                "strarc: Bad stream header in base archive '%1!ws!', "
+                "only files before it can be used as base for delta "
+                "streams.%%n",
+                wczBaseArchive);
+
+            bCurrentUsable = false;
+
+            break;
+        }
+
+        LONGLONG FileOffset = -1;
+        LONGLONG DataOffset = Position;
+        LONGLONG DataSize = stream_header->Size.QuadPart;
+
+        if ((stream_header->dwStreamId == BACKUP_DATA) &&
+            (stream_header->dwStreamAttributes == STREAM_NORMAL_ATTRIBUTE) &&
+            (stream_header->dwStreamNameSize == 0))
+            FileOffset = 0;
+        else if ((stream_header->dwStreamId == BACKUP_SPARSE_BLOCK) &&
+            (stream_header->dwStreamAttributes == STREAM_SPARSE_ATTRIBUTE) &&
+            (stream_header->dwStreamNameSize == 0) &&
+            (DataSize >= sizeof(LARGE_INTEGER)) &&
+            bCurrentUsable)
+        {
+            LARGE_INTEGER StartPosition;
+
+            if (ReadBaseArchive(Position, (LPBYTE)&StartPosition,
+                sizeof StartPosition) != sizeof StartPosition)
+                break;
+
+            FileOffset = StartPosition.QuadPart;
+            DataOffset += sizeof(LARGE_INTEGER);
+            DataSize -= sizeof(LARGE_INTEGER);
+        }
+        else if ((stream_header->dwStreamId == BACKUP_INVALID) &&
+            (stream_header->dwStreamAttributes == STRARC_MAGIC_DELTA_COPY))
+            bCurrentUsable = false;
+
+        if ((FileOffset >= 0) && bCurrentUsable)
+        {
+            if (CurrentItem == NULL)
+            {
+                dwCurrentSlot = BaseArchiveItem::Hash(&path) &
+                    (BASE_ARCHIVE_INDEX_SIZE - 1);
+
+                CurrentItem = BaseArchiveItem::NewItem(NULL, &path);
+
+                if (CurrentItem == NULL)
+                    Exception(XE_NOT_ENOUGH_MEMORY);
+            }
+
+            // Extents out of order, or a second data stream, cannot be used.
+            if (!CurrentItem->AddExtent(FileOffset, DataOffset, DataSize))
+                bCurrentUsable = false;
+        }
+
+        Position += stream_header->dwStreamNameSize +
+            stream_header->Size.QuadPart;
+    }
+
+    if ((CurrentItem != NULL) &&
+        AddBaseArchiveFile(BaseArchiveIndex, dwCurrentSlot, CurrentItem,
+            bCurrentUsable))
+        ++IndexedFiles;
+
+    if (bVerbose)
+        fprintf(stderr, "%I64i files in base archive can be used as base for "
+            "delta streams.\n", IndexedFiles);
+
+    return true;
+}
+
+// This function reads file data from the extents of a file in base archive.
+// Data between extents reads as zeros, like holes in a sparse file. Returns
+// number of bytes read, which is less than requested if base archive is
+// truncated or if requested data ends after end of file data.
+DWORD
+StrArc::ReadBaseArchiveData(BaseArchiveItem *Base,
+    LONGLONG Offset,
+    LPBYTE lpBuf,
+    DWORD dwSize)
+{
+    if (Offset + dwSize > Base->GetDataSize())
+        dwSize = Offset < Base->GetDataSize() ?
+        (DWORD)(Base->GetDataSize() - Offset) : 0;
+
+    DWORD dwExtent = Base->FindExtent(Offset);
+    DWORD dwDone = 0;
+
+    while (dwDone < dwSize)
+    {
+        LONGLONG Position = Offset + dwDone;
+        DWORD dwChunk = dwSize - dwDone;
+
+        const BaseArchiveExtent *extent = Base->GetExtent(dwExtent);
+
+        if ((extent != NULL) && (extent->FileOffset <= Position))
+        {
+            LONGLONG ExtentEnd = extent->FileOffset + extent->Length;
+
+            if ((LONGLONG)dwChunk >= ExtentEnd - Position)
+            {
+                dwChunk = (DWORD)(ExtentEnd - Position);
+                ++dwExtent;
+            }
+
+            DWORD dwBytesRead = ReadBaseArchive(extent->ArchiveOffset +
+                Position - extent->FileOffset,
+                lpBuf + dwDone,
+                dwChunk);
+
+            dwDone += dwBytesRead;
+
+            if (dwBytesRead != dwChunk)
+                break;
+        }
+        else
+        {
+            LONGLONG HoleEnd = extent != NULL ?
+                extent->FileOffset : Base->GetDataSize();
+
+            if ((LONGLONG)dwChunk > HoleEnd - Position)
+                dwChunk = (DWORD)(HoleEnd - Position);
+
+            ZeroMemory(lpBuf + dwDone, dwChunk);
+            dwDone += dwChunk;
+        }
+    }
+
+    return dwDone;
+}
+
+// This function writes a block of file data that was not found in base
+// archive as a sparse block stream. The stream header is built in place
+// right before the data, so there must be room for HEADER_SIZE +
+// sizeof(LARGE_INTEGER) bytes before lpData that are not needed any longer.
+void
+StrArc::WriteDeltaLiteral(LONGLONG Offset,
+    LPBYTE lpData,
+    DWORD dwSize)
+{
+    if (dwSize == 0)
+        return;
+
+    LPWIN32_STREAM_ID record = (LPWIN32_STREAM_ID)
+        (lpData - HEADER_SIZE - sizeof(LARGE_INTEGER));
+
+    record->dwStreamId = BACKUP_SPARSE_BLOCK;
+    record->dwStreamAttributes = STREAM_SPARSE_ATTRIBUTE;
+    record->dwStreamNameSize = 0;
+    record->Size.QuadPart = sizeof(LARGE_INTEGER) + dwSize;
+    ((PLARGE_INTEGER)lpData)[-1].QuadPart = Offset;
+
+    WriteArchive((LPBYTE)record,
+        HEADER_SIZE + sizeof(LARGE_INTEGER) + dwSize);
+}
+
+// This function writes a copy stream for a range of data found in base
+// archive, if any, and then clears the range.
+void
+StrArc::WriteDeltaCopy(PSTRARC_DELTA_COPY Copy)
+{
+    if (Copy->Length.QuadPart == 0)
+        return;
+
+    // The copy structure follows the stream header directly, without the
+    // alignment padding a structure with both would get.
+    BYTE record[HEADER_SIZE + sizeof(STRARC_DELTA_COPY)];
+
+    LPWIN32_STREAM_ID record_header = (LPWIN32_STREAM_ID)record;
+
+    record_header->dwStreamId = BACKUP_INVALID;
+    record_header->dwStreamAttributes = STRARC_MAGIC_DELTA_COPY;
+    record_header->dwStreamNameSize = 0;
+    record_header->Size.QuadPart = sizeof(STRARC_DELTA_COPY);
+    memcpy(record + HEADER_SIZE, Copy, sizeof(STRARC_DELTA_COPY));
+
+    WriteArchive(record, sizeof record);
+
+    Copy->Length.QuadPart = 0;
+}
+
+// This function is called when the header of an unnamed data stream has just
+// been read from BackupRead into Buffer, for a file that also has data in
+// base archive. Signatures of blocks of DELTA_BLOCK_SIZE bytes in base data
+// are calculated first. The new data is then searched for blocks with the
+// same signatures, moving one byte at a time where no match is found. Blocks
+// found in base data are stored as copy streams and other data as sparse
+// block streams, in order of position in the file.
+bool
+StrArc::ReadDataStreamAsDelta(PUNICODE_STRING File,
+    HANDLE hFile,
+    LPVOID *lpCtx,
+    BaseArchiveItem *Base)
+{
+    const DWORD dwRecordHeaderSize = HEADER_SIZE + sizeof(LARGE_INTEGER);
+
+    LONGLONG BytesToRead = header->Size.QuadPart;
+    LONGLONG BaseSize = Base->GetDataSize();
+
+    HCRYPTPROV hProv = NULL;
+    if (!CryptAcquireContext(&hProv,
+        NULL,
+        NULL,
+        PROV_RSA_FULL,
+        CRYPT_VERIFYCONTEXT))
+    {
+        WErrMsgA errmsg;
+        oem_printf(stderr,
+            "strarc: Cannot calculate block signatures for '%1!wZ!': %2%%n",
+            File, errmsg);
+
+        hProv = NULL;
+    }
+
+    DWORD dwBlocks = hProv != NULL ?
+        (DWORD)(BaseSize / DELTA_BLOCK_SIZE) : 0;
+
+    DWORD dwSlotBits = 1;
+    while ((dwSlotBits < 31) && ((1UL << dwSlotBits) < dwBlocks))
+        ++dwSlotBits;
+
+    WHeapMem<DeltaBlockSignature> signature_buffer(
+        sizeof(DeltaBlockSignature) * (dwBlocks + 1),
+        HEAP_GENERATE_EXCEPTIONS);
+
+    WHeapMem<DWORD> slot_buffer(sizeof(DWORD) << dwSlotBits,
+        HEAP_GENERATE_EXCEPTIONS | HEAP_ZERO_MEMORY);
+
+    WHeapMem<BYTE> window_buffer(dwRecordHeaderSize + DELTA_WINDOW_SIZE,
+        HEAP_GENERATE_EXCEPTIONS);
+
+    DeltaBlockSignature *signatures = signature_buffer;
+    LPDWORD slots = slot_buffer;
+    LPBYTE window = window_buffer + dwRecordHeaderSize;
+
+    for (DWORD dwBlock = 0; dwBlock < dwBlocks; )
+    {
+        YieldSingleProcessor();
+
+        if (bCancel)
+        {
+            CryptReleaseContext(hProv, 0);
+            return false;
+        }
+
+        DWORD dwChunkBlocks = dwBlocks - dwBlock;
+        if (dwChunkBlocks > DELTA_WINDOW_SIZE / DELTA_BLOCK_SIZE)
+            dwChunkBlocks = DELTA_WINDOW_SIZE / DELTA_BLOCK_SIZE;
+
+        DWORD dwChunk = dwChunkBlocks * DELTA_BLOCK_SIZE;
+
+        if (ReadBaseArchiveData(Base,
+            (LONGLONG)dwBlock * DELTA_BLOCK_SIZE,
+            window,
+            dwChunk) != dwChunk)
+        {
+            oem_printf(stderr,
+                "strarc: Base archive is truncated, only part of the base "
+                "data for '%1!wZ!' is used.%%n",
+                File);
+
+            dwBlocks = dwBlock;
+            break;
+        }
+
+        for (DWORD i = 0; i < dwChunkBlocks; i++, dwBlock++)
+        {
+            DeltaBlockSignature *signature = signatures + dwBlock;
+            LPCBYTE lpBlock = window + i * DELTA_BLOCK_SIZE;
+
+            RollingChecksum checksum;
+            checksum.Init(lpBlock, DELTA_BLOCK_SIZE);
+            signature->dwWeak = checksum.Get();
+
+            if (!GetBlockHash(hProv, lpBlock, DELTA_BLOCK_SIZE,
+                signature->Strong))
+                continue;
+
+            DWORD slot = GetBlockSlot(signature->dwWeak, dwSlotBits);
+            signature->dwNext = slots[slot];
+            slots[slot] = dwBlock + 1;
+        }
+    }
+
+    STRARC_DELTA_COPY copy = { 0 };
+    copy.BaseSize.QuadPart = BaseSize;
+
+    LONGLONG WindowOffset = 0;
+    LONGLONG CopiedBytes = 0;
+    DWORD dwFilled = 0;
+    DWORD dwPos = 0;
+    DWORD dwLiteral = 0;
+
+    RollingChecksum checksum;
+    bool bChecksumValid = false;
+
+    for (;;)
+    {
+        // Data before current position is no longer needed when less than a
+        // block is left in the window. It is written and the rest of the
+        // window is moved to the beginning before reading more data.
+        if ((dwFilled - dwPos < DELTA_BLOCK_SIZE) && (BytesToRead > 0))
+        {
+            YieldSingleProcessor();
+
+            if (bCancel)
+            {
+                if (hProv != NULL)
+                    CryptReleaseContext(hProv, 0);
+
+                return false;
+            }
+
+            if (dwLiteral < dwPos)
+            {
+                WriteDeltaCopy(&copy);
+                WriteDeltaLiteral(WindowOffset + dwLiteral,
+                    window + dwLiteral,
+                    dwPos - dwLiteral);
+            }
+
+            MoveMemory(window, window + dwPos, dwFilled - dwPos);
+            WindowOffset += dwPos;
+            dwFilled -= dwPos;
+            dwPos = 0;
+            dwLiteral = 0;
+
+            DWORD dwChunk = DELTA_WINDOW_SIZE - dwFilled;
+            if ((LONGLONG)dwChunk > BytesToRead)
+                dwChunk = (DWORD)BytesToRead;
+
+            if (!BackupReadBlock(hFile, window + dwFilled, dwChunk, lpCtx))
+            {
+                WErrMsgA errmsg;
+                oem_printf(stderr,
+                    "strarc: Cannot read '%1!wZ!': %2%%n",
+                    File, errmsg);
+
+                if (hProv != NULL)
+                    CryptReleaseContext(hProv, 0);
+
+                return false;
+            }
+
+            dwFilled += dwChunk;
+            BytesToRead -= dwChunk;
+        }
+
+        if (dwFilled - dwPos < DELTA_BLOCK_SIZE)
+            break;
+
+        if (!bChecksumValid)
+        {
+            checksum.Init(window + dwPos, DELTA_BLOCK_SIZE);
+            bChecksumValid = true;
+        }
+
+        DWORD dwWeak = checksum.Get();
+        DWORD dwMatch = 0;
+        bool bStrongValid = false;
+        BYTE strong[16];
+
+        for (DWORD i = dwBlocks > 0 ?
+            slots[GetBlockSlot(dwWeak, dwSlotBits)] : 0;
+            i != 0;
+            i = signatures[i - 1].dwNext)
+        {
+            if (signatures[i - 1].dwWeak != dwWeak)
+                continue;
+
+            if (!bStrongValid)
+            {
+                if (!GetBlockHash(hProv, window + dwPos, DELTA_BLOCK_SIZE,
+                    strong))
+                    break;
+
+                bStrongValid = true;
+            }
+
+            if (memcmp(strong, signatures[i - 1].Strong, sizeof strong) != 0)
+                continue;
+
+            // A block that continues current copy range is preferred, so that
+            // ranges can be stored in as few copy streams as possible.
+            bool bContinues = (copy.Length.QuadPart > 0) &&
+                (copy.BaseOffset.QuadPart + copy.Length.QuadPart ==
+                    (LONGLONG)(i - 1) * DELTA_BLOCK_SIZE);
+
+            if ((dwMatch == 0) || bContinues)
+                dwMatch = i;
+
+            if (bContinues)
+                break;
+        }
+
+        if (dwMatch == 0)
+        {
+            if (dwPos + DELTA_BLOCK_SIZE < dwFilled)
+                checksum.Roll(window[dwPos], window[dwPos + DELTA_BLOCK_SIZE],
+                    DELTA_BLOCK_SIZE);
+            else
+                bChecksumValid = false;
+
+            ++dwPos;
+            continue;
+        }
+
+        if (dwLiteral < dwPos)
+        {
+            WriteDeltaCopy(&copy);
+            WriteDeltaLiteral(WindowOffset + dwLiteral,
+                window + dwLiteral,
+                dwPos - dwLiteral);
+        }
+
+        LONGLONG Offset = WindowOffset + dwPos;
+        LONGLONG BaseOffset = (LONGLONG)(dwMatch - 1) * DELTA_BLOCK_SIZE;
+
+        if ((copy.Length.QuadPart == 0) ||
+            (copy.Offset.QuadPart + copy.Length.QuadPart != Offset) ||
+            (copy.BaseOffset.QuadPart + copy.Length.QuadPart != BaseOffset))
+        {
+            WriteDeltaCopy(&copy);
+            copy.Offset.QuadPart = Offset;
+            copy.BaseOffset.QuadPart = BaseOffset;
+        }
+
+        copy.Length.QuadPart += DELTA_BLOCK_SIZE;
+        CopiedBytes += DELTA_BLOCK_SIZE;
+
+        dwPos += DELTA_BLOCK_SIZE;
+        dwLiteral = dwPos;
+        bChecksumValid = false;
+    }
+
+    WriteDeltaCopy(&copy);
+    WriteDeltaLiteral(WindowOffset + dwLiteral,
+        window + dwLiteral,
+        dwFilled - dwLiteral);
+
+    if (hProv != NULL)
+        CryptReleaseContext(hProv, 0);
+
+    if (bVerbose)
+        fprintf(stderr, "[delta, %I64i of %I64i bytes from base]",
+            CopiedBytes, header->Size.QuadPart);
+
+    return true;
+}
+
+// This function restores a range of file data from base archive, as
+// described by a copy stream. The data is written as sparse block streams in
+// Buffer, through the same code as the sparse block streams between copy
+// streams, so that all data of the file is written with BackupWrite. On
+// errors, the partly restored file is removed and bSeekOnly is set to skip
+// remaining streams for the file.
+bool
+StrArc::WriteFileDeltaCopyFromArchive(HANDLE &hFile,
+    DWORD dwBytesRead,
+    PLARGE_INTEGER BytesToRead,
+    PUNICODE_STRING File,
+    bool &bSeekOnly)
+{
+    const DWORD dwRecordHeaderSize = HEADER_SIZE + sizeof(LARGE_INTEGER);
+
+    if (bSeekOnly || (hFile == INVALID_HANDLE_VALUE))
+        return SkipArchive(BytesToRead);
+
+    DWORD offset = GetDataOffset();
+
+    if ((BytesToRead->QuadPart != 0) ||
+        (dwBytesRead != offset + sizeof(STRARC_DELTA_COPY)))
+    {
+        oem_printf(stderr,
+            "strarc: Bad delta copy stream for '%1!wZ!'%%n",
+            File);
+
+        return SkipArchive(BytesToRead);
+    }
+
+    STRARC_DELTA_COPY copy = *(PSTRARC_DELTA_COPY)(Buffer + offset);
+
+    // Base data is found by the path as stored in archive, which could
+    // differ from File when restoring short names only.
+    BaseArchiveItem *base = BaseArchiveIndex != NULL ?
+        FindBaseArchiveFile(&LastHeaderPath) : NULL;
+
+    bool bResult = true;
+
+    if (base == NULL)
+    {
+        oem_printf(stderr,
+            "strarc: '%1!wZ!' is stored as delta, but data for it was not "
+            "found in base archive. Use -u switch with same base archive "
+            "as when backing up.%%n",
+            File);
+
+        bResult = false;
+    }
+    else if ((base->GetDataSize() != copy.BaseSize.QuadPart) ||
+        (copy.Offset.QuadPart < 0) ||
+        (copy.BaseOffset.QuadPart < 0) ||
+        (copy.Length.QuadPart < 0) ||
+        (copy.BaseOffset.QuadPart + copy.Length.QuadPart >
+            base->GetDataSize()))
+    {
+        oem_printf(stderr,
+            "strarc: Data for '%1!wZ!' in base archive does not match "
+            "delta stream. Wrong base archive?%%n",
+            File);
+
+        bResult = false;
+    }
+
+    while (bResult && (copy.Length.QuadPart > 0))
+    {
+        YieldSingleProcessor();
+
+        if (bCancel)
+        {
+            bResult = false;
+            break;
+        }
+
+        DWORD dwChunk =
+            copy.Length.QuadPart >
+            (LONGLONG)(dwBufferSize - dwRecordHeaderSize) ?
+            dwBufferSize - dwRecordHeaderSize : copy.Length.LowPart;
+
+        if (ReadBaseArchiveData(base,
+            copy.BaseOffset.QuadPart,
+            Buffer + dwRecordHeaderSize,
+            dwChunk) != dwChunk)
+        {
+            oem_printf(stderr,
+                "strarc: Base archive is truncated, cannot restore "
+                "'%1!wZ!'.%%n",
+                File);
+
+            bResult = false;
+            break;
+        }
+
+        header->dwStreamId = BACKUP_SPARSE_BLOCK;
+        header->dwStreamAttributes = STREAM_SPARSE_ATTRIBUTE;
+        header->dwStreamNameSize = 0;
+        header->Size.QuadPart = sizeof(LARGE_INTEGER) + dwChunk;
+        ((PLARGE_INTEGER)(Buffer + HEADER_SIZE))->QuadPart =
+            copy.Offset.QuadPart;
+
+        LARGE_INTEGER NoMoreData = { 0 };
+
+        // On errors, the file is already removed unless it is still open.
+        if (!WriteFileDataStreamFromArchive(hFile,
+            dwRecordHeaderSize + dwChunk,
+            &NoMoreData,
+            *File,
+            bSeekOnly) ||
+            bSeekOnly)
+        {
+            bResult = false;
+            break;
+        }
+
+        copy.Offset.QuadPart += dwChunk;
+        copy.BaseOffset.QuadPart += dwChunk;
+        copy.Length.QuadPart -= dwChunk;
+    }
+
+    if (!bResult && (hFile != INVALID_HANDLE_VALUE))
+    {
+        if (!NativeDeleteFile(hFile))
+        {
+            WErrMsgA errmsg;
+            oem_printf(stderr,
+                "strarc: Cannot remove temporary file '%1!wZ!': %2%%n",
+                File, errmsg);
+        }
+
+        CloseHandle(hFile);
+        hFile = INVALID_HANDLE_VALUE;
+    }
+
+    if (!bResult)
+        bSeekOnly = true;
+
+    return !bCancel;
+}
@@ -0,0 +1,364 @@
+/* Stream Archive I/O utility, Copyright (C) Olof Lagerkvist 2004-2022
+*
+* listout.cpp
+* Buffered output of file lists and JSON Lines/CSV archive catalogs.
+*/
+
+#ifndef _UNICODE
+#define _UNICODE
+#endif
+#ifndef _DLL
+#define _DLL
+#endif
+#ifndef UNICODE
+#define UNICODE
+#endif
+#ifndef _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#define WIN32_NO_STATUS
+#include <windows.h>
+#include <intsafe.h>
+#undef WIN32_NO_STATUS
+#include <ntdll.h>
+
+#include <winstrct.h>
+#include <wio.h>
+
+#include <stdio.h>
+
+#include "strarc.hpp"
+
+bool
+ListOutput::Initialize(HANDLE _hOutput, bool bColumnNames)
+{
+    Buffer = (LPSTR)LocalAlloc(LMEM_FIXED, LIST_OUTPUT_BUFFER_SIZE);
+
+    if (Buffer == NULL)
+        return false;
+
+    // Stream names and link targets are kept until end of each record.
+    if (IsCatalog())
+    {
+        PendingStreamName = (LPWSTR)LocalAlloc(LMEM_FIXED, USHORT_MAX + 1);
+        LinkTarget = (LPWSTR)LocalAlloc(LMEM_FIXED, USHORT_MAX + 1);
+
+        if ((PendingStreamName == NULL) || (LinkTarget == NULL))
+            return false;
+    }
+
+    hOutput = _hOutput;
+    dwLastFlush = GetTickCount();
+
+    // CSV output starts with a line of column names.
+    if ((Format == LIST_FORMAT_CSV) && bColumnNames)
+    {
+        Append("path,short_name,offset,attributes,creation_time,"
+            "last_access_time,last_write_time,volume_serial_number,"
+            "file_index,size,links,streams,link_target");
+        EndLine();
+    }
+
+    return true;
+}
+
+// Writes names collected so far followed by contents of a file with list
+// output from another session, such as a temporary file written by a thread
+// testing a range of an archive.
+bool
+ListOutput::AppendFile(HANDLE hFile)
+{
+    Flush();
+
+    LARGE_INTEGER position = { 0 };
+    if (!SetFilePointerEx(hFile, position, NULL, FILE_BEGIN))
+        return false;
+
+    for (;;)
+    {
+        DWORD dwRead;
+        if (!ReadFile(hFile, Buffer, LIST_OUTPUT_BUFFER_SIZE, &dwRead, NULL))
+            return false;
+
+        if (dwRead == 0)
+            return true;
+
+        dwUsed = dwRead;
+        Flush();
+    }
+}
+
+void
+ListOutput::AppendText(LPCWSTR Text, int chars, bool bQuote)
+{
+    // A character takes at most three bytes in UTF-8 and two in OEM code
+    // pages, or six bytes when escaped in JSON.
+    LPSTR ptr = Reserve(chars * 6 + 2);
+
+    if (!bQuote)
+    {
+        int length = chars == 0 ? 0 :
+            WideCharToMultiByte(CodePage, 0, Text, chars,
+                ptr, chars * 3, NULL, NULL);
+
+        dwUsed += length;
+        return;
+    }
+
+    *ptr++ = '"';
+
+    for (int i = 0; i < chars; i++)
+    {
+        WCHAR c = Text[i];
+
+        if ((Format == LIST_FORMAT_JSON) && ((c == L'"') || (c == L'\\')))
+        {
+            *ptr++ = '\\';
+            *ptr++ = (char)c;
+        }
+        else if ((Format == LIST_FORMAT_JSON) && (c < 0x20))
+            ptr += sprintf(ptr, "\\u%.4x", c);
+        else if ((Format == LIST_FORMAT_CSV) && (c == L'"'))
+        {
+            *ptr++ = '"';
+            *ptr++ = '"';
+        }
+        else if (c < 0x80)
+            *ptr++ = (char)c;
+        else
+        {
+            int count = IS_HIGH_SURROGATE(c) && (i + 1 < chars) &&
+                IS_LOW_SURROGATE(Text[i + 1]) ? 2 : 1;
+
+            ptr += WideCharToMultiByte(CodePage, 0, Text + i, count,
+                ptr, 4, NULL, NULL);
+
+            i += count - 1;
+        }
+    }
+
+    *ptr++ = '"';
+
+    dwUsed = (DWORD)(ptr - Buffer);
+}
+
+// Times are written in ISO 8601 format in UTC, or as empty values when not
+// set.
+void
+ListOutput::AppendFileTime(const FILETIME *Time)
+{
+    SYSTEMTIME system_time;
+
+    if (((Time->dwLowDateTime == 0) && (Time->dwHighDateTime == 0)) ||
+        !FileTimeToSystemTime(Time, &system_time))
+    {
+        Append(Format == LIST_FORMAT_JSON ? "null" : "");
+        return;
+    }
+
+    LPSTR ptr = Reserve(40);
+
+    dwUsed += sprintf(ptr,
+        "\"%.4u-%.2u-%.2uT%.2u:%.2u:%.2u.%.7uZ\"",
+        system_time.wYear,
+        system_time.wMonth,
+        system_time.wDay,
+        system_time.wHour,
+        system_time.wMinute,
+        system_time.wSecond,
+        (UINT)((((ULONGLONG)Time->dwHighDateTime << 32) |
+            Time->dwLowDateTime) % 10000000));
+}
+
+// This function starts a record for a file with information from the file
+// header. Streams are added by AddStream() and the record is completed by
+// EndRecord().
+void
+ListOutput::BeginRecord(PCUNICODE_STRING File,
+    const BY_HANDLE_FILE_INFORMATION *FileInfo,
+    PCUNICODE_STRING ShortName,
+    LONGLONG Offset)
+{
+    bool bJson = Format == LIST_FORMAT_JSON;
+
+    if (bJson)
+        Append("{\"path\":");
+    AppendText(File->Buffer, File->Length / sizeof(WCHAR), true);
+
+    Append(bJson ? ",\"short_name\":" : ",");
+    if (ShortName != NULL)
+        AppendText(ShortName->Buffer, ShortName->Length / sizeof(WCHAR),
+            true);
+    else
+        Append(bJson ? "\"\"" : "");
+
+    LPSTR ptr = Reserve(80);
+    dwUsed += sprintf(ptr,
+        bJson ? ",\"offset\":%I64i,\"attributes\":%u" : ",%I64i,%u",
+        Offset,
+        FileInfo->dwFileAttributes);
+
+    Append(bJson ? ",\"creation_time\":" : ",");
+    AppendFileTime(&FileInfo->ftCreationTime);
+    Append(bJson ? ",\"last_access_time\":" : ",");
+    AppendFileTime(&FileInfo->ftLastAccessTime);
+    Append(bJson ? ",\"last_write_time\":" : ",");
+    AppendFileTime(&FileInfo->ftLastWriteTime);
+
+    ptr = Reserve(160);
+    dwUsed += sprintf(ptr,
+        bJson ?
+        ",\"volume_serial_number\":%u,\"file_index\":%I64u,"
+        "\"size\":%I64u,\"links\":" :
+        ",%u,%I64u,%I64u,",
+        FileInfo->dwVolumeSerialNumber,
+        ((ULONGLONG)FileInfo->nFileIndexHigh << 32) |
+        FileInfo->nFileIndexLow,
+        ((ULONGLONG)FileInfo->nFileSizeHigh << 32) |
+        FileInfo->nFileSizeLow);
+
+    // Number of links is 0 in headers of files backed up from directory
+    // listings without hard link tracking, where it is not known.
+    if (FileInfo->nNumberOfLinks != 0)
+    {
+        ptr = Reserve(16);
+        dwUsed += sprintf(ptr, "%u", FileInfo->nNumberOfLinks);
+    }
+    else if (bJson)
+        Append("null");
+
+    Append(bJson ? ",\"streams\":[" : ",\"");
+
+    bRecordOpen = true;
+    dwRecordStreams = 0;
+    dwPendingStreamCount = 0;
+    LinkTargetLength = 0;
+}
+
+// Writes the stream entry collected so far. In CSV, entries are written as
+// ID[NAME]=SIZE[*COUNT] separated by semicolons within one quoted field.
+void
+ListOutput::AppendStreamEntry()
+{
+    if (dwPendingStreamCount == 0)
+        return;
+
+    bool bJson = Format == LIST_FORMAT_JSON;
+
+    LPSTR ptr = Reserve(80);
+    dwUsed += sprintf(ptr,
+        bJson ? "%s{\"id\":\"%s\"" : "%s%s",
+        dwRecordStreams == 0 ? "" : bJson ? "," : ";",
+        GetStreamIdDescription(dwPendingStreamId));
+
+    if (PendingStreamNameLength > 0)
+    {
+        if (bJson)
+        {
+            Append(",\"name\":");
+            AppendText(PendingStreamName,
+                PendingStreamNameLength / sizeof(WCHAR), true);
+        }
+        else
+        {
+            // The CSV field is already quoted, so only quotes are doubled.
+            LPCWSTR segment = PendingStreamName;
+            LPCWSTR end = PendingStreamName +
+                PendingStreamNameLength / sizeof(WCHAR);
+
+            for (LPCWSTR name = segment; name <= end; name++)
+                if ((name == end) || (*name == L'"'))
+                {
+                    AppendText(segment, (int)(name - segment), false);
+
+                    if (name != end)
+                        Append("\"\"");
+
+                    segment = name + 1;
+                }
+        }
+    }
+
+    ptr = Reserve(80);
+    if (bJson)
+        dwUsed += sprintf(ptr, ",\"size\":%I64i,\"count\":%u}",
+            PendingStreamSize, dwPendingStreamCount);
+    else if (dwPendingStreamCount > 1)
+        dwUsed += sprintf(ptr, "=%I64i*%u",
+            PendingStreamSize, dwPendingStreamCount);
+    else
+        dwUsed += sprintf(ptr, "=%I64i", PendingStreamSize);
+
+    ++dwRecordStreams;
+    dwPendingStreamCount = 0;
+}
+
+void
+ListOutput::AddStream(DWORD dwStreamId,
+    LPCWSTR StreamName,
+    DWORD dwStreamNameSize,
+    LONGLONG Size,
+    LPCWSTR Target,
+    DWORD dwTargetSize)
+{
+    if (!bRecordOpen)
+        return;
+
+    if (dwStreamNameSize > USHORT_MAX)
+        dwStreamNameSize = USHORT_MAX & ~1;
+
+    if ((dwPendingStreamCount > 0) &&
+        ((dwStreamId != dwPendingStreamId) ||
+            (dwStreamNameSize != PendingStreamNameLength) ||
+            (memcmp(StreamName, PendingStreamName, dwStreamNameSize) != 0)))
+        AppendStreamEntry();
+
+    if (dwPendingStreamCount == 0)
+    {
+        dwPendingStreamId = dwStreamId;
+        PendingStreamNameLength = (USHORT)dwStreamNameSize;
+        CopyMemory(PendingStreamName, StreamName, dwStreamNameSize);
+        PendingStreamSize = 0;
+    }
+
+    PendingStreamSize += Size;
+    ++dwPendingStreamCount;
+
+    if (Target != NULL)
+    {
+        if (dwTargetSize > USHORT_MAX)
+            dwTargetSize = USHORT_MAX & ~1;
+
+        LinkTargetLength = (USHORT)dwTargetSize;
+        CopyMemory(LinkTarget, Target, dwTargetSize);
+    }
+}
+
+void
+ListOutput::EndRecord()
+{
+    if (!bRecordOpen)
+        return;
+
+    AppendStreamEntry();
+
+    bool bJson = Format == LIST_FORMAT_JSON;
+
+    Append(bJson ? "],\"link_target\":" : "\",");
+
+    if (LinkTargetLength > 0)
+        AppendText(LinkTarget, LinkTargetLength / sizeof(WCHAR), true);
+    else
+        Append(bJson ? "null" : "");
+
+    if (bJson)
+        Append("}");
+
+    EndLine();
+
+    bRecordOpen = false;
+}
@@ -0,0 +1,221 @@
+// Size of buffer where file names listed with -t and -l are collected
+// before they are written to stdout.
+#define LIST_OUTPUT_BUFFER_SIZE (256 << 10)
+
+// Collected names are also written when this number of milliseconds has
+// passed since last write, so that listing to a console does not look
+// stalled.
+#define LIST_OUTPUT_FLUSH_INTERVAL 200
+
+// Formats of listed files. Catalog formats with one record of file
+// information and streams for each file are only used in test mode.
+enum ListFormats
+{
+  LIST_FORMAT_NAMES,
+  LIST_FORMAT_JSON,
+  LIST_FORMAT_CSV
+};
+
+// This class formats listed file names into a large buffer, without any
+// allocation for each name, and writes the buffer to the output handle in
+// large chunks. Names are converted to OEM or UTF-8 characters and
+// terminated by line breaks or NUL characters.
+class ListOutput
+{
+
+private:
+
+  HANDLE hOutput;
+  LPSTR Buffer;
+  DWORD dwUsed;
+  DWORD dwLastFlush;
+  UINT CodePage;
+  bool bNulDelimited;
+  ListFormats Format;
+
+  // State of catalog record for current file, implemented in listout.cpp.
+  // Consecutive streams with same id and name, such as sparse blocks, are
+  // summed up and written as one entry.
+  bool bRecordOpen;
+  DWORD dwRecordStreams;
+  DWORD dwPendingStreamId;
+  USHORT PendingStreamNameLength;
+  LPWSTR PendingStreamName;
+  LONGLONG PendingStreamSize;
+  DWORD dwPendingStreamCount;
+  USHORT LinkTargetLength;
+  LPWSTR LinkTarget;
+
+  void
+  AppendStreamEntry();
+
+  void
+  AppendFileTime(const FILETIME *Time);
+
+public:
+
+  ListOutput()
+    : hOutput(INVALID_HANDLE_VALUE),
+      Buffer(NULL),
+      dwUsed(0),
+      dwLastFlush(0),
+      CodePage(CP_OEMCP),
+      bNulDelimited(false),
+      Format(LIST_FORMAT_NAMES),
+      bRecordOpen(false),
+      PendingStreamName(NULL),
+      LinkTarget(NULL)
+  {
+  }
+
+  ~ListOutput()
+  {
+    Flush();
+
+    if (Buffer != NULL)
+      LocalFree(Buffer);
+
+    if (PendingStreamName != NULL)
+      LocalFree(PendingStreamName);
+
+    if (LinkTarget != NULL)
+      LocalFree(LinkTarget);
+  }
+
+  void
+  SetUTF8()
+  {
+    CodePage = CP_UTF8;
+  }
+
+  void
+  SetNulDelimited()
+  {
+    bNulDelimited = true;
+  }
+
+  // Catalog formats are always written as UTF-8.
+  void
+  SetFormat(ListFormats _Format)
+  {
+    Format = _Format;
+
+    if (Format != LIST_FORMAT_NAMES)
+      CodePage = CP_UTF8;
+  }
+
+  bool
+  IsCatalog() const
+  {
+    return Format != LIST_FORMAT_NAMES;
+  }
+
+  // Uses same format as another list output, for output that is later
+  // appended to that list by AppendFile().
+  void
+  SetFormatFrom(const ListOutput *Template)
+  {
+    CodePage = Template->CodePage;
+    bNulDelimited = Template->bNulDelimited;
+    Format = Template->Format;
+  }
+
+  // Column names are written first in CSV output, unless bColumnNames is
+  // false.
+  bool
+  Initialize(HANDLE _hOutput, bool bColumnNames = true);
+
+  bool
+  AppendFile(HANDLE hFile);
+
+  // Writes collected names to the output handle. Write errors, such as a
+  // closed pipe, are ignored like when names were written one by one.
+  void
+  Flush()
+  {
+    LPSTR ptr = Buffer;
+
+    while (dwUsed > 0)
+      {
+	DWORD dwWritten;
+	if (!WriteFile(hOutput, ptr, dwUsed, &dwWritten, NULL) ||
+	    (dwWritten == 0))
+	  break;
+
+	ptr += dwWritten;
+	dwUsed -= dwWritten;
+      }
+
+    dwUsed = 0;
+    dwLastFlush = GetTickCount();
+  }
+
+  // Makes room for at least dwSize bytes in the buffer, which must be less
+  // than the buffer size, and returns a pointer to free space.
+  LPSTR
+  Reserve(DWORD dwSize)
+  {
+    if (dwUsed + dwSize > LIST_OUTPUT_BUFFER_SIZE)
+      Flush();
+
+    return Buffer + dwUsed;
+  }
+
+  void
+  Append(LPCSTR Text)
+  {
+    DWORD dwSize = (DWORD) strlen(Text);
+    CopyMemory(Reserve(dwSize), Text, dwSize);
+    dwUsed += dwSize;
+  }
+
+  // Appends characters converted to output code page. With bQuote, text is
+  // quoted as a JSON string or CSV field depending on format.
+  void
+  AppendText(LPCWSTR Text, int chars, bool bQuote);
+
+  void
+  EndLine()
+  {
+    LPSTR ptr = Reserve(2);
+
+    if (bNulDelimited)
+      {
+	*ptr = 0;
+	++dwUsed;
+      }
+    else
+      {
+	ptr[0] = '\r';
+	ptr[1] = '\n';
+	dwUsed += 2;
+      }
+
+    if (GetTickCount() - dwLastFlush > LIST_OUTPUT_FLUSH_INTERVAL)
+      Flush();
+  }
+
+  void
+  Write(PCUNICODE_STRING Name)
+  {
+    AppendText(Name->Buffer, Name->Length / sizeof(WCHAR), false);
+    EndLine();
+  }
+
+  void
+  BeginRecord(PCUNICODE_STRING File,
+	      const BY_HANDLE_FILE_INFORMATION *FileInfo,
+	      PCUNICODE_STRING ShortName,
+	      LONGLONG Offset);
+
+  void
+  AddStream(DWORD dwStreamId,
+	    LPCWSTR StreamName,
+	    DWORD dwStreamNameSize,
+	    LONGLONG Size,
+	    LPCWSTR Target,
+	    DWORD dwTargetSize);
+
+  void
+  EndRecord();
+};
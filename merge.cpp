@@ -0,0 +1,674 @@
+/* Stream Archive I/O utility, Copyright (C) Olof Lagerkvist 2004-2022
+*
+* merge.cpp
+* Merging a full archive and incremental archives into a new full archive.
+*/
+
+#ifndef _UNICODE
+#define _UNICODE
+#endif
+#ifndef _DLL
+#define _DLL
+#endif
+#ifndef UNICODE
+#define UNICODE
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#define WIN32_NO_STATUS
+#include <process.h>
+#include <windows.h>
+#include <intsafe.h>
+#undef WIN32_NO_STATUS
+#include <ntdll.h>
+
+#include <winstrct.h>
+#include <wio.h>
+
+#include "strarc.hpp"
+
+// This function reads all file headers in an archive to merge and records
+// location of each file record in merge index, replacing any record for the
+// same path found earlier. Stream data is skipped, except security
+// descriptor dictionary entries that are loaded so that references to them
+// can be resolved when records are copied.
+bool
+StrArc::ScanMergeArchive(HANDLE hInput,
+    DWORD dwArchive,
+    LPCWSTR wczArchive,
+    MergeArchiveIndex &Index)
+{
+    LARGE_INTEGER ArchiveSize;
+    if (!GetFileSizeEx(hInput, &ArchiveSize))
+        return false;
+
+    if (bVerbose)
+        oem_printf(stderr, "Reading archive '%1!ws!'...%%n", wczArchive);
+
+    WHeapMem<BYTE> header_buffer(HEADER_SIZE + 65536 + sizeof(DWORD) +
+        sizeof(BY_HANDLE_FILE_INFORMATION) + 26,
+        HEAP_GENERATE_EXCEPTIONS);
+
+    WHeapMem<BYTE> path_buffer(USHORT_MAX + 1, HEAP_GENERATE_EXCEPTIONS);
+
+    LPWIN32_STREAM_ID stream_header = (LPWIN32_STREAM_ID)
+        (LPBYTE)header_buffer;
+
+    UNICODE_STRING path;
+    path.Buffer = (PWSTR)(LPBYTE)path_buffer;
+    path.Length = 0;
+    path.MaximumLength = USHORT_MAX;
+
+    MergeArchiveItem *record = NULL;
+    LONGLONG Position = 0;
+    LONGLONG Records = 0;
+
+    while (ReadArchiveAt(hInput, Position, header_buffer, HEADER_SIZE) ==
+        HEADER_SIZE)
+    {
+        YieldSingleProcessor();
+
+        if (bCancel)
+            return false;
+
+        if (IsValidFileHeader(stream_header))
+        {
+            if (record != NULL)
+                record->SetRecordSize(Position - record->GetRecordOffset());
+
+            record = NULL;
+
+            LONGLONG HeaderPosition = Position;
+            Position += HEADER_SIZE;
+
+            DWORD dwBytesToRead =
+                stream_header->dwStreamNameSize +
+                stream_header->Size.LowPart;
+
+            if (ReadArchiveAt(hInput,
+                Position,
+                header_buffer + HEADER_SIZE,
+                dwBytesToRead) != dwBytesToRead)
+                break;
+
+            Position += dwBytesToRead;
+
+            DWORD dwSharedLength = 0;
+            DWORD dwSharedLengthSize = 0;
+
+            if (stream_header->dwStreamAttributes ==
+                STRARC_MAGIC_FRONT_CODED)
+            {
+                dwSharedLength = *(LPDWORD)(header_buffer + HEADER_SIZE +
+                    stream_header->dwStreamNameSize);
+                dwSharedLengthSize = sizeof(DWORD);
+            }
+
+            if ((dwSharedLength > path.Length) ||
+                (dwSharedLength + stream_header->dwStreamNameSize >
+                    USHORT_MAX))
+            {
+                oem_printf(stderr,
+                    "strarc: Bad front coded path in '%1!ws!', file is not "
+                    "merged.%%n",
+                    wczArchive);
+
+                path.Length = 0;
+                continue;
+            }
+
+            memcpy((LPBYTE)path.Buffer + dwSharedLength,
+                stream_header->cStreamName,
+                stream_header->dwStreamNameSize);
+            path.Length = (USHORT)
+                (dwSharedLength + stream_header->dwStreamNameSize);
+
+            record = Index.FindOrAdd(&path);
+
+            if (record == NULL)
+                Exception(XE_NOT_ENOUGH_MEMORY);
+
+            // File information follows the path and the shared length of a
+            // front coded path.
+            DWORD dwFileInfoOffset = stream_header->dwStreamNameSize +
+                dwSharedLengthSize;
+
+            bool bDirectory =
+                (stream_header->Size.LowPart >= dwSharedLengthSize +
+                    sizeof(BY_HANDLE_FILE_INFORMATION)) &&
+                (((PBY_HANDLE_FILE_INFORMATION)
+                    (header_buffer + HEADER_SIZE + dwFileInfoOffset))->
+                    dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+
+            record->SetRecord(dwArchive,
+                HeaderPosition,
+                Position - HeaderPosition,
+                bDirectory);
+
+            ++Records;
+
+            continue;
+        }
+
+        if (stream_header->dwStreamNameSize > 65535)
+        {
+            oem_printf(stderr,
+                "strarc: Bad stream header in '%1!ws!', rest of archive is "
+                "not merged.%%n",
+                wczArchive);
+
+            break;
+        }
+
+        if (Position + HEADER_SIZE + stream_header->dwStreamNameSize +
+            stream_header->Size.QuadPart > ArchiveSize.QuadPart)
+        {
+            if (record != NULL)
+                oem_printf(stderr,
+                    "strarc: Archive '%1!ws!' is truncated, '%2!wZ!' is "
+                    "merged without last stream.%%n",
+                    wczArchive, record->GetName());
+            else
+                oem_printf(stderr,
+                    "strarc: Archive '%1!ws!' is truncated.%%n",
+                    wczArchive);
+
+            break;
+        }
+
+        Position += HEADER_SIZE;
+
+        if ((record != NULL) &&
+            (IsMergeStreamSkipped(stream_header) ||
+            ((stream_header->dwStreamId == BACKUP_SECURITY_DATA) &&
+            ((stream_header->dwStreamAttributes ==
+                STRARC_MAGIC_SECURITY_ENTRY) ||
+            (stream_header->dwStreamAttributes ==
+                STRARC_MAGIC_SECURITY_REFERENCE)))))
+            record->SetRewriteStreams();
+
+        if ((stream_header->dwStreamId == BACKUP_SECURITY_DATA) &&
+            (stream_header->dwStreamAttributes ==
+                STRARC_MAGIC_SECURITY_ENTRY) &&
+            (stream_header->dwStreamNameSize == 0) &&
+            (stream_header->Size.QuadPart > sizeof(DWORD)) &&
+            (stream_header->Size.QuadPart <= 65536))
+        {
+            DWORD dwBytesToRead = stream_header->Size.LowPart;
+
+            if (ReadArchiveAt(hInput,
+                Position,
+                header_buffer + HEADER_SIZE,
+                dwBytesToRead) != dwBytesToRead)
+                break;
+
+            AddSecurityDescriptor(MERGE_SECURITY_ID(dwArchive,
+                *(LPDWORD)(header_buffer + HEADER_SIZE)),
+                header_buffer + HEADER_SIZE + sizeof(DWORD),
+                dwBytesToRead - sizeof(DWORD));
+        }
+
+        Position += stream_header->dwStreamNameSize +
+            stream_header->Size.QuadPart;
+    }
+
+    if (record != NULL)
+        record->SetRecordSize(Position - record->GetRecordOffset());
+
+    if (bVerbose)
+        fprintf(stderr, "%I64i files found in archive.\n", Records);
+
+    return true;
+}
+
+// This function copies one file record from an archive being merged to the
+// output archive. The file header is written with complete path and
+// security descriptor dictionary streams are written as ordinary security
+// streams, since neither can refer to earlier records when records from
+// different archives are mixed. Streams selected with -s:s or -s:n are left
+// out and short names are left out with -s:8. All other streams are copied
+// unchanged.
+bool
+StrArc::CopyMergeRecord(HANDLE hInput,
+    LPCWSTR wczArchive,
+    MergeArchiveItem *Item,
+    LPBYTE header_buffer)
+{
+    LPWIN32_STREAM_ID stream_header = (LPWIN32_STREAM_ID)
+        (LPBYTE)header_buffer;
+
+    LONGLONG Position = Item->GetRecordOffset();
+    LONGLONG RecordEnd = Position + Item->GetRecordSize();
+
+    if (ReadArchiveAt(hInput, Position, header_buffer, HEADER_SIZE) !=
+        HEADER_SIZE)
+        Exception(XE_ARCHIVE_TRUNC);
+
+    if (!IsValidFileHeader(stream_header))
+        Exception(XE_ARCHIVE_BAD_HEADER);
+
+    DWORD dwBytesToRead =
+        stream_header->dwStreamNameSize +
+        stream_header->Size.LowPart;
+
+    if (ReadArchiveAt(hInput,
+        Position + HEADER_SIZE,
+        header_buffer + HEADER_SIZE,
+        dwBytesToRead) != dwBytesToRead)
+        Exception(XE_ARCHIVE_TRUNC);
+
+    Position += HEADER_SIZE + dwBytesToRead;
+
+    // Save file information from the header, it is written again after the
+    // complete path.
+    BYTE header_data[sizeof(BY_HANDLE_FILE_INFORMATION) + 26];
+    DWORD dwHeaderDataSize = stream_header->Size.LowPart;
+    LPBYTE file_info = header_buffer + HEADER_SIZE +
+        stream_header->dwStreamNameSize;
+
+    if (stream_header->dwStreamAttributes == STRARC_MAGIC_FRONT_CODED)
+    {
+        file_info += sizeof(DWORD);
+        dwHeaderDataSize -= sizeof(DWORD);
+    }
+
+    memcpy(header_data, file_info, dwHeaderDataSize);
+
+    if (bSkipShortNames)
+        dwHeaderDataSize = sizeof(BY_HANDLE_FILE_INFORMATION);
+
+    bool bIncludeThis;
+    ExcludedString(Item->GetName(),
+        (PBY_HANDLE_FILE_INFORMATION)header_data,
+        NULL,
+        &bIncludeThis);
+
+    if (!bIncludeThis)
+        return true;
+
+    if (bVerbose)
+        oem_printf(stderr, "Merging '%1!wZ!' from '%2!ws!'%%n",
+            Item->GetName(), wczArchive);
+    else if (bListFiles)
+        ListFileName(Item->GetName());
+
+    stream_header->dwStreamId = BACKUP_INVALID;
+    stream_header->dwStreamAttributes = STRARC_MAGIC;
+    stream_header->dwStreamNameSize = Item->GetName()->Length;
+    stream_header->Size.QuadPart = dwHeaderDataSize;
+    memcpy(stream_header->cStreamName,
+        Item->GetName()->Buffer,
+        Item->GetName()->Length);
+    memcpy((LPBYTE)stream_header->cStreamName + Item->GetName()->Length,
+        header_data,
+        dwHeaderDataSize);
+
+    WriteArchive(header_buffer,
+        HEADER_SIZE + Item->GetName()->Length + dwHeaderDataSize);
+
+    // Streams that are not changed are forwarded in blocks of buffer size,
+    // regardless of stream boundaries.
+    if (!Item->GetRewriteStreams())
+    {
+        while (Position < RecordEnd)
+        {
+            if (bCancel)
+                return false;
+
+            DWORD dwBlockSize =
+                RecordEnd - Position > (LONGLONG)dwBufferSize ?
+                dwBufferSize : (DWORD)(RecordEnd - Position);
+
+            if (ReadArchiveAt(hInput, Position, Buffer, dwBlockSize) !=
+                dwBlockSize)
+                Exception(XE_ARCHIVE_TRUNC);
+
+            WriteArchive(Buffer, dwBlockSize);
+
+            Position += dwBlockSize;
+        }
+
+        ++FileCounter;
+
+        return true;
+    }
+
+    while (Position < RecordEnd)
+    {
+        if (bCancel)
+            return false;
+
+        if (ReadArchiveAt(hInput, Position, header_buffer, HEADER_SIZE) !=
+            HEADER_SIZE)
+            Exception(XE_ARCHIVE_TRUNC);
+
+        Position += HEADER_SIZE;
+
+        if (IsMergeStreamSkipped(stream_header))
+        {
+            Position += stream_header->dwStreamNameSize +
+                stream_header->Size.QuadPart;
+
+            continue;
+        }
+
+        if ((stream_header->dwStreamId == BACKUP_SECURITY_DATA) &&
+            ((stream_header->dwStreamAttributes ==
+                STRARC_MAGIC_SECURITY_ENTRY) ||
+                (stream_header->dwStreamAttributes ==
+                    STRARC_MAGIC_SECURITY_REFERENCE)) &&
+            (stream_header->dwStreamNameSize == 0) &&
+            (stream_header->Size.QuadPart >= sizeof(DWORD)))
+        {
+            DWORD dwId;
+            if (ReadArchiveAt(hInput,
+                Position,
+                (LPBYTE)&dwId,
+                sizeof(dwId)) != sizeof(dwId))
+                Exception(XE_ARCHIVE_TRUNC);
+
+            Position += stream_header->Size.QuadPart;
+
+            SecurityDictionaryItem *item =
+                LookupSecurityDescriptor(MERGE_SECURITY_ID(
+                    Item->GetArchive(), dwId));
+
+            if (item == NULL)
+            {
+                oem_printf(stderr,
+                    "strarc: Unknown security descriptor %1!u! for '%2!wZ!'%%n",
+                    dwId, Item->GetName());
+
+                continue;
+            }
+
+            stream_header->dwStreamAttributes = STREAM_NORMAL_ATTRIBUTE;
+            stream_header->Size.QuadPart = item->GetSize();
+
+            WriteArchive(header_buffer, HEADER_SIZE);
+            WriteArchive((LPBYTE)item->GetDescriptor(), item->GetSize());
+
+            continue;
+        }
+
+        WriteArchive(header_buffer, HEADER_SIZE);
+
+        LONGLONG BytesToCopy = stream_header->dwStreamNameSize +
+            stream_header->Size.QuadPart;
+
+        while (BytesToCopy > 0)
+        {
+            DWORD dwBlockSize = BytesToCopy > (LONGLONG)dwBufferSize ?
+                dwBufferSize : (DWORD)BytesToCopy;
+
+            if (ReadArchiveAt(hInput, Position, Buffer, dwBlockSize) !=
+                dwBlockSize)
+                Exception(XE_ARCHIVE_TRUNC);
+
+            WriteArchive(Buffer, dwBlockSize);
+
+            Position += dwBlockSize;
+            BytesToCopy -= dwBlockSize;
+        }
+    }
+
+    ++FileCounter;
+
+    return true;
+}
+
+// This function merges a full archive and a number of incremental or
+// differential archives, in order from oldest to newest, into the archive
+// opened for output. Only the newest record of each path is written, in
+// the order paths were first found, except that each directory is written
+// after all files and directories in it. Archives to merge must be
+// uncompressed disk files. Delta copy streams are copied unchanged and
+// still need the same base archive when the merged archive is restored.
+bool
+StrArc::MergeArchives(int iArchives,
+    LPWSTR *wczArchives)
+{
+    if (iArchives > MERGE_ARCHIVE_MAX_COUNT)
+    {
+        oem_printf(stderr,
+            "strarc: At most %1!u! archives can be merged.%%n",
+            MERGE_ARCHIVE_MAX_COUNT);
+
+        return false;
+    }
+
+    MergeArchiveIndex Index;
+
+    if (!Index.IsValid())
+        Exception(XE_NOT_ENOUGH_MEMORY);
+
+    WHeapMem<HANDLE> hArchives(sizeof(HANDLE) * iArchives,
+        HEAP_GENERATE_EXCEPTIONS);
+
+    for (int i = 0; i < iArchives; i++)
+        hArchives[i] = NULL;
+
+    bool bResult = true;
+
+    for (int i = 0; i < iArchives; i++)
+    {
+        hArchives[i] = CreateFile(wczArchives[i],
+            GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_DELETE,
+            NULL,
+            OPEN_EXISTING,
+            FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_RANDOM_ACCESS,
+            NULL);
+
+        if (hArchives[i] == INVALID_HANDLE_VALUE)
+        {
+            WErrMsgA errmsg;
+            oem_printf(stderr,
+                "strarc: Cannot open archive '%1!ws!': %2%%n",
+                wczArchives[i], errmsg);
+
+            hArchives[i] = NULL;
+            bResult = false;
+            break;
+        }
+
+        if (GetFileType(hArchives[i]) != FILE_TYPE_DISK)
+        {
+            oem_printf(stderr,
+                "strarc: Archive '%1!ws!' is not a disk file.%%n",
+                wczArchives[i]);
+
+            bResult = false;
+            break;
+        }
+
+        if (!ScanMergeArchive(hArchives[i], i, wczArchives[i], Index))
+        {
+            if (!bCancel)
+            {
+                WErrMsgA errmsg;
+                oem_printf(stderr,
+                    "strarc: Cannot read archive '%1!ws!': %2%%n",
+                    wczArchives[i], errmsg);
+            }
+
+            bResult = false;
+            break;
+        }
+    }
+
+    if (bResult)
+    {
+        Index.SortDirectoriesLast();
+
+        WHeapMem<BYTE> header_buffer(HEADER_SIZE + 65536 + sizeof(DWORD) +
+            sizeof(BY_HANDLE_FILE_INFORMATION) + 26,
+            HEAP_GENERATE_EXCEPTIONS);
+
+        for (DWORD i = 0; i < Index.Count(); i++)
+        {
+            YieldSingleProcessor();
+
+            MergeArchiveItem *item = Index.GetItem(i);
+
+            if (!CopyMergeRecord(hArchives[item->GetArchive()],
+                wczArchives[item->GetArchive()],
+                item,
+                header_buffer))
+            {
+                bResult = false;
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < iArchives; i++)
+        if (hArchives[i] != NULL)
+            CloseHandle(hArchives[i]);
+
+    return bResult;
+}
+
+class StrArc::MergeThreadContext
+{
+    StrArc *MergeSession;
+    int iArchives;
+    LPWSTR *wczArchives;
+
+    HANDLE MergeThreadHandle;
+
+    static
+        unsigned
+        CALLBACK
+        MergeThread(void *lpCtx)
+    {
+        MergeThreadContext *Context = (MergeThreadContext *)lpCtx;
+
+        DWORD dwResult = NO_ERROR;
+
+        __try
+        {
+            if (!Context->MergeSession->MergeArchives(Context->iArchives,
+                Context->wczArchives))
+                dwResult = ERROR_INVALID_DATA;
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            dwResult = RtlNtStatusToDosError(GetExceptionCode());
+        }
+
+        // This closes the write end of the pipe, so that the restore session
+        // finds end of archive.
+        delete Context->MergeSession;
+        Context->MergeSession = NULL;
+
+        return dwResult;
+    }
+
+public:
+
+    StrArc *GetMergeSession()
+    {
+        return MergeSession;
+    }
+
+    bool
+        GetMergeThreadResult()
+    {
+        WaitForSingleObject(MergeThreadHandle, INFINITE);
+
+        DWORD dwExitCode;
+        if (!GetExitCodeThread(MergeThreadHandle, &dwExitCode))
+            dwExitCode = GetLastError();
+
+        CloseHandle(MergeThreadHandle);
+
+        if (dwExitCode == NO_ERROR)
+            return true;
+
+        SetLastError(dwExitCode);
+        return false;
+    }
+
+    bool
+        StartMergeThread()
+    {
+        unsigned uiThreadId;
+
+        MergeThreadHandle = (HANDLE)
+            _beginthreadex(NULL, 0, MergeThread, this, 0, &uiThreadId);
+
+        return MergeThreadHandle != NULL;
+    }
+
+    MergeThreadContext(StrArc *Template,
+        HANDLE hWritePipe,
+        int iArchives,
+        LPWSTR *wczArchives)
+        : MergeSession(NULL),
+        iArchives(iArchives),
+        wczArchives(wczArchives),
+        MergeThreadHandle(NULL)
+    {
+        MergeSession = Template->TemplateNew(hWritePipe);
+
+        if (MergeSession == NULL)
+        {
+            CloseHandle(hWritePipe);
+            return;
+        }
+
+        // Files are listed by the restore session.
+        MergeSession->bVerbose = false;
+        MergeSession->bListFiles = false;
+    }
+
+    ~MergeThreadContext()
+    {
+        if (MergeSession != NULL)
+            delete MergeSession;
+    }
+};
+
+// This function restores from a full archive and later incremental or
+// differential archives in one pass. Archives are merged like with -y by a
+// merge session in a separate thread that writes the newest record of each
+// path to a pipe, and this session restores from the other end of the pipe.
+// That way each file is restored once and only data for files actually
+// restored is read from the archives. The merge session writes each
+// directory after all files in it, also files added to the directory in a
+// later archive, so directory timestamps are set after the files in the
+// directory have been restored.
+bool
+StrArc::RestoreArchiveChain(int iArchives,
+    LPWSTR *wczArchives)
+{
+    HANDLE hReadPipe;
+    HANDLE hWritePipe;
+    if (!CreatePipe(&hReadPipe, &hWritePipe, NULL, dwBufferSize))
+        return false;
+
+    hArchive = hReadPipe;
+
+    MergeThreadContext Context(this, hWritePipe, iArchives, wczArchives);
+
+    if (Context.GetMergeSession() == NULL)
+        return false;
+
+    if (!Context.StartMergeThread())
+        return false;
+
+    if (ContentStatistics != NULL)
+        ScanArchiveStatistics();
+    else
+        RestoreDirectoryTree();
+
+    // If restore ended before end of merged archive, closing the pipe makes
+    // the merge session fail writing and end.
+    CloseHandle(hArchive);
+    hArchive = NULL;
+
+    return Context.GetMergeThreadResult();
+}
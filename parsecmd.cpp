@@ -50,21 +50,52 @@ usage()
         "\n"
         "Usage:\r\n"
         "\n"
-        "strarc -c[afjr] [-z:CMD] [-m:f|d|i] [-l|v] [-s:ls8] [-b:SIZE]\r\n"
-        "       [-e:EXCLUDE[,...]] [-i:INCLUDE[,...]] [-d:DIR] [ARCHIVE|-n] [LIST ...]\r\n"
+        "strarc -c[afjr] [-z:CMD] [-m:f|d|i] [-g:psz] [-p[:e]] [-l[:08]|v] [-s:ls8]\r\n"
+        "       [-b:SIZE] [-u:BASE] [-e:EXCLUDE[,...]] [-i:INCLUDE[,...]] [-d:DIR]\r\n"
+        "       [-q[:FILE]] [-h[:[SECONDS][,FILE]]] [--trace:FILE] [--stripe:FILE,...]\r\n"
+        "       [--tee:DEST ...] [--volume:SIZE] [ARCHIVE|-n] [LIST ...]\r\n"
         "\n"
-        "strarc -x [-8] [-z:CMD] [-l|v] [-s:aclst8] [-o[:afn]] [-b:SIZE] [-w:8]\r\n"
-        "       [-e:EXCLUDE[,...]] [-i:INCLUDE[,...]] [-d:DIR] [ARCHIVE]\r\n"
+        "strarc -x [-8] [-z:CMD] [-l[:08]|v] [-s:aclst8] [-o[:afn]] [-b:SIZE] [-w:8]\r\n"
+        "       [-u:BASE] [-e:EXCLUDE[,...]] [-i:INCLUDE[,...]] [-d:DIR]\r\n"
+        "       [-q[:FILE]] [-h[:[SECONDS][,FILE]]] [--trace:FILE] [--stripe]\r\n"
+        "       [--volume] [ARCHIVE [INCREMENTAL ...]]\r\n"
         "\n"
-        "strarc -t [-z:CMD] [-v] [-b:SIZE] [-e:EXCLUDE[,...]] [-i:INCLUDE[,...]]\r\n"
-        "       [ARCHIVE]\r\n" "\n" "-- Main options --\r\n"
+        "strarc -t[:sp[N]] [-z:CMD] [-l:08jc|v] [-b:SIZE] [-e:EXCLUDE[,...]]\r\n"
+        "       [-i:INCLUDE[,...]] [-q[:FILE]] [-h[:[SECONDS][,FILE]]]\r\n"
+        "       [--trace:FILE] [--stripe] [--volume] [ARCHIVE [INCREMENTAL ...]]\r\n"
+        "\n"
+        "strarc -y[a] [-z:CMD] [-l[:08]|v] [-s:ns8] [-b:SIZE] [-e:EXCLUDE[,...]]\r\n"
+        "       [-i:INCLUDE[,...]] [-q[:FILE]] [-h[:[SECONDS][,FILE]]] [--trace:FILE]\r\n"
+        "       [--stripe:FILE,...] [--tee:DEST ...] [--volume:SIZE]\r\n"
+        "       ARCHIVE|- FULL [INCREMENTAL ...]\r\n"
+        "\n"
+        "-- Main options --\r\n"
         "\n"
         "-c     Backup operation. Default archive output is stdout. If an archive\r\n"
         "       filename is given, that file is overwritten if not the -a switch is also\r\n"
         "       specified.\r\n" "\n"
-        "-x     Restore operation. Default archive input is stdin.\r\n" "\n"
+        "-x     Restore operation. Default archive input is stdin. If more than one\r\n"
+        "       archive is given, they are a full archive followed by later incremental\r\n"
+        "       or differential archives. Only the newest version of each file is\r\n"
+        "       restored, in one pass. This also works with -t. Such archives must be\r\n"
+        "       uncompressed disk files.\r\n" "\n"
         "-t     Read archive and display filenames and possible errors but no\r\n"
-        "       extracting. Default archive input is stdin.\r\n" "\n"
+        "       extracting. Default archive input is stdin.\r\n"
+        "       s - Display statistics of archive contents instead of filenames:\r\n"
+        "           bytes and counts by stream type, file attribute, extension and\r\n"
+        "           directory depth, the largest files and bytes not stored for\r\n"
+        "           hard links, sparse files and delta streams. Only headers are\r\n"
+        "           read when the archive is a disk file.\r\n"
+        "       p - Test an uncompressed archive file in N parallel ranges, default\r\n"
+        "           one for each processor. Cannot be used with -t:s or -v.\r\n" "\n"
+        "-y     Merge a full backup archive and later incremental or differential\r\n"
+        "       archives into a new full archive, without reading any files on disk.\r\n"
+        "       Only the newest version of each file is written to the new archive.\r\n"
+        "       Archives to merge must be uncompressed disk files, listed from oldest\r\n"
+        "       to newest. Files deleted since the full backup are still included.\r\n"
+        "       The -z switch filters the new archive only. With only one archive to\r\n"
+        "       merge, -y repacks it, for instance to select files with -e and -i or\r\n"
+        "       leave out streams with -s.\r\n" "\n"
         "-- Backup options --\r\n" "\n"
         "-a     Append to existing archive.\r\n" "\n"
         "-f     Read files to backup from stdin. If this flag is not present the tree of\r\n"
@@ -74,7 +105,23 @@ usage()
         "       read from stdin should be backed up. The filenames read from stdin are\r\n"
         "       read as Ansi characters if -f is given, or Unicode characters if -F is\r\n"
         "       given. You may get better performance with the -F switch than with the\r\n"
-        "       -f switch.\r\n" "\n"
+        "       -f switch.\r\n"
+        "       0 - Names are separated by NUL characters instead of line breaks, as\r\n"
+        "           written for instance by find -print0.\r\n"
+        "       8 - Names are read as UTF-8 characters. Only valid with -f.\r\n"
+        "       Files listed after each other in the same directory are backed up\r\n"
+        "       faster than files listed in random order.\r\n" "\n"
+        "-g     Generate a more compact archive.\r\n"
+        "       p - Store only the part of each path that differs from the path of\r\n"
+        "           the previous file in the archive.\r\n"
+        "       z - Store data blocks of %u bytes that only contain zeros as holes\r\n"
+        "           in sparse block streams, instead of storing the zeros in the\r\n"
+        "           archive. Data in files already marked as sparse is always\r\n"
+        "           stored as sparse blocks.\r\n"
+        "       s - Store each distinct security descriptor once in the archive and\r\n"
+        "           refer to it from other files with the same descriptor. Such\r\n"
+        "           archives cannot be restored by earlier versions of strarc.\r\n"
+        "\n"
         "-j     Do not follow junctions or other reparse points, instead the reparse\r\n"
         "       points are backed up.\r\n" "\n"
         "-m     Select backup method.\r\n"
@@ -92,6 +139,12 @@ usage()
         "-n     No actual backup operation. Used for example with -l to list files that\r\n"
         "       would have been backed up.\r\n"
         "\n"
+        "-p     Back up files in each directory in order of file id, which usually\r\n"
+        "       is close to the order of file records on disk, instead of directory\r\n"
+        "       order. This reduces seeking on rotating disks.\r\n"
+        "       e - Order files by location of their first data extent on disk.\r\n"
+        "           Each file is opened an extra time to find that location.\r\n"
+        "\n"
         "-r     Backup loaded registry database of the running system.\r\n"
         "\n"
         "       Creates temporary snapshot files of loaded registry database files and\r\n"
@@ -126,11 +179,19 @@ usage()
         "\n"
         "-b     Specifies the buffer size used when calling the backup API functions.\r\n"
         "       You can suffix the number with K or M to specify KB or MB. The default\r\n"
-        "       value is %.4g %s. The specified size must be at least 64 KB.\r\n"
+        "       value is %.4g %s. The specified size must be at least 64 KB. The\r\n"
+        "       archive is also read in blocks of this size.\r\n"
         "\n"
         "-d     Before doing anything, change to this directory. When extracting, the\r\n"
         "       directory is first created if it does not exist.\r\n" "\n"
-        "-l     Display filenames like -t while backing up/extracting.\r\n"
+        "-l     Display filenames like -t while backing up/extracting. Options for\r\n"
+        "       format of names displayed by -l or -t:\r\n"
+        "       0 - Names are separated by NUL characters instead of line breaks,\r\n"
+        "           for instance for xargs -0.\r\n"
+        "       8 - Names are written as UTF-8 characters instead of OEM characters.\r\n"
+        "       j - With -t, write a catalog with one JSON object per line for each\r\n"
+        "           file, with file information, archive offset and streams.\r\n"
+        "       c - With -t, write the same catalog in CSV format.\r\n"
         "\n"
         "-s     Ignore/skip restoring some information while backing up/restoring:\r\n"
         "       a - No file attributes restored.\r\n"
@@ -140,11 +201,18 @@ usage()
         "           files.\r\n"
         "           On restore: Create separate files when extracting hard linked files\r\n"
         "           instead of first attempt to restore the hard link between them.\r\n"
+        "       n - No alternate data streams written to merged archive. Only valid\r\n"
+        "           with -y.\r\n"
         "       s - No security (access/owner/audit) information backed up/restored.\r\n"
         "       t - No file creation/last access/last written times restored.\r\n"
         "       8 - Skip storing short 8.3 names in archive on backup, or skip restoring\n"
         "           such names on restore.\r\n"
         "\n"
+        "-u     Base archive for delta backup. On backup, data in files of at least\r\n"
+        "       1 MB that are also found in the base archive is stored as differences\r\n"
+        "       against the data in base archive. On restore, the same base archive\r\n"
+        "       needs to be specified. Base archive must be an uncompressed disk file.\r\n"
+        "\n"
         "-- General options --\r\n" "\n"
         "-e     Exclude paths and files where any part of the relative path matches any\r\n"
         "       string in specified comma-separated list.\r\n"
@@ -154,6 +222,40 @@ usage()
         "       Default is to include all files and directories. -e takes presedence\r\n"
         "       over -i.\r\n"
         "\n"
+        "-h     Display progress every 10 seconds, or at specified interval in\r\n"
+        "       seconds: number of files, files/s, archive MB read and written and\r\n"
+        "       MB/s. When restoring from an archive file, also percent done and an\r\n"
+        "       estimate of time left. If a file name is given after a comma, the\r\n"
+        "       progress is written to that file instead of stderr.\r\n"
+        "\n"
+        "-q     Display time spent in each phase of the operation, such as directory\r\n"
+        "       listing, opening files, backup API calls and archive I/O, and bytes in\r\n"
+        "       each type of backup stream, when done. If a file name is given, the\r\n"
+        "       statistics are also written to that file in JSON format, including\r\n"
+        "       latency histograms for each phase.\r\n"
+        "\n"
+        "--trace:FILE\r\n"
+        "       Record start and end time of each file and each I/O operation and\r\n"
+        "       write them to FILE in Chrome trace format when done, for viewing in\r\n"
+        "       Perfetto or chrome://tracing. The last 65536 events are kept.\r\n"
+        "\n"
+        "--tee:DEST\r\n"
+        "       Also write the archive to DEST in the same pass, where DEST is a file\r\n"
+        "       name, or | followed by a command that reads the archive from stdin.\r\n"
+        "       Can be given up to 8 times. Each copy is written by its own thread.\r\n"
+        "\n"
+        "--volume:SIZE\r\n"
+        "       Split archive into volumes of SIZE bytes, with K, M, G or T suffix,\r\n"
+        "       named ARCHIVE.001, ARCHIVE.002 and so on. Each volume starts with a\r\n"
+        "       volume header. To read the archive, use --volume without size and\r\n"
+        "       ARCHIVE without volume number.\r\n"
+        "\n"
+        "--stripe:FILE,...\r\n"
+        "       Write archive in blocks of -b size to each FILE in turn, each by its\r\n"
+        "       own thread. Each FILE starts with a stripe header. ARCHIVE is a\r\n"
+        "       manifest listing the files. To read the archive, use --stripe\r\n"
+        "       without files and the manifest as ARCHIVE.\r\n"
+        "\n"
         "-v     Verbose debug mode to stderr. Useful to find out how strarc handles\r\n"
         "       errors in filesystems and archives.\r\n" "\n"
         "-z     Filter archive I/O through another program, e.g. a compression utility.\r\n"
@@ -168,6 +270,7 @@ usage()
         "usage examples, please read the file strarc.txt following this program file or\r\n"
         "download strarc.zip from http://www.ltr-data.se/opencode.html where the latest\r\n"
         "version should be available.\r\n",
+        SPARSE_ZERO_BLOCK_SIZE,
         TO_h(DEFAULT_STREAM_BUFFER_SIZE),
         TO_p(DEFAULT_STREAM_BUFFER_SIZE));
 
@@ -182,11 +285,33 @@ StrArc::Main(int argc, LPWSTR *argv)
 
     bool bBackupMode = false;
     bool bRestoreMode = false;
+    bool bMergeMode = false;
     bool bFilesFromStdIn = false;
     bool bFilesFromStdInUnicode = false;
+    bool bFilesFromStdInNulDelimited = false;
+    bool bFilesFromStdInUTF8 = false;
     DWORD dwArchiveCreation = CREATE_ALWAYS;
     LPWSTR wczFilterCmd = NULL;
     LPWSTR wczStartDir = NULL;
+    LPWSTR wczBaseArchive = NULL;
+    bool bStatisticsSummary = false;
+    LPWSTR wczStatisticsFile = NULL;
+    PerfStatistics statistics;
+    LPWSTR wczTraceFile = NULL;
+    TraceRecorder trace;
+    ListOutput listing;
+    bool bArchiveStatistics = false;
+    ArchiveStatistics content_statistics;
+    DWORD dwTestThreads = 1;
+    bool bStripeSet = false;
+    LPWSTR wczStripeFiles = NULL;
+    LPWSTR wczTeeTargets[TEE_MAX_TARGETS];
+    DWORD dwTeeTargets = 0;
+    bool bVolumeSet = false;
+    ULONGLONG VolumeSize = 0;
+    DWORD dwProgressInterval = 0;
+    LPWSTR wczProgressFile = NULL;
+    ProgressCounters progress;
 
     // Nice argument parse loop :)
     while (argc > 1 ? argv[1][0] ? ((argv[1][0] | 0x02) == L'/') &
@@ -197,19 +322,57 @@ StrArc::Main(int argc, LPWSTR *argv)
             switch (argv[1][0] | 0x20)
             {
             case L'c':
-                if (bRestoreMode || bTestMode)
+                if (bRestoreMode || bTestMode || bMergeMode)
                     return usage();
                 bBackupMode = true;
                 break;
             case L'x':
-                if (bBackupMode || bTestMode)
+                if (bBackupMode || bTestMode || bMergeMode)
                     return usage();
                 bRestoreMode = true;
                 break;
             case L't':
-                if (bBackupMode || bRestoreMode)
+                if (bBackupMode || bRestoreMode || bMergeMode)
                     return usage();
                 bTestMode = true;
+
+                if (argv[1][1] == L':')
+                {
+                    if (argv[1][2] == 0)
+                        return usage();
+
+                    for (argv[1] += 1; argv[1][1] != 0; argv[1]++)
+                        switch (argv[1][1])
+                        {
+                        case L's':
+                            bArchiveStatistics = true;
+                            break;
+                        case L'p':
+                        {
+                            LPWSTR suffix = NULL;
+                            dwTestThreads = wcstoul(argv[1] + 2, &suffix, 10);
+                            argv[1] = suffix - 2;
+                            if (dwTestThreads == 0)
+                            {
+                                SYSTEM_INFO system_info;
+                                GetSystemInfo(&system_info);
+                                dwTestThreads =
+                                    system_info.dwNumberOfProcessors;
+                            }
+                            if (dwTestThreads < 2)
+                                dwTestThreads = 2;
+                            break;
+                        }
+                        default:
+                            return usage();
+                        }
+                }
+
+                break;
+            case L'y':
+                if (bBackupMode || bRestoreMode || bTestMode)
+                    return usage();
+                bMergeMode = true;
                 break;
             case L'a':
                 dwArchiveCreation = OPEN_ALWAYS;
@@ -250,6 +413,32 @@ StrArc::Main(int argc, LPWSTR *argv)
                 break;
             case L'l':
                 bListFiles = true;
+
+                if (argv[1][1] == L':')
+                {
+                    if (argv[1][2] == 0)
+                        return usage();
+
+                    for (argv[1] += 1; argv[1][1] != 0; argv[1]++)
+                        switch (argv[1][1])
+                        {
+                        case L'0':
+                            listing.SetNulDelimited();
+                            break;
+                        case L'8':
+                            listing.SetUTF8();
+                            break;
+                        case L'j':
+                            listing.SetFormat(LIST_FORMAT_JSON);
+                            break;
+                        case L'c':
+                            listing.SetFormat(LIST_FORMAT_CSV);
+                            break;
+                        default:
+                            return usage();
+                        }
+                }
+
                 break;
             case L'v':
                 bVerbose = true;
@@ -260,6 +449,28 @@ StrArc::Main(int argc, LPWSTR *argv)
             case L'f':
                 bFilesFromStdInUnicode = argv[1][0] == L'F';
                 bFilesFromStdIn = true;
+
+                if (argv[1][1] == L':')
+                {
+                    if (argv[1][2] == 0)
+                        return usage();
+
+                    for (argv[1] += 1; argv[1][1] != 0; argv[1]++)
+                        switch (argv[1][1])
+                        {
+                        case L'0':
+                            bFilesFromStdInNulDelimited = true;
+                            break;
+                        case L'8':
+                            if (bFilesFromStdInUnicode)
+                                return usage();
+                            bFilesFromStdInUTF8 = true;
+                            break;
+                        default:
+                            return usage();
+                        }
+                }
+
                 break;
             case L'r':
                 bBackupRegistrySnapshots = true;
@@ -334,6 +545,12 @@ StrArc::Main(int argc, LPWSTR *argv)
                     case L'l':
                         bHardLinkSupport = false;
                         break;
+                    case L'n':
+                        if (!bMergeMode)
+                            return usage();
+
+                        bSkipAlternateStreams = true;
+                        break;
                     case L's':
                         bProcessSecurity = FALSE;
                         break;
@@ -348,6 +565,57 @@ StrArc::Main(int argc, LPWSTR *argv)
                     }
                 }
 
+                break;
+            case L'g':
+                if (argv[1][1] != L':')
+                    return usage();
+                if (argv[1][2] == 0)
+                    return usage();
+
+                for (argv[1] += 1; argv[1][1] != 0; argv[1]++)
+                {
+                    switch (argv[1][1])
+                    {
+                    case L'p':
+                        if (!bBackupMode)
+                            return usage();
+
+                        bFrontCodedPaths = true;
+                        break;
+                    case L's':
+                        if (!bBackupMode)
+                            return usage();
+
+                        bSecurityDictionary = true;
+                        break;
+                    case L'z':
+                        if (!bBackupMode)
+                            return usage();
+
+                        bSparseZeroBlocks = true;
+                        break;
+                    default:
+                        return usage();
+                    }
+                }
+
+                break;
+            case L'p':
+                if (!bBackupMode)
+                    return usage();
+
+                if (argv[1][1] != L':')
+                {
+                    ReadOrder = READ_ORDER_FILE_ID;
+                    break;
+                }
+
+                if (_wcsicmp(argv[1] + 1, L":e") == 0)
+                    ReadOrder = READ_ORDER_EXTENT;
+                else
+                    return usage();
+
+                argv[1] += 2;
                 break;
             case L'w':
                 if (argv[1][1] != L':')
@@ -391,6 +659,139 @@ StrArc::Main(int argc, LPWSTR *argv)
                 wczFilterCmd = argv[1] + 2;
                 argv[1] += wcslen(argv[1]) - 1;
                 break;
+            case L'u':
+                if (argv[1][1] != L':')
+                    return usage();
+                if (argv[1][2] == 0)
+                    return usage();
+                wczBaseArchive = argv[1] + 2;
+                argv[1] += wcslen(argv[1]) - 1;
+                break;
+            case L'h':
+            {
+                dwProgressInterval = PROGRESS_DEFAULT_INTERVAL;
+                if (argv[1][1] != L':')
+                    break;
+                if (argv[1][2] == 0)
+                    return usage();
+                LPWSTR suffix = NULL;
+                if (argv[1][2] != L',')
+                    dwProgressInterval = wcstoul(argv[1] + 2, &suffix, 0);
+                else
+                    suffix = argv[1] + 2;
+                switch (*suffix)
+                {
+                case 0:
+                    break;
+                case L',':
+                    if (suffix[1] == 0)
+                        return usage();
+                    wczProgressFile = suffix + 1;
+                    break;
+                default:
+                    return usage();
+                }
+                // The interval is waited for in milliseconds.
+                if ((dwProgressInterval == 0) ||
+                    (dwProgressInterval > MAXDWORD / 1000))
+                    return usage();
+                argv[1] += wcslen(argv[1]) - 1;
+                break;
+            }
+            case L'q':
+                Statistics = &statistics;
+                bStatisticsSummary = true;
+                if (argv[1][1] != L':')
+                    break;
+                if (argv[1][2] == 0)
+                    return usage();
+                wczStatisticsFile = argv[1] + 2;
+                argv[1] += wcslen(argv[1]) - 1;
+                break;
+            case L'-':
+                // Long options, --name:VALUE, use rest of the argument.
+                if ((_wcsnicmp(argv[1] + 1, L"trace:", 6) == 0) &&
+                    (argv[1][7] != 0))
+                {
+                    wczTraceFile = argv[1] + 7;
+                    argv[1] += wcslen(argv[1]) - 1;
+                    break;
+                }
+
+                if ((_wcsnicmp(argv[1] + 1, L"tee:", 4) == 0) &&
+                    (argv[1][5] != 0))
+                {
+                    if (dwTeeTargets >= TEE_MAX_TARGETS)
+                        return usage();
+
+                    wczTeeTargets[dwTeeTargets++] = argv[1] + 5;
+                    argv[1] += wcslen(argv[1]) - 1;
+                    break;
+                }
+
+                if (_wcsnicmp(argv[1] + 1, L"volume", 6) == 0)
+                {
+                    if (argv[1][7] == L':')
+                    {
+                        LPWSTR suffix = NULL;
+                        VolumeSize = _wcstoui64(argv[1] + 8, &suffix, 0);
+                        int iShift = 0;
+                        switch (*suffix)
+                        {
+                        case 0:
+                            break;
+                        case L'T':
+                            iShift += 10;
+                        case L'G':
+                            iShift += 10;
+                        case L'M':
+                            iShift += 10;
+                        case L'K':
+                            iShift += 10;
+                            if (suffix[1] == 0)
+                                break;
+                        default:
+                            return usage();
+                        }
+
+                        // Volume size must fit in a file offset after the
+                        // suffix has been applied.
+                        if (VolumeSize > ((ULONGLONG)MAXLONGLONG >> iShift))
+                            return usage();
+
+                        VolumeSize <<= iShift;
+
+                        // Each volume needs room for its volume header and
+                        // some archive data.
+                        if (VolumeSize <= sizeof(STRARC_VOLUME_HEADER))
+                            return usage();
+                    }
+                    else if (argv[1][7] != 0)
+                        return usage();
+
+                    bVolumeSet = true;
+                    argv[1] += wcslen(argv[1]) - 1;
+                    break;
+                }
+
+                if (_wcsnicmp(argv[1] + 1, L"stripe", 6) == 0)
+                {
+                    if (argv[1][7] == L':')
+                    {
+                        if (argv[1][8] == 0)
+                            return usage();
+
+                        wczStripeFiles = argv[1] + 8;
+                    }
+                    else if (argv[1][7] != 0)
+                        return usage();
+
+                    bStripeSet = true;
+                    argv[1] += wcslen(argv[1]) - 1;
+                    break;
+                }
+
+                return usage();
             default:
                 return usage();
             }
@@ -406,17 +807,42 @@ StrArc::Main(int argc, LPWSTR *argv)
         --argc;
     }
 
-    // More than one parameter is only allowed in backup mode.
-    if ((argc > 2) && (!bBackupMode))
+    // Needs one of -c, -x, -t or -y switches.
+    if (((int)bBackupMode + (int)bRestoreMode + (int)bTestMode +
+        (int)bMergeMode) != 1)
+        return usage();
+
+    // Merge needs output archive and at least one archive to merge, and
+    // cannot create delta streams.
+    if (bMergeMode && ((argc < 3) || (wczBaseArchive != NULL)))
         return usage();
 
-    // Needs one of -c, -x or -t switches.
-    if (((int)bBackupMode + (int)bRestoreMode + (int)bTestMode) != 1)
+    // More than one archive to restore or test is a full archive followed by
+    // later incremental or differential archives. They are merged while
+    // restoring and must be uncompressed disk files.
+    bool bArchiveChain = (bRestoreMode || bTestMode) && (argc > 2);
+
+    if (bArchiveChain && (wczFilterCmd != NULL))
         return usage();
 
-    if (bListFiles && (bTestMode || bVerbose))
+    // With -t, -l is only needed to select output format.
+    if (bListFiles && bVerbose)
     {
-        fputs("The -l option cannot be used with -t or -v.\r\n", stderr);
+        fputs("The -l option cannot be used with -v.\r\n", stderr);
+        return 1;
+    }
+
+    // Catalogs list information from archive headers.
+    if (listing.IsCatalog() && !bTestMode)
+    {
+        fputs("Catalog formats of -l can only be used with -t.\r\n", stderr);
+        return 1;
+    }
+
+    // Archive statistics are written to stdout instead of file names.
+    if (bArchiveStatistics && bListFiles)
+    {
+        fputs("The -l option cannot be used with -t:s.\r\n", stderr);
         return 1;
     }
 
@@ -424,13 +850,79 @@ StrArc::Main(int argc, LPWSTR *argv)
     bool bTargetStdOut = (!bListOnly) &&
         (argc < 2 || (argv[1][0] == 0) || (wcscmp(argv[1], L"-") == 0));
 
-    if (bListFiles && bBackupMode && bTargetStdOut)
+    // Ranges of the archive are tested with separate handles to the archive
+    // file.
+    if ((dwTestThreads > 1) &&
+        (bArchiveChain || bArchiveStatistics || bVerbose || bTargetStdOut ||
+            (wczFilterCmd != NULL)))
+    {
+        fputs("The -t:p option needs a single uncompressed archive file and "
+            "cannot be used\r\nwith -t:s or -v.\r\n", stderr);
+        return 1;
+    }
+
+    // Stripe files are listed when creating an archive and found in the
+    // manifest, given as archive name, when reading the archive.
+    if (bStripeSet &&
+        (bTargetStdOut || bArchiveChain || (dwTestThreads > 1) ||
+            (dwArchiveCreation == OPEN_ALWAYS) ||
+            ((wczStripeFiles != NULL) != (bBackupMode || bMergeMode))))
+    {
+        fputs("The --stripe option needs a manifest file name, with stripe "
+            "files only when\r\ncreating an archive, and cannot be used "
+            "with -a, -t:p or archive chains.\r\n", stderr);
+        return 1;
+    }
+
+    // Volume size is given when creating an archive, and volumes are found by
+    // archive name followed by volume number when reading the archive.
+    if (bVolumeSet &&
+        (bTargetStdOut || bArchiveChain || bStripeSet ||
+            (dwTestThreads > 1) || (dwArchiveCreation == OPEN_ALWAYS) ||
+            ((VolumeSize != 0) != (bBackupMode || bMergeMode))))
+    {
+        fputs("The --volume option needs an archive name, with volume size "
+            "only when creating\r\nan archive, and cannot be used with -a, "
+            "-t:p, --stripe or archive chains.\r\n", stderr);
+        return 1;
+    }
+
+    // Copies of the archive are only written when creating an archive.
+    if ((dwTeeTargets > 0) && (bListOnly || !(bBackupMode || bMergeMode)))
+    {
+        fputs("The --tee option can only be used when creating an "
+            "archive.\r\n", stderr);
+        return 1;
+    }
+
+    if (bListFiles && (bBackupMode || bMergeMode) && bTargetStdOut)
     {
         fputs("Cannot list files when creating an archive to stdout.\r\n",
             stderr);
         return 1;
     }
 
+    // Trace events are recorded when timing operations for statistics.
+    if (wczTraceFile != NULL)
+    {
+        if (!trace.Initialize())
+            Exception(XE_NOT_ENOUGH_MEMORY);
+
+        statistics.SetTrace(&trace);
+        Statistics = &statistics;
+    }
+
+    // Listed names are written to stdout through a large buffer. Backups
+    // list files with -l also when verbose output is written to stderr.
+    if ((bListFiles && bBackupMode) ||
+        ((bListFiles || bTestMode) && !bVerbose && !bArchiveStatistics))
+    {
+        if (!listing.Initialize(GetStdHandle(STD_OUTPUT_HANDLE)))
+            Exception(XE_NOT_ENOUGH_MEMORY);
+
+        Listing = &listing;
+    }
+
     XError bufferstatus = InitializeBuffer();
 
     if (bufferstatus != XE_NOERROR)
@@ -448,30 +940,128 @@ StrArc::Main(int argc, LPWSTR *argv)
                     "No registry snapshots will be backed up.%%n", errmsg);
             }
 
-    if (!bListOnly && !OpenArchive(bTargetStdOut ? NULL : argv[1],
-        bBackupMode,
-        dwArchiveCreation))
+    if (!bListOnly && !bArchiveChain &&
+        !(bStripeSet ?
+            OpenStripeSet(argv[1],
+                wczStripeFiles,
+                bBackupMode || bMergeMode) :
+            bVolumeSet ?
+            OpenVolumeSet(argv[1],
+                VolumeSize,
+                bBackupMode || bMergeMode) :
+            OpenArchive(bTargetStdOut ? NULL : argv[1],
+                bBackupMode || bMergeMode,
+                dwArchiveCreation)))
+    {
+        Exception(XE_ARCHIVE_OPEN, bTargetStdOut ? NULL : argv[1]);
+    }
+
+    // Copies of the archive get the same data as the archive, after any
+    // filter utility.
+    if ((dwTeeTargets > 0) &&
+        !OpenTeeTargets(dwTeeTargets, wczTeeTargets, dwArchiveCreation))
     {
         Exception(XE_ARCHIVE_OPEN, bTargetStdOut ? NULL : argv[1]);
     }
 
     // If we should filter through a compression utility.
-    if (wczFilterCmd != NULL && !OpenFilterUtility(wczFilterCmd, bBackupMode))
+    if (wczFilterCmd != NULL &&
+        !OpenFilterUtility(wczFilterCmd, bBackupMode || bMergeMode))
     {
         Exception(XE_FILTER_EXECUTE, wczFilterCmd);
     }
 
+    // Base archive for delta streams is opened before changing directory, so
+    // that a relative path is relative to current directory like the archive.
+    if (wczBaseArchive != NULL && !OpenBaseArchive(wczBaseArchive))
+    {
+        Exception(XE_ARCHIVE_OPEN, wczBaseArchive);
+    }
+
+    // Progress reports start when archive is open, so that its size is known
+    // when restoring from an archive file.
+    ProgressReporter *Reporter = NULL;
+    if (dwProgressInterval != 0)
+    {
+        Progress = &progress;
+        Reporter = StartProgressReport(dwProgressInterval, wczProgressFile);
+
+        if (Reporter == NULL)
+        {
+            WErrMsgA errmsg;
+            oem_printf(stderr,
+                "strarc: Cannot start progress reports: %1%%n", errmsg);
+        }
+    }
+
     argv++;
     argc--;
 
+    // Archives to merge are opened before changing directory, like the
+    // output archive.
+    if (bMergeMode)
+    {
+        if (dwBufferSize < HEADER_SIZE)
+            Exception(XE_BAD_BUFFER);
+
+        bool bMerged = MergeArchives(argc - 1, argv + 1);
+
+        // Archive is closed before the summary, so that errors in threads
+        // writing or reading it are reported first and give an error exit
+        // code.
+        bool bArchiveClosed = CloseArchive();
+
+        if (bVerbose)
+            fprintf(stderr,
+                "strarc %s, %I64u file%s merged.\n",
+                bCancel ? "cancelled" : "done",
+                FileCounter,
+                FileCounter != 1 ? "s" : "");
+
+        StopProgressReport(Reporter);
+        Progress = NULL;
+
+        listing.Flush();
+        Listing = NULL;
+
+        ReportStatistics(bStatisticsSummary, wczStatisticsFile, wczTraceFile);
+        Statistics = NULL;
+
+        return (bMerged && bArchiveClosed) ? 0 : 1;
+    }
+
     if (!OpenWorkingDirectory(wczStartDir, bBackupMode))
     {
         Exception(XE_CHANGE_DIR, wczStartDir);
     }
 
+    if (bArchiveStatistics)
+        ContentStatistics = &content_statistics;
+
     if (bRestoreMode || bTestMode)
     {
-        RestoreDirectoryTree();
+        bool bRestored = true;
+
+        if (!bArchiveChain)
+            if (bArchiveStatistics)
+                ScanArchiveStatistics();
+            else if ((dwTestThreads > 1) && bSeekableArchive)
+            {
+                if (!TestArchiveRanges(argv[0], dwTestThreads) && !bCancel)
+                    bRestored = false;
+            }
+            else
+                RestoreDirectoryTree();
+        else if (!RestoreArchiveChain(argc, argv) && !bCancel)
+        {
+            WErrMsgA errmsg;
+            oem_printf(stderr,
+                "strarc: Error merging archives: %1%%n", errmsg);
+
+            bRestored = false;
+        }
+
+        bool bArchiveClosed = CloseArchive();
 
         if (bVerbose)
             if (bCancel)
@@ -487,7 +1077,22 @@ StrArc::Main(int argc, LPWSTR *argv)
                     FileCounter != 1 ? "s" : "",
                     bTestMode ? "found in archive" : "restored");
 
-        return 0;
+        StopProgressReport(Reporter);
+        Progress = NULL;
+
+        listing.Flush();
+        Listing = NULL;
+
+        if (bArchiveStatistics)
+        {
+            content_statistics.PrintReport(stdout, ArchivePosition);
+            ContentStatistics = NULL;
+        }
+
+        ReportStatistics(bStatisticsSummary, wczStatisticsFile, wczTraceFile);
+        Statistics = NULL;
+
+        return (bRestored && bArchiveClosed) ? 0 : 1;
     }
 
     if (dwBufferSize < HEADER_SIZE)
@@ -497,12 +1102,17 @@ StrArc::Main(int argc, LPWSTR *argv)
         BackupFiles(argc, argv);
     else if (bFilesFromStdIn)
         if (bFilesFromStdInUnicode)
-            BackupFilenamesFromStreamW(GetStdHandle(STD_INPUT_HANDLE));
+            BackupFilenamesFromStreamW(GetStdHandle(STD_INPUT_HANDLE),
+                bFilesFromStdInNulDelimited ? L'\0' : L'\n');
         else
-            BackupFilenamesFromStreamA(GetStdHandle(STD_INPUT_HANDLE));
+            BackupFilenamesFromStreamA(GetStdHandle(STD_INPUT_HANDLE),
+                bFilesFromStdInUTF8 ? CP_UTF8 : CP_ACP,
+                bFilesFromStdInNulDelimited ? '\0' : '\n');
     else
         BackupCurrentDirectory();
 
+    bool bArchiveClosed = CloseArchive();
+
     if (bVerbose)
         if (bCancel)
             fprintf(stderr,
@@ -517,5 +1127,14 @@ StrArc::Main(int argc, LPWSTR *argv)
                 FileCounter != 1 ? "s" : "",
                 bListOnly ? "found" : "backed up");
 
-    return 0;
+    StopProgressReport(Reporter);
+    Progress = NULL;
+
+    listing.Flush();
+    Listing = NULL;
+
+    ReportStatistics(bStatisticsSummary, wczStatisticsFile, wczTraceFile);
+    Statistics = NULL;
+
+    return bArchiveClosed ? 0 : 1;
 }
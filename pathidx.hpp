@@ -0,0 +1,507 @@
+#include <malloc.h>
+
+// One range of the unnamed data stream of a file stored in a base archive.
+// Files stored as sparse blocks in base archive have one extent for each
+// block, other files have a single extent.
+struct BaseArchiveExtent
+{
+  LONGLONG FileOffset;
+  LONGLONG ArchiveOffset;
+  LONGLONG Length;
+};
+
+// This class holds the locations of the unnamed data stream of one file in a
+// base archive used for delta backups. Items are looked up by the path of
+// the file as stored in the archive.
+class BaseArchiveItem
+{
+
+private:
+
+  UNICODE_STRING Name;
+  BaseArchiveExtent *Extents;
+  DWORD dwExtents;
+  DWORD dwMaxExtents;
+  LONGLONG DataSize;
+  BaseArchiveItem *Next;
+
+  BaseArchiveItem(BaseArchiveItem * _Next,
+		  PUNICODE_STRING _Name)
+    : Extents(NULL),
+      dwExtents(0),
+      dwMaxExtents(0),
+      DataSize(0),
+      Next(_Next)
+  {
+    Name.Buffer = (PWSTR) malloc(_Name->Length);
+
+    if (Name.Buffer == NULL)
+      return;
+
+    Name.Length = _Name->Length;
+    Name.MaximumLength = _Name->Length;
+
+    RtlCopyUnicodeString(&Name, _Name);
+  }
+
+  ~BaseArchiveItem()
+  {
+    if (Name.Buffer != NULL)
+      free(Name.Buffer);
+
+    if (Extents != NULL)
+      free(Extents);
+  }
+
+public:
+
+  // Simple FNV-1a hash of path name.
+  static
+  DWORD Hash(PUNICODE_STRING _Name)
+  {
+    DWORD hash = 2166136261UL;
+
+    for (USHORT i = 0; i < (_Name->Length >> 1); i++)
+      hash = (hash ^ _Name->Buffer[i]) * 16777619UL;
+
+    return hash;
+  }
+
+  BaseArchiveItem *DeleteAndGetNext()
+  {
+    BaseArchiveItem *next_item = Next;
+    delete this;
+    return next_item;
+  }
+
+  static
+  BaseArchiveItem *NewItem(BaseArchiveItem * Next,
+			   PUNICODE_STRING Name)
+  {
+    BaseArchiveItem *item = new BaseArchiveItem(Next, Name);
+
+    if (item == NULL)
+      return NULL;
+
+    if (item->Name.Buffer == NULL)
+      {
+	delete item;
+	return NULL;
+      }
+
+    return item;
+  }
+
+  // Adds a range of file data found at ArchiveOffset in base archive.
+  // Extents must be added in order of file offset and must not overlap.
+  // Empty extents only extend the data size. Returns false if the extent is
+  // out of order, or if there is not enough memory.
+  bool AddExtent(LONGLONG FileOffset,
+		 LONGLONG ArchiveOffset,
+		 LONGLONG Length)
+  {
+    if ((FileOffset < DataSize) || (Length < 0))
+      return false;
+
+    DataSize = FileOffset + Length;
+
+    if (Length == 0)
+      return true;
+
+    if (dwExtents == dwMaxExtents)
+      {
+	DWORD dwNewMaxExtents = dwMaxExtents > 0 ? dwMaxExtents << 1 : 1;
+
+	BaseArchiveExtent *NewExtents = (BaseArchiveExtent *)
+	  realloc(Extents, sizeof(*Extents) * dwNewMaxExtents);
+
+	if (NewExtents == NULL)
+	  return false;
+
+	Extents = NewExtents;
+	dwMaxExtents = dwNewMaxExtents;
+      }
+
+    Extents[dwExtents].FileOffset = FileOffset;
+    Extents[dwExtents].ArchiveOffset = ArchiveOffset;
+    Extents[dwExtents].Length = Length;
+    ++dwExtents;
+
+    return true;
+  }
+
+  // Returns index of first extent that ends after FileOffset, or the number
+  // of extents if there is no such extent.
+  DWORD FindExtent(LONGLONG FileOffset) const
+  {
+    DWORD dwLow = 0;
+    DWORD dwHigh = dwExtents;
+
+    while (dwLow < dwHigh)
+      {
+	DWORD dwMiddle = dwLow + ((dwHigh - dwLow) >> 1);
+
+	if (Extents[dwMiddle].FileOffset + Extents[dwMiddle].Length >
+	    FileOffset)
+	  dwHigh = dwMiddle;
+	else
+	  dwLow = dwMiddle + 1;
+      }
+
+    return dwLow;
+  }
+
+  const BaseArchiveExtent *GetExtent(DWORD dwExtent) const
+  {
+    return dwExtent < dwExtents ? Extents + dwExtent : NULL;
+  }
+
+  bool
+  Match(PUNICODE_STRING _Name)
+  {
+    return RtlEqualUnicodeString(&Name, _Name, FALSE) != FALSE;
+  }
+
+  LONGLONG GetDataSize() const
+  {
+    return DataSize;
+  }
+
+  void SetNext(BaseArchiveItem * _Next)
+  {
+    Next = _Next;
+  }
+
+  BaseArchiveItem *GetNext()
+  {
+    return Next;
+  }
+};
+
+// This class holds the location of the newest record found for one file
+// when merging archives (-y). A file record is the file header followed by
+// all streams up to the next file header.
+class MergeArchiveItem
+{
+
+private:
+
+  UNICODE_STRING Name;
+  DWORD dwArchive;
+  LONGLONG RecordOffset;
+  LONGLONG RecordSize;
+  bool bRewriteStreams;
+  bool bDirectory;
+  ULONGLONG OrderKey;
+  MergeArchiveItem *Next;
+
+  MergeArchiveItem(MergeArchiveItem * _Next,
+		   PUNICODE_STRING _Name)
+    : Next(_Next),
+      dwArchive(0),
+      RecordOffset(0),
+      RecordSize(0),
+      bRewriteStreams(false),
+      bDirectory(false),
+      OrderKey(0)
+  {
+    Name.Buffer = (PWSTR) malloc(_Name->Length);
+
+    if (Name.Buffer == NULL)
+      return;
+
+    Name.Length = _Name->Length;
+    Name.MaximumLength = _Name->Length;
+
+    RtlCopyUnicodeString(&Name, _Name);
+  }
+
+  ~MergeArchiveItem()
+  {
+    if (Name.Buffer != NULL)
+      free(Name.Buffer);
+  }
+
+public:
+
+  MergeArchiveItem *DeleteAndGetNext()
+  {
+    MergeArchiveItem *next_item = Next;
+    delete this;
+    return next_item;
+  }
+
+  static
+  MergeArchiveItem *NewItem(MergeArchiveItem * Next,
+			    PUNICODE_STRING Name)
+  {
+    MergeArchiveItem *item = new MergeArchiveItem(Next, Name);
+
+    if (item == NULL)
+      return NULL;
+
+    if (item->Name.Buffer == NULL)
+      {
+	delete item;
+	return NULL;
+      }
+
+    return item;
+  }
+
+  bool
+  Match(PUNICODE_STRING _Name)
+  {
+    return RtlEqualUnicodeString(&Name, _Name, FALSE) != FALSE;
+  }
+
+  void
+  SetRecord(DWORD _dwArchive,
+	    LONGLONG _RecordOffset,
+	    LONGLONG _RecordSize,
+	    bool _bDirectory)
+  {
+    dwArchive = _dwArchive;
+    RecordOffset = _RecordOffset;
+    RecordSize = _RecordSize;
+    bRewriteStreams = false;
+    bDirectory = _bDirectory;
+  }
+
+  // Marks that some streams in the record need to be rewritten or left
+  // out. Streams in other records are copied in large blocks.
+  void
+  SetRewriteStreams()
+  {
+    bRewriteStreams = true;
+  }
+
+  bool
+  GetRewriteStreams() const
+  {
+    return bRewriteStreams;
+  }
+
+  void
+  SetRecordSize(LONGLONG _RecordSize)
+  {
+    RecordSize = _RecordSize;
+  }
+
+  PUNICODE_STRING GetName()
+  {
+    return &Name;
+  }
+
+  DWORD GetArchive() const
+  {
+    return dwArchive;
+  }
+
+  LONGLONG GetRecordOffset() const
+  {
+    return RecordOffset;
+  }
+
+  LONGLONG GetRecordSize() const
+  {
+    return RecordSize;
+  }
+
+  bool IsDirectory() const
+  {
+    return bDirectory;
+  }
+
+  // Position of the record in the merged archive, used by MergeArchiveIndex
+  // to sort items.
+  void SetOrderKey(ULONGLONG _OrderKey)
+  {
+    OrderKey = _OrderKey;
+  }
+
+  ULONGLONG GetOrderKey() const
+  {
+    return OrderKey;
+  }
+
+  MergeArchiveItem *GetNext()
+  {
+    return Next;
+  }
+};
+
+// This class finds merge items by path name and keeps them in the order
+// each path was first found. Before the merged archive is written, items are
+// sorted so that each directory comes after all files and directories in
+// it, like when backing up. Restoring the directory entry then sets its
+// timestamps after all files in it have been restored.
+class MergeArchiveIndex
+{
+
+private:
+
+  MergeArchiveItem **Buckets;
+  MergeArchiveItem **Items;
+  DWORD dwItemsCount;
+  DWORD dwItemsCapacity;
+
+  // Bits of the order key used to order directories that are moved to the
+  // same position.
+  enum
+    {
+      ORDER_KEY_DEPTH_BITS = 17
+    };
+
+  static
+  int
+  __cdecl
+  CompareOrderKeys(const void *Item1, const void *Item2)
+  {
+    ULONGLONG Key1 = (*(MergeArchiveItem **) Item1)->GetOrderKey();
+    ULONGLONG Key2 = (*(MergeArchiveItem **) Item2)->GetOrderKey();
+
+    return Key1 < Key2 ? -1 : Key1 > Key2 ? 1 : 0;
+  }
+
+public:
+
+  MergeArchiveIndex()
+    : Items(NULL),
+      dwItemsCount(0),
+      dwItemsCapacity(0)
+  {
+    Buckets = (MergeArchiveItem **)
+      LocalAlloc(LPTR, sizeof(*Buckets) * MERGE_ARCHIVE_INDEX_SIZE);
+  }
+
+  ~MergeArchiveIndex()
+  {
+    if (Buckets != NULL)
+      {
+	for (int i = 0; i < MERGE_ARCHIVE_INDEX_SIZE; i++)
+	  for (MergeArchiveItem *item = Buckets[i];
+	       item != NULL;
+	       item = item->DeleteAndGetNext());
+
+	LocalFree(Buckets);
+      }
+
+    if (Items != NULL)
+      LocalFree(Items);
+  }
+
+  bool
+  IsValid() const
+  {
+    return Buckets != NULL;
+  }
+
+  // Finds item for a path. Returns NULL if not found.
+  MergeArchiveItem *
+  Find(PUNICODE_STRING Name)
+  {
+    DWORD slot = BaseArchiveItem::Hash(Name) &
+      (MERGE_ARCHIVE_INDEX_SIZE - 1);
+
+    for (MergeArchiveItem *item = Buckets[slot];
+	 item != NULL;
+	 item = item->GetNext())
+      if (item->Match(Name))
+	return item;
+
+    return NULL;
+  }
+
+  // Finds item for a path. If not found, a new item is added last in
+  // order. Returns NULL if there is not enough memory.
+  MergeArchiveItem *
+  FindOrAdd(PUNICODE_STRING Name)
+  {
+    MergeArchiveItem *item = Find(Name);
+
+    if (item != NULL)
+      return item;
+
+    DWORD slot = BaseArchiveItem::Hash(Name) &
+      (MERGE_ARCHIVE_INDEX_SIZE - 1);
+
+    if (dwItemsCount == dwItemsCapacity)
+      {
+	DWORD new_capacity = dwItemsCapacity == 0 ?
+	  4096 : dwItemsCapacity << 1;
+
+	MergeArchiveItem **new_items = (MergeArchiveItem **)
+	  (Items == NULL ?
+	   LocalAlloc(LMEM_FIXED, new_capacity * sizeof(*Items)) :
+	   LocalReAlloc(Items, new_capacity * sizeof(*Items),
+			LMEM_MOVEABLE));
+
+	if (new_items == NULL)
+	  return NULL;
+
+	Items = new_items;
+	dwItemsCapacity = new_capacity;
+      }
+
+    item = MergeArchiveItem::NewItem(Buckets[slot], Name);
+
+    if (item == NULL)
+      return NULL;
+
+    Buckets[slot] = item;
+    Items[dwItemsCount++] = item;
+
+    return item;
+  }
+
+  // Moves each directory after the last file or directory in it, if any
+  // is found after the directory itself. A file added to an existing
+  // directory in an incremental archive is first found after the record of
+  // the directory in the full archive. Directories moved to the same
+  // position are ordered with the deepest directory first.
+  void
+  SortDirectoriesLast()
+  {
+    for (DWORD i = 0; i < dwItemsCount; i++)
+      Items[i]->SetOrderKey((ULONGLONG) i << ORDER_KEY_DEPTH_BITS);
+
+    for (DWORD i = 0; i < dwItemsCount; i++)
+      {
+	UNICODE_STRING parent = *Items[i]->GetName();
+
+	for (USHORT length = parent.Length >> 1; length > 0; )
+	  {
+	    if (parent.Buffer[--length] != L'\\')
+	      continue;
+
+	    parent.Length = (USHORT) (length << 1);
+
+	    MergeArchiveItem *directory = Find(&parent);
+
+	    if ((directory == NULL) ||
+		!directory->IsDirectory() ||
+		((directory->GetOrderKey() >> ORDER_KEY_DEPTH_BITS) >= i))
+	      continue;
+
+	    directory->SetOrderKey(((ULONGLONG) i << ORDER_KEY_DEPTH_BITS) |
+				   ((1UL << 16) - parent.Length));
+	  }
+      }
+
+    if (dwItemsCount > 1)
+      qsort(Items, dwItemsCount, sizeof(*Items), CompareOrderKeys);
+  }
+
+  DWORD
+  Count() const
+  {
+    return dwItemsCount;
+  }
+
+  MergeArchiveItem *
+  GetItem(DWORD dwIndex)
+  {
+    return Items[dwIndex];
+  }
+};
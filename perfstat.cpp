@@ -0,0 +1,311 @@
+/* Stream Archive I/O utility, Copyright (C) Olof Lagerkvist 2004-2022
+*
+* perfstat.cpp
+* Reports of per-phase performance counters (-q) and trace events (--trace).
+*/
+
+#ifndef _UNICODE
+#define _UNICODE
+#endif
+#ifndef _DLL
+#define _DLL
+#endif
+#ifndef UNICODE
+#define UNICODE
+#endif
+#ifndef _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#define WIN32_NO_STATUS
+#include <windows.h>
+#include <intsafe.h>
+#undef WIN32_NO_STATUS
+#include <ntdll.h>
+
+#include <winstrct.h>
+#include <wio.h>
+
+#include <stdio.h>
+
+#include "strarc.hpp"
+
+const char *perf_phase_names[] = {
+    "enumerate",        // Directory listing
+    "open",             // Opening and creating files
+    "query",            // File information queries
+    "backup_read",      // BackupRead
+    "backup_write",     // BackupWrite
+    "archive_read",     // Reading archive
+    "archive_write",    // Writing archive
+    "filter",           // -e and -i matching
+    "link_track",       // Hard link tracking
+    "set_attributes",   // Setting attributes and time stamps
+    "close",            // Closing files
+    "file"              // Complete file, including directory contents
+};
+
+LPCSTR
+PerfStatistics::GetPhaseName(PerfPhase Phase)
+{
+    return perf_phase_names[Phase];
+}
+
+// This function prints a table with time spent in each phase and bytes in
+// each type of backup stream.
+void
+PerfStatistics::PrintSummary(FILE *Stream, LONGLONG FileCount) const
+{
+    LONGLONG ElapsedMicroseconds = GetElapsedMicroseconds();
+
+    fprintf(Stream,
+        "\n"
+        "strarc statistics, %I64i files in %.3f seconds.\n"
+        "\n"
+        "Phase            Count       Seconds  Avg us      Max us      Bytes\n",
+        FileCount,
+        ElapsedMicroseconds / 1000000.0);
+
+    for (int i = 0; i < PERF_PHASE_COUNT; i++)
+    {
+        const PhaseCounters *counters = Phases + i;
+
+        if (counters->Count == 0)
+            continue;
+
+        fprintf(Stream,
+            "%-16s %-11I64i %-8.3f %-11I64i %-11I64i %I64i\n",
+            GetPhaseName((PerfPhase)i),
+            counters->Count,
+            TicksToMicroseconds(counters->Ticks) / 1000000.0,
+            TicksToMicroseconds(counters->Ticks) / counters->Count,
+            TicksToMicroseconds(counters->MaxTicks),
+            counters->Bytes);
+    }
+
+    fputs("\n"
+        "Stream type            Count       Bytes\n",
+        Stream);
+
+    for (DWORD i = 0; i < PERF_STREAM_TYPES; i++)
+    {
+        if (Streams[i].Count == 0)
+            continue;
+
+        fprintf(Stream,
+            "%-22s %-11I64i %I64i\n",
+            GetStreamIdDescription(i),
+            Streams[i].Count,
+            Streams[i].Bytes);
+    }
+}
+
+// This function writes the same counters as PrintSummary() as a JSON object
+// to a file, including latency histograms for each phase.
+bool
+PerfStatistics::WriteJson(LPCWSTR FileName, LONGLONG FileCount) const
+{
+    FILE *Stream = _wfopen(FileName, L"w");
+
+    if (Stream == NULL)
+        return false;
+
+    fprintf(Stream,
+        "{\n"
+        "  \"files\": %I64i,\n"
+        "  \"elapsed_us\": %I64i,\n"
+        "  \"histogram_bucket_limits_us\": \"2^n\",\n"
+        "  \"phases\": {",
+        FileCount,
+        GetElapsedMicroseconds());
+
+    bool bFirst = true;
+
+    for (int i = 0; i < PERF_PHASE_COUNT; i++)
+    {
+        const PhaseCounters *counters = Phases + i;
+
+        fprintf(Stream,
+            "%s\n"
+            "    \"%s\": {\n"
+            "      \"count\": %I64i,\n"
+            "      \"total_us\": %I64i,\n"
+            "      \"max_us\": %I64i,\n"
+            "      \"bytes\": %I64i,\n"
+            "      \"histogram\": [",
+            bFirst ? "" : ",",
+            GetPhaseName((PerfPhase)i),
+            counters->Count,
+            TicksToMicroseconds(counters->Ticks),
+            TicksToMicroseconds(counters->MaxTicks),
+            counters->Bytes);
+
+        for (int j = 0; j < PERF_HISTOGRAM_BUCKETS; j++)
+            fprintf(Stream, "%s%I64i",
+                j == 0 ? "" : ", ",
+                counters->Histogram[j]);
+
+        fputs("]\n    }", Stream);
+
+        bFirst = false;
+    }
+
+    fputs("\n  },\n  \"streams\": {", Stream);
+
+    bFirst = true;
+
+    for (DWORD i = 0; i < PERF_STREAM_TYPES; i++)
+    {
+        if (Streams[i].Count == 0)
+            continue;
+
+        fprintf(Stream,
+            "%s\n"
+            "    \"%s\": { \"count\": %I64i, \"bytes\": %I64i }",
+            bFirst ? "" : ",",
+            GetStreamIdDescription(i),
+            Streams[i].Count,
+            Streams[i].Bytes);
+
+        bFirst = false;
+    }
+
+    fputs("\n  }\n}\n", Stream);
+
+    bool bResult = ferror(Stream) == 0;
+
+    if (fclose(Stream) != 0)
+        bResult = false;
+
+    return bResult;
+}
+
+// This function writes a file name as a JSON string, converted to UTF-8.
+static void
+WriteJsonString(FILE *Stream, LPCWSTR String)
+{
+    fputc('"', Stream);
+
+    for (; *String != 0; String++)
+        switch (*String)
+        {
+        case L'"':
+            fputs("\\\"", Stream);
+            break;
+        case L'\\':
+            fputs("\\\\", Stream);
+            break;
+        default:
+            if (*String < 0x20)
+                fprintf(Stream, "\\u%.4x", *String);
+            else
+            {
+                int chars = IS_HIGH_SURROGATE(String[0]) &&
+                    IS_LOW_SURROGATE(String[1]) ? 2 : 1;
+
+                char utf8[4];
+                int length = WideCharToMultiByte(CP_UTF8, 0, String, chars,
+                    utf8, sizeof(utf8), NULL, NULL);
+
+                if (length > 0)
+                    fwrite(utf8, 1, length, Stream);
+
+                String += chars - 1;
+            }
+        }
+
+    fputc('"', Stream);
+}
+
+// This function writes recorded events in Chrome trace event format, which
+// can be opened in Perfetto or chrome://tracing. Each event is a complete
+// event with start time and duration in microseconds from start of trace.
+bool
+TraceRecorder::WriteJson(LPCWSTR FileName) const
+{
+    FILE *Stream = _wfopen(FileName, L"w");
+
+    if (Stream == NULL)
+        return false;
+
+    fputs("{\n"
+        "  \"displayTimeUnit\": \"ms\",\n"
+        "  \"traceEvents\": [",
+        Stream);
+
+    LONGLONG Count = EventCount;
+    LONGLONG First = Count > TRACE_RING_EVENTS ? Count - TRACE_RING_EVENTS : 0;
+    DWORD ProcessId = GetCurrentProcessId();
+
+    for (LONGLONG i = First; i < Count; i++)
+    {
+        const TraceEvent *event = Events + (i & (TRACE_RING_EVENTS - 1));
+
+        fprintf(Stream,
+            "%s\n"
+            "    { \"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+            "\"ts\": %.3f, \"dur\": %.3f, \"pid\": %u, \"tid\": %u, "
+            "\"args\": { \"bytes\": %I64i",
+            i == First ? "" : ",",
+            PerfStatistics::GetPhaseName(event->Phase),
+            event->Phase == PERF_PHASE_FILE ? "file" : "io",
+            (event->StartTicks - StartTicks) * 1000000.0 / Frequency,
+            (event->EndTicks - event->StartTicks) * 1000000.0 / Frequency,
+            ProcessId,
+            event->ThreadId,
+            event->Bytes);
+
+        if (event->Name[0] != 0)
+        {
+            fputs(", \"file\": ", Stream);
+            WriteJsonString(Stream, event->Name);
+        }
+
+        fputs(" } }", Stream);
+    }
+
+    fputs("\n  ]\n}\n", Stream);
+
+    bool bResult = ferror(Stream) == 0;
+
+    if (fclose(Stream) != 0)
+        bResult = false;
+
+    return bResult;
+}
+
+// This function prints statistics at end of a run, if enabled with -q, and
+// also writes them as JSON if a file name was given with the switch. Events
+// recorded with --trace are written to wczTraceFile.
+void
+StrArc::ReportStatistics(bool bSummary,
+    LPCWSTR wczJsonFile,
+    LPCWSTR wczTraceFile)
+{
+    if (Statistics == NULL)
+        return;
+
+    if (bSummary)
+        Statistics->PrintSummary(stderr, FileCounter);
+
+    if ((wczJsonFile != NULL) &&
+        !Statistics->WriteJson(wczJsonFile, FileCounter))
+    {
+        WErrMsgA errmsg;
+        oem_printf(stderr,
+            "strarc: Cannot write statistics to '%1!ws!': %2%%n",
+            wczJsonFile, errmsg);
+    }
+
+    if ((wczTraceFile != NULL) && (Statistics->GetTrace() != NULL) &&
+        !Statistics->GetTrace()->WriteJson(wczTraceFile))
+    {
+        WErrMsgA errmsg;
+        oem_printf(stderr,
+            "strarc: Cannot write trace to '%1!ws!': %2%%n",
+            wczTraceFile, errmsg);
+    }
+}
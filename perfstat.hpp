@@ -0,0 +1,386 @@
+// Phases of backup and restore operations timed when statistics are
+// enabled with the -q switch.
+enum PerfPhase
+{
+  PERF_PHASE_ENUMERATE,
+  PERF_PHASE_OPEN,
+  PERF_PHASE_QUERY,
+  PERF_PHASE_BACKUP_READ,
+  PERF_PHASE_BACKUP_WRITE,
+  PERF_PHASE_ARCHIVE_READ,
+  PERF_PHASE_ARCHIVE_WRITE,
+  PERF_PHASE_FILTER,
+  PERF_PHASE_LINK_TRACK,
+  PERF_PHASE_SET_ATTRIBUTES,
+  PERF_PHASE_CLOSE,
+  PERF_PHASE_FILE,
+  PERF_PHASE_COUNT
+};
+
+// Latency histogram bucket n counts operations that took less than 2^n
+// microseconds but at least 2^(n-1). The last bucket counts everything
+// slower than that.
+#define PERF_HISTOGRAM_BUCKETS 24
+
+// Bytes are counted for stream ids below this value, higher ids are
+// counted together with BACKUP_INVALID.
+#define PERF_STREAM_TYPES 16
+
+// Number of events kept by TraceRecorder, must be a power of two. When more
+// events are recorded, the oldest ones are overwritten.
+#define TRACE_RING_EVENTS 65536
+
+// Number of characters kept from the end of file names in trace events.
+#define TRACE_NAME_LENGTH 40
+
+// One timed operation recorded for --trace.
+struct TraceEvent
+{
+  LONGLONG StartTicks;
+  LONGLONG EndTicks;
+  LONGLONG Bytes;
+  DWORD ThreadId;
+  PerfPhase Phase;
+  WCHAR Name[TRACE_NAME_LENGTH];
+};
+
+// This class records begin and end time of timed operations in a ring
+// buffer shared by all threads. A slot is claimed with one interlocked
+// increment, so recording does not need any locks. Events are written as
+// Chrome trace JSON by WriteJson() when all threads are done.
+class TraceRecorder
+{
+
+private:
+
+  TraceEvent *Events;
+  volatile LONGLONG EventCount;
+  LONGLONG Frequency;
+  LONGLONG StartTicks;
+
+public:
+
+  TraceRecorder()
+    : Events(NULL),
+      EventCount(0),
+      Frequency(1),
+      StartTicks(0)
+  {
+  }
+
+  ~TraceRecorder()
+  {
+    if (Events != NULL)
+      VirtualFree(Events, 0, MEM_RELEASE);
+  }
+
+  // Allocates the ring buffer. Memory is only used as events are recorded.
+  bool
+  Initialize()
+  {
+    Events = (TraceEvent *)
+      VirtualAlloc(NULL, sizeof(TraceEvent) * TRACE_RING_EVENTS,
+		   MEM_COMMIT, PAGE_READWRITE);
+
+    if (Events == NULL)
+      return false;
+
+    LARGE_INTEGER counter;
+    QueryPerformanceFrequency(&counter);
+    Frequency = counter.QuadPart;
+    QueryPerformanceCounter(&counter);
+    StartTicks = counter.QuadPart;
+
+    return true;
+  }
+
+  void
+  AddEvent(PerfPhase Phase,
+	   LONGLONG _StartTicks,
+	   LONGLONG EndTicks,
+	   LONGLONG Bytes,
+	   PCUNICODE_STRING Name)
+  {
+    TraceEvent *event = Events +
+      ((InterlockedIncrement64(&EventCount) - 1) & (TRACE_RING_EVENTS - 1));
+
+    event->StartTicks = _StartTicks;
+    event->EndTicks = EndTicks;
+    event->Bytes = Bytes;
+    event->ThreadId = GetCurrentThreadId();
+    event->Phase = Phase;
+    event->Name[0] = 0;
+
+    if (Name != NULL)
+      {
+	// The end of a path says more than the beginning.
+	USHORT length = Name->Length / sizeof(WCHAR);
+	USHORT skip = length >= TRACE_NAME_LENGTH ?
+	  length - (TRACE_NAME_LENGTH - 1) : 0;
+
+	length -= skip;
+	CopyMemory(event->Name, Name->Buffer + skip, length * sizeof(WCHAR));
+	event->Name[length] = 0;
+      }
+  }
+
+  bool
+  WriteJson(LPCWSTR FileName) const;
+};
+
+// This class holds counters for one run. Counters are only updated with
+// interlocked operations, so that the same object can be shared by sessions
+// running in other threads, and read while being updated.
+class PerfStatistics
+{
+
+public:
+
+  struct PhaseCounters
+  {
+    volatile LONGLONG Count;
+    volatile LONGLONG Ticks;
+    volatile LONGLONG MaxTicks;
+    volatile LONGLONG Bytes;
+    volatile LONGLONG Histogram[PERF_HISTOGRAM_BUCKETS];
+  };
+
+  struct StreamCounters
+  {
+    volatile LONGLONG Count;
+    volatile LONGLONG Bytes;
+  };
+
+private:
+
+  PhaseCounters Phases[PERF_PHASE_COUNT];
+  StreamCounters Streams[PERF_STREAM_TYPES];
+  LONGLONG Frequency;
+  LONGLONG StartTicks;
+  TraceRecorder *Trace;
+
+public:
+
+  PerfStatistics()
+    : Trace(NULL)
+  {
+    ZeroMemory(Phases, sizeof(Phases));
+    ZeroMemory(Streams, sizeof(Streams));
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    Frequency = frequency.QuadPart;
+
+    StartTicks = Now();
+  }
+
+  static
+  LONGLONG Now()
+  {
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart;
+  }
+
+  LONGLONG
+  TicksToMicroseconds(LONGLONG Ticks) const
+  {
+    return Ticks / Frequency * 1000000 +
+      Ticks % Frequency * 1000000 / Frequency;
+  }
+
+  // Also records each timed operation with this object, if set.
+  void
+  SetTrace(TraceRecorder *_Trace)
+  {
+    Trace = _Trace;
+  }
+
+  TraceRecorder *
+  GetTrace() const
+  {
+    return Trace;
+  }
+
+  void
+  AddTime(PerfPhase Phase, LONGLONG _StartTicks, LONGLONG Bytes,
+	  PCUNICODE_STRING Name = NULL)
+  {
+    PhaseCounters *counters = Phases + Phase;
+    LONGLONG end_ticks = Now();
+    LONGLONG ticks = end_ticks - _StartTicks;
+
+    if (Trace != NULL)
+      Trace->AddEvent(Phase, _StartTicks, end_ticks, Bytes, Name);
+
+    InterlockedIncrement64(&counters->Count);
+    InterlockedExchangeAdd64(&counters->Ticks, ticks);
+
+    if (Bytes != 0)
+      InterlockedExchangeAdd64(&counters->Bytes, Bytes);
+
+    LONGLONG max_ticks = counters->MaxTicks;
+    while (ticks > max_ticks)
+      {
+	LONGLONG old_max =
+	  InterlockedCompareExchange64(&counters->MaxTicks, ticks, max_ticks);
+
+	if (old_max == max_ticks)
+	  break;
+
+	max_ticks = old_max;
+      }
+
+    int bucket = 0;
+    for (LONGLONG us = TicksToMicroseconds(ticks);
+	 (us != 0) && (bucket < PERF_HISTOGRAM_BUCKETS - 1);
+	 us >>= 1)
+      ++bucket;
+
+    InterlockedIncrement64(&counters->Histogram[bucket]);
+  }
+
+  void
+  AddStream(DWORD dwStreamId, LONGLONG Bytes)
+  {
+    StreamCounters *counters =
+      Streams + (dwStreamId < PERF_STREAM_TYPES ? dwStreamId : 0);
+
+    InterlockedIncrement64(&counters->Count);
+    InterlockedExchangeAdd64(&counters->Bytes, Bytes);
+  }
+
+  const PhaseCounters *
+  GetPhase(PerfPhase Phase) const
+  {
+    return Phases + Phase;
+  }
+
+  const StreamCounters *
+  GetStream(DWORD dwStreamId) const
+  {
+    return Streams + dwStreamId;
+  }
+
+  LONGLONG
+  GetElapsedMicroseconds() const
+  {
+    return TicksToMicroseconds(Now() - StartTicks);
+  }
+
+  static
+  LPCSTR GetPhaseName(PerfPhase Phase);
+
+  void
+  PrintSummary(FILE *Stream, LONGLONG FileCount) const;
+
+  bool
+  WriteJson(LPCWSTR FileName, LONGLONG FileCount) const;
+};
+
+// This class times a block of code and adds the time to a phase when it
+// goes out of scope. It does nothing if statistics are not enabled.
+class PerfTimer
+{
+
+private:
+
+  PerfStatistics *Statistics;
+  PerfPhase Phase;
+  LONGLONG StartTicks;
+  LONGLONG Bytes;
+  PCUNICODE_STRING Name;
+
+public:
+
+  // Name, if any, is shown in trace events and must stay valid until the
+  // timer goes out of scope.
+  PerfTimer(PerfStatistics * _Statistics, PerfPhase _Phase,
+	    PCUNICODE_STRING _Name = NULL)
+    : Statistics(_Statistics),
+      Phase(_Phase),
+      StartTicks(_Statistics != NULL ? PerfStatistics::Now() : 0),
+      Bytes(0),
+      Name(_Name)
+  {
+  }
+
+  ~PerfTimer()
+  {
+    if (Statistics != NULL)
+      Statistics->AddTime(Phase, StartTicks, Bytes, Name);
+  }
+
+  void
+  SetBytes(LONGLONG _Bytes)
+  {
+    Bytes = _Bytes;
+  }
+};
+
+// Default number of seconds between progress reports with the -h switch.
+#define PROGRESS_DEFAULT_INTERVAL 10
+
+// This class holds counters read by the progress reporter thread enabled
+// with -h. Like PerfStatistics, counters are only updated with interlocked
+// operations and are shared by sessions created by TemplateNew().
+class ProgressCounters
+{
+
+private:
+
+  volatile LONGLONG ArchiveBytesRead;
+  volatile LONGLONG ArchiveBytesSkipped;
+  volatile LONGLONG ArchiveBytesWritten;
+
+public:
+
+  ProgressCounters()
+    : ArchiveBytesRead(0),
+      ArchiveBytesSkipped(0),
+      ArchiveBytesWritten(0)
+  {
+  }
+
+  void
+  AddArchiveRead(LONGLONG Bytes)
+  {
+    InterlockedExchangeAdd64(&ArchiveBytesRead, Bytes);
+  }
+
+  // Bytes skipped by seeking in a seekable archive are counted separately
+  // so that position in the archive is known without counting them as
+  // transferred.
+  void
+  AddArchiveSkipped(LONGLONG Bytes)
+  {
+    InterlockedExchangeAdd64(&ArchiveBytesSkipped, Bytes);
+  }
+
+  void
+  AddArchiveWritten(LONGLONG Bytes)
+  {
+    InterlockedExchangeAdd64(&ArchiveBytesWritten, Bytes);
+  }
+
+  LONGLONG
+  GetArchiveRead() const
+  {
+    return InterlockedCompareExchange64((volatile LONGLONG *)
+					&ArchiveBytesRead, 0, 0);
+  }
+
+  LONGLONG
+  GetArchiveSkipped() const
+  {
+    return InterlockedCompareExchange64((volatile LONGLONG *)
+					&ArchiveBytesSkipped, 0, 0);
+  }
+
+  LONGLONG
+  GetArchiveWritten() const
+  {
+    return InterlockedCompareExchange64((volatile LONGLONG *)
+					&ArchiveBytesWritten, 0, 0);
+  }
+};
@@ -0,0 +1,293 @@
+/* Stream Archive I/O utility, Copyright (C) Olof Lagerkvist 2004-2022
+*
+* progress.cpp
+* Periodic progress reports with throughput and time left (-h).
+*/
+
+#ifndef _UNICODE
+#define _UNICODE
+#endif
+#ifndef _DLL
+#define _DLL
+#endif
+#ifndef UNICODE
+#define UNICODE
+#endif
+#ifndef _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#define WIN32_NO_STATUS
+#include <process.h>
+#include <windows.h>
+#include <intsafe.h>
+#undef WIN32_NO_STATUS
+#include <ntdll.h>
+
+#include <winstrct.h>
+#include <wio.h>
+
+#include <stdio.h>
+
+#include "strarc.hpp"
+
+class StrArc::ProgressReporter
+{
+    StrArc *Session;
+    DWORD dwInterval;
+    LPCWSTR wczStatusFile;
+
+    // Size of archive being read, if known, otherwise zero.
+    LONGLONG TotalBytes;
+
+    LONGLONG Frequency;
+    LONGLONG StartTicks;
+
+    // Counter values at previous report, used to calculate current rates.
+    LONGLONG LastTicks;
+    LONGLONG LastFiles;
+    LONGLONG LastBytesRead;
+    LONGLONG LastBytesWritten;
+
+    HANDLE StopEvent;
+    HANDLE ReporterThreadHandle;
+
+    static
+        unsigned
+        CALLBACK
+        ReporterThread(void *lpCtx)
+    {
+        ProgressReporter *Context = (ProgressReporter *)lpCtx;
+
+        while (WaitForSingleObject(Context->StopEvent,
+            Context->dwInterval * 1000) == WAIT_TIMEOUT)
+            Context->Report(false);
+
+        return 0;
+    }
+
+    // This function calculates rates since last report and time left, and
+    // prints a line to stderr or replaces the status file.
+    void
+        Report(bool bDone)
+    {
+        LONGLONG Ticks = PerfStatistics::Now();
+        LONGLONG Files = InterlockedCompareExchange64(&Session->FileCounter,
+            0, 0);
+        LONGLONG BytesRead = Session->Progress->GetArchiveRead();
+        LONGLONG BytesWritten = Session->Progress->GetArchiveWritten();
+        LONGLONG Position = BytesRead + Session->Progress->GetArchiveSkipped();
+
+        double Elapsed = (double)(Ticks - StartTicks) / Frequency;
+        double Interval = (double)(Ticks - LastTicks) / Frequency;
+        if (Interval <= 0)
+            Interval = 1;
+
+        double FilesPerSecond = (Files - LastFiles) / Interval;
+        double ReadPerSecond = (BytesRead - LastBytesRead) / Interval;
+        double WrittenPerSecond = (BytesWritten - LastBytesWritten) / Interval;
+
+        LastTicks = Ticks;
+        LastFiles = Files;
+        LastBytesRead = BytesRead;
+        LastBytesWritten = BytesWritten;
+
+        // Time left is estimated from average rate since start, which is less
+        // sensitive to directories of small files than current rate.
+        LONGLONG Remaining = -1;
+        LONGLONG SecondsLeft = -1;
+        if ((TotalBytes > 0) && !bDone)
+        {
+            Remaining = TotalBytes > Position ? TotalBytes - Position : 0;
+
+            if ((Position > 0) && (Elapsed > 0))
+                SecondsLeft = (LONGLONG)(Remaining / (Position / Elapsed));
+        }
+
+        if (wczStatusFile == NULL)
+        {
+            fprintf(stderr,
+                "strarc: %I64i files, %.1f files/s, "
+                "read %.1f MB %.1f MB/s, written %.1f MB %.1f MB/s",
+                Files,
+                FilesPerSecond,
+                BytesRead / 1048576.0,
+                ReadPerSecond / 1048576.0,
+                BytesWritten / 1048576.0,
+                WrittenPerSecond / 1048576.0);
+
+            if (Remaining >= 0)
+                fprintf(stderr, ", %.1f%%",
+                    TotalBytes > 0 ? Position * 100.0 / TotalBytes : 0.0);
+
+            if (SecondsLeft >= 0)
+                fprintf(stderr, ", %I64i:%.2i:%.2i left",
+                    SecondsLeft / 3600,
+                    (int)(SecondsLeft / 60 % 60),
+                    (int)(SecondsLeft % 60));
+
+            fputs("\n", stderr);
+
+            return;
+        }
+
+        // The status file is written under another name and then moved over
+        // the old one, so that a reader never sees a partly written file.
+        size_t TempNameLength = wcslen(wczStatusFile) + 5;
+        WHeapMem<WCHAR> TempName(TempNameLength * sizeof(WCHAR),
+            HEAP_GENERATE_EXCEPTIONS);
+        _snwprintf(TempName, TempNameLength, L"%ws.tmp", wczStatusFile);
+
+        FILE *Stream = _wfopen(TempName, L"w");
+        if (Stream == NULL)
+            return;
+
+        fprintf(Stream,
+            "state=%s\n"
+            "elapsed_seconds=%.0f\n"
+            "files=%I64i\n"
+            "files_per_second=%.1f\n"
+            "archive_read_bytes=%I64i\n"
+            "archive_read_bytes_per_second=%.0f\n"
+            "archive_written_bytes=%I64i\n"
+            "archive_written_bytes_per_second=%.0f\n",
+            bDone ? "done" : "running",
+            Elapsed,
+            Files,
+            FilesPerSecond,
+            BytesRead,
+            ReadPerSecond,
+            BytesWritten,
+            WrittenPerSecond);
+
+        if (TotalBytes > 0)
+            fprintf(Stream,
+                "archive_position=%I64i\n"
+                "archive_size=%I64i\n",
+                Position,
+                TotalBytes);
+
+        if (Remaining >= 0)
+            fprintf(Stream, "remaining_bytes=%I64i\n", Remaining);
+
+        if (SecondsLeft >= 0)
+            fprintf(Stream, "seconds_left=%I64i\n", SecondsLeft);
+
+        bool bWritten = ferror(Stream) == 0;
+
+        if (fclose(Stream) != 0)
+            bWritten = false;
+
+        if (bWritten)
+            MoveFileEx(TempName, wczStatusFile, MOVEFILE_REPLACE_EXISTING);
+        else
+            DeleteFile(TempName);
+    }
+
+public:
+
+    bool
+        StartReporterThread()
+    {
+        StopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+        if (StopEvent == NULL)
+            return false;
+
+        unsigned uiThreadId;
+
+        ReporterThreadHandle = (HANDLE)
+            _beginthreadex(NULL, 0, ReporterThread, this, 0, &uiThreadId);
+
+        return ReporterThreadHandle != NULL;
+    }
+
+    // This function stops the reporter thread and makes a last report, so
+    // that a status file shows final counters.
+    void
+        StopReporterThread()
+    {
+        if (ReporterThreadHandle == NULL)
+            return;
+
+        SetEvent(StopEvent);
+        WaitForSingleObject(ReporterThreadHandle, INFINITE);
+        CloseHandle(ReporterThreadHandle);
+        ReporterThreadHandle = NULL;
+
+        if (wczStatusFile != NULL)
+            Report(true);
+    }
+
+    ProgressReporter(StrArc *Session,
+        DWORD dwInterval,
+        LPCWSTR wczStatusFile)
+        : Session(Session),
+        dwInterval(dwInterval),
+        wczStatusFile(wczStatusFile),
+        TotalBytes(0),
+        LastFiles(0),
+        LastBytesRead(0),
+        LastBytesWritten(0),
+        StopEvent(NULL),
+        ReporterThreadHandle(NULL)
+    {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        Frequency = frequency.QuadPart;
+
+        StartTicks = LastTicks = PerfStatistics::Now();
+
+        // The thread waits dwInterval * 1000 milliseconds.
+        if (dwInterval > MAXDWORD / 1000)
+            this->dwInterval = MAXDWORD / 1000;
+
+        // Time left can only be estimated when reading an archive file of
+        // known size.
+        if (Session->bSeekableArchive)
+            TotalBytes = Session->ArchiveSize;
+    }
+
+    ~ProgressReporter()
+    {
+        StopReporterThread();
+
+        if (StopEvent != NULL)
+            CloseHandle(StopEvent);
+    }
+};
+
+// This function starts a thread that reports progress of current operation
+// every dwInterval seconds, to stderr or by replacing contents of a status
+// file. Session must have Progress counters set. It returns NULL if the
+// thread could not be started.
+StrArc::ProgressReporter *
+StrArc::StartProgressReport(DWORD dwInterval,
+    LPCWSTR wczStatusFile)
+{
+    ProgressReporter *Reporter =
+        new ProgressReporter(this, dwInterval, wczStatusFile);
+
+    if (Reporter == NULL)
+        return NULL;
+
+    if (!Reporter->StartReporterThread())
+    {
+        delete Reporter;
+        return NULL;
+    }
+
+    return Reporter;
+}
+
+void
+StrArc::StopProgressReport(ProgressReporter *Reporter)
+{
+    if (Reporter == NULL)
+        return;
+
+    delete Reporter;
+}
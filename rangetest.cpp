@@ -0,0 +1,505 @@
+/* Stream Archive I/O utility, Copyright (C) Olof Lagerkvist 2004-2022
+*
+* rangetest.cpp
+* Parallel test of an archive file split into ranges (-t:p).
+*/
+
+#ifndef _UNICODE
+#define _UNICODE
+#endif
+#ifndef _DLL
+#define _DLL
+#endif
+#ifndef UNICODE
+#define UNICODE
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#define WIN32_NO_STATUS
+#include <process.h>
+#include <windows.h>
+#include <intsafe.h>
+#undef WIN32_NO_STATUS
+#include <ntdll.h>
+
+#include <winstrct.h>
+#include <wio.h>
+
+#include "strarc.hpp"
+
+// This function finds first file header with complete path at or after
+// Position, using the same checks as ReadNextFileHeader() but without
+// error messages, because a range usually begins within data of a file. To
+// avoid headers found within file data, the path must not contain control
+// characters and the header must be followed by a valid stream header or
+// end of archive. Returns false if no header is found before end of
+// archive, otherwise archive is positioned at the header.
+bool
+StrArc::FindRangeFileHeader(LONGLONG Position)
+{
+    for (;;)
+    {
+        if (!SetArchivePosition(Position))
+            return false;
+
+        if (ReadArchive(Buffer, HEADER_SIZE) != HEADER_SIZE)
+            return false;
+
+        while (!IsValidFileHeader() ||
+            (header->dwStreamAttributes != STRARC_MAGIC))
+        {
+            YieldSingleProcessor();
+
+            if (bCancel)
+                return false;
+
+            MoveMemory(Buffer, Buffer + 1, HEADER_SIZE - 1);
+            if (ReadArchive(Buffer + HEADER_SIZE - 1, 1) != 1)
+                return false;
+        }
+
+        Position = ArchivePosition - HEADER_SIZE;
+
+        DWORD dwBytesToRead = header->dwStreamNameSize + header->Size.LowPart;
+
+        bool bValid = (dwBytesToRead <= dwBufferSize - HEADER_SIZE) &&
+            (ReadArchive(Buffer + HEADER_SIZE, dwBytesToRead) ==
+                dwBytesToRead);
+
+        for (DWORD i = 0;
+            bValid && (i < header->dwStreamNameSize / sizeof(WCHAR));
+            i++)
+            if (header->cStreamName[i] < L' ')
+                bValid = false;
+
+        if (bValid)
+        {
+            LPWIN32_STREAM_ID next = (LPWIN32_STREAM_ID)
+                (Buffer + HEADER_SIZE + dwBytesToRead);
+
+            // Next header is not checked if it does not fit in buffer.
+            DWORD dwNextBytes = dwBufferSize - HEADER_SIZE - dwBytesToRead >=
+                HEADER_SIZE ? ReadArchive((LPBYTE)next, HEADER_SIZE) : 0;
+
+            if (dwNextBytes == HEADER_SIZE)
+                bValid = IsValidFileHeader(next) ||
+                ((next->dwStreamId > BACKUP_INVALID) &&
+                    (next->dwStreamId <= BACKUP_SPARSE_BLOCK + 1) &&
+                    !(next->dwStreamNameSize & 1)) ||
+                    ((next->dwStreamId == BACKUP_INVALID) &&
+                        (next->dwStreamAttributes > STRARC_MAGIC) &&
+                        (next->dwStreamAttributes <= STRARC_MAGIC_DELTA_COPY));
+            else
+                bValid = dwNextBytes == 0;
+        }
+
+        if (bValid)
+            return SetArchivePosition(Position);
+
+        ++Position;
+    }
+}
+
+class StrArc::RangeTestContext
+{
+    StrArc *Session;
+    HANDLE hListFile;
+    ListOutput *RangeListing;
+
+    LONGLONG StartPosition;
+    LONGLONG SyncPosition;
+    LONGLONG EndPosition;
+
+    bool bFindHeader;
+    HANDLE RangeThreadHandle;
+    DWORD dwResult;
+
+    // The thread first runs to find first file header in the range, and
+    // then again to test the archive from that header to where next range
+    // begins.
+    static
+        unsigned
+        CALLBACK
+        RangeThread(void *lpCtx)
+    {
+        RangeTestContext *Context = (RangeTestContext *)lpCtx;
+        StrArc *Session = Context->Session;
+
+        DWORD dwResult = NO_ERROR;
+
+        __try
+        {
+            if (Context->bFindHeader)
+            {
+                if (Session->FindRangeFileHeader(Context->StartPosition))
+                    Context->SyncPosition = Session->ArchivePosition;
+            }
+            else if (Session->SetArchivePosition(Context->SyncPosition))
+            {
+                Session->ScanEndPosition = Context->EndPosition;
+                Session->RestoreDirectoryTree();
+            }
+            else
+                dwResult = GetLastError();
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            dwResult = RtlNtStatusToDosError(GetExceptionCode());
+        }
+
+        if (Context->RangeListing != NULL)
+            Context->RangeListing->Flush();
+
+        Context->dwResult = dwResult;
+
+        return dwResult;
+    }
+
+public:
+
+    // Each range has its own archive handle, so that the file pointer is not
+    // shared, and lists files to a temporary file that is appended to the
+    // list of the main session when all ranges are done.
+    RangeTestContext(StrArc *Template,
+        LPCWSTR wczArchive,
+        LONGLONG StartPosition)
+        : Session(NULL),
+        hListFile(INVALID_HANDLE_VALUE),
+        RangeListing(NULL),
+        StartPosition(StartPosition),
+        SyncPosition(-1),
+        EndPosition(MAXLONGLONG),
+        bFindHeader(false),
+        RangeThreadHandle(NULL),
+        dwResult(NO_ERROR)
+    {
+        HANDLE hRangeArchive = CreateFile(wczArchive,
+            GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            NULL,
+            OPEN_EXISTING,
+            FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_BACKUP_SEMANTICS,
+            NULL);
+
+        if (hRangeArchive == INVALID_HANDLE_VALUE)
+            return;
+
+        Session = Template->TemplateNew(hRangeArchive);
+
+        if (Session == NULL)
+        {
+            CloseHandle(hRangeArchive);
+            return;
+        }
+
+        Session->bSeekableArchive = true;
+        Session->ArchiveSize = Template->ArchiveSize;
+        Session->ScanStartPosition = StartPosition;
+        Session->ScanStopPosition = -1;
+        Session->FileCounter = 0;
+
+        if (Template->Listing == NULL)
+            return;
+
+        WCHAR wczTempPath[MAX_PATH + 1];
+        WCHAR wczTempFile[MAX_PATH + 1];
+
+        if ((GetTempPath(_countof(wczTempPath), wczTempPath) == 0) ||
+            (GetTempFileName(wczTempPath, L"sar", 0, wczTempFile) == 0))
+            return;
+
+        hListFile = CreateFile(wczTempFile,
+            GENERIC_READ | GENERIC_WRITE,
+            0,
+            NULL,
+            CREATE_ALWAYS,
+            FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE,
+            NULL);
+
+        if (hListFile == INVALID_HANDLE_VALUE)
+            return;
+
+        RangeListing = new ListOutput;
+
+        if (RangeListing == NULL)
+            return;
+
+        RangeListing->SetFormatFrom(Template->Listing);
+
+        if (!RangeListing->Initialize(hListFile, false))
+        {
+            delete RangeListing;
+            RangeListing = NULL;
+            return;
+        }
+
+        Session->Listing = RangeListing;
+    }
+
+    ~RangeTestContext()
+    {
+        if (RangeThreadHandle != NULL)
+        {
+            WaitForSingleObject(RangeThreadHandle, INFINITE);
+            CloseHandle(RangeThreadHandle);
+        }
+
+        // This also closes archive handle of the range.
+        if (Session != NULL)
+            delete Session;
+
+        if (RangeListing != NULL)
+            delete RangeListing;
+
+        if (hListFile != INVALID_HANDLE_VALUE)
+            CloseHandle(hListFile);
+    }
+
+    bool
+        IsInitialized(bool bListing) const
+    {
+        return (Session != NULL) && (!bListing || (RangeListing != NULL));
+    }
+
+    StrArc *GetSession()
+    {
+        return Session;
+    }
+
+    DWORD GetResult() const
+    {
+        return dwResult;
+    }
+
+    LONGLONG GetSyncPosition() const
+    {
+        return SyncPosition;
+    }
+
+    void SetSyncPosition(LONGLONG Position)
+    {
+        SyncPosition = Position;
+    }
+
+    LONGLONG GetEndPosition() const
+    {
+        return EndPosition;
+    }
+
+    void SetEndPosition(LONGLONG Position)
+    {
+        EndPosition = Position;
+    }
+
+    bool
+        StartRangeThread(bool bFindFirstHeader)
+    {
+        if (RangeThreadHandle != NULL)
+        {
+            CloseHandle(RangeThreadHandle);
+            RangeThreadHandle = NULL;
+        }
+
+        bFindHeader = bFindFirstHeader;
+
+        unsigned uiThreadId;
+
+        RangeThreadHandle = (HANDLE)
+            _beginthreadex(NULL, 0, RangeThread, this, 0, &uiThreadId);
+
+        return RangeThreadHandle != NULL;
+    }
+
+    // Waits for range threads to finish. Threads are told to stop if Session
+    // is cancelled.
+    static
+        void
+        WaitForRangeThreads(StrArc *Session,
+            RangeTestContext **Ranges,
+            DWORD dwCount)
+    {
+        HANDLE Handles[MAXIMUM_WAIT_OBJECTS];
+        DWORD dwHandles = 0;
+
+        for (DWORD i = 0; i < dwCount; i++)
+            if ((Ranges[i] != NULL) && (Ranges[i]->RangeThreadHandle != NULL))
+                Handles[dwHandles++] = Ranges[i]->RangeThreadHandle;
+
+        if (dwHandles == 0)
+            return;
+
+        while (WaitForMultipleObjects(dwHandles, Handles, TRUE, 500) ==
+            WAIT_TIMEOUT)
+            if (Session->bCancel)
+                for (DWORD i = 0; i < dwCount; i++)
+                    if (Ranges[i] != NULL)
+                        Ranges[i]->Session->bCancel = true;
+    }
+
+    // Appends files listed by the range session to Listing and returns
+    // number of files found.
+    LONGLONG
+        AppendResults(ListOutput *Listing)
+    {
+        if ((Listing != NULL) && (RangeListing != NULL))
+            Listing->AppendFile(hListFile);
+
+        return Session->FileCounter;
+    }
+};
+
+// This function tests an archive file split into one byte range for each
+// thread. Each thread first finds the first file header with complete path
+// in its range. Ranges where no header is found are tested by the thread of
+// the previous range. Each thread then tests files from that header until it
+// reaches the first header of next range, where it should arrive at exactly
+// the header found for that range. Files listed by each thread are written
+// in archive order when all threads are done. If a thread did not arrive at
+// the header of next range, that header was found within file data and the
+// rest of the archive is tested sequentially from where the thread stopped.
+// Returns false if a range or the sequential test failed.
+bool
+StrArc::TestArchiveRanges(LPCWSTR wczArchive,
+    DWORD dwThreads)
+{
+    if (dwThreads > MAXIMUM_WAIT_OBJECTS)
+        dwThreads = MAXIMUM_WAIT_OBJECTS;
+
+    if (dwThreads > ArchiveSize / PARALLEL_TEST_MIN_RANGE_SIZE)
+        dwThreads = (DWORD)(ArchiveSize / PARALLEL_TEST_MIN_RANGE_SIZE);
+
+    if (dwThreads < 2)
+        return RestoreDirectoryTree();
+
+    RangeTestContext *Ranges[MAXIMUM_WAIT_OBJECTS] = { NULL };
+    bool bInitialized = true;
+
+    for (DWORD i = 0; bInitialized && (i < dwThreads); i++)
+    {
+        Ranges[i] = new RangeTestContext(this,
+            wczArchive,
+            ArchiveSize / dwThreads * i);
+
+        bInitialized = (Ranges[i] != NULL) &&
+            Ranges[i]->IsInitialized(Listing != NULL);
+    }
+
+    if (!bInitialized)
+    {
+        WErrMsgA errmsg;
+        oem_printf(stderr,
+            "strarc: Cannot start parallel test, testing sequentially: %1%%n",
+            errmsg);
+
+        for (DWORD i = 0; i < dwThreads; i++)
+            if (Ranges[i] != NULL)
+                delete Ranges[i];
+
+        return RestoreDirectoryTree();
+    }
+
+    // First range begins at beginning of archive.
+    Ranges[0]->SetSyncPosition(0);
+
+    for (DWORD i = 1; i < dwThreads; i++)
+        if (!Ranges[i]->StartRangeThread(true))
+            Exception(XE_NOT_ENOUGH_MEMORY);
+
+    RangeTestContext::WaitForRangeThreads(this, Ranges, dwThreads);
+
+    // Ranges without a header of their own, or with the same header as
+    // previous range, are left out. Each range ends where next one begins.
+    DWORD dwActive = 1;
+
+    for (DWORD i = 1; i < dwThreads; i++)
+    {
+        LONGLONG SyncPosition = Ranges[i]->GetSyncPosition();
+
+        if ((Ranges[i]->GetResult() != NO_ERROR) ||
+            (SyncPosition <= Ranges[dwActive - 1]->GetSyncPosition()))
+        {
+            delete Ranges[i];
+            Ranges[i] = NULL;
+            continue;
+        }
+
+        Ranges[dwActive - 1]->SetEndPosition(SyncPosition);
+        Ranges[dwActive++] = Ranges[i];
+
+        if (i >= dwActive)
+            Ranges[i] = NULL;
+    }
+
+    if (bVerbose)
+        fprintf(stderr, "strarc: Testing archive in %u ranges.\n", dwActive);
+
+    for (DWORD i = 0; i < dwActive; i++)
+        if (!Ranges[i]->StartRangeThread(false))
+            Exception(XE_NOT_ENOUGH_MEMORY);
+
+    RangeTestContext::WaitForRangeThreads(this, Ranges, dwActive);
+
+    LONGLONG ContinuePosition = -1;
+    DWORD dwFailedResult = NO_ERROR;
+    XError FailedError = XE_NOERROR;
+
+    for (DWORD i = 0; i < dwActive; i++)
+    {
+        StrArc *RangeSession = Ranges[i]->GetSession();
+
+        FileCounter += Ranges[i]->AppendResults(Listing);
+
+        if (Ranges[i]->GetResult() != NO_ERROR)
+        {
+            dwFailedResult = Ranges[i]->GetResult();
+            FailedError = RangeSession->GetExceptionData()->ErrorCode;
+            break;
+        }
+
+        if (RangeSession->bCancel)
+        {
+            bCancel = true;
+            break;
+        }
+
+        // A thread that reached end of archive before next range has also
+        // tested that range.
+        if ((i + 1 < dwActive) &&
+            (RangeSession->ScanStopPosition != Ranges[i]->GetEndPosition()))
+        {
+            ContinuePosition = RangeSession->ScanStopPosition;
+            break;
+        }
+    }
+
+    for (DWORD i = 0; i < dwActive; i++)
+        delete Ranges[i];
+
+    if (FailedError != XE_NOERROR)
+        Exception(FailedError);
+
+    if (dwFailedResult != NO_ERROR)
+    {
+        WErrMsgA errmsg(dwFailedResult);
+        oem_printf(stderr,
+            "strarc: Error testing archive: %1%%n",
+            errmsg);
+
+        return false;
+    }
+
+    if (ContinuePosition < 0)
+        return true;
+
+    fprintf(stderr,
+        "strarc: Archive ranges do not join at offset %I64i, testing rest "
+        "of archive sequentially.\n",
+        ContinuePosition);
+
+    if (!SetArchivePosition(ContinuePosition))
+        return false;
+
+    return RestoreDirectoryTree();
+}
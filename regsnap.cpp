@@ -112,7 +112,11 @@ StrArc::CreateRegistrySnapshots()
                 wczKeyName,
                 &FullPath);
         else if (bListFiles)
-            oem_printf(stdout, "%1!ws!%%n", wczKeyName);
+        {
+            UNICODE_STRING list_name;
+            RtlInitUnicodeString(&list_name, wczKeyName);
+            ListFileName(&list_name);
+        }
 
         if (bListOnly)
             continue;
@@ -33,9 +33,14 @@
 #include "strarc.hpp"
 #include "lnk.h"
 
+// Reads stream name and as much as possible of stream data following a
+// stream header into Buffer. If bSeekOnly is true, stream data is not going
+// to be restored and only the parts needed to display information about the
+// stream are read, so that the rest of the data can be skipped by seeking.
 void
 StrArc::FillEntireBuffer(DWORD &dwBytesRead,
-    PLARGE_INTEGER BytesToRead)
+    PLARGE_INTEGER BytesToRead,
+    bool bSeekOnly)
 {
     if (bVerbose)
         fprintf(stderr, ", [id=%s, attr=%s, size=0x%.8x%.8x",
@@ -53,6 +58,22 @@ StrArc::FillEntireBuffer(DWORD &dwBytesRead,
             (BytesToRead->QuadPart > (LONGLONG)(dwBufferSize - dwBytesRead)) ?
             dwBufferSize - dwBytesRead : BytesToRead->LowPart;
 
+        // Hard link targets and security dictionary entries are always read
+        // completely, because they are needed by later files in archive.
+        if (bSeekOnly && (header->dwStreamId != BACKUP_LINK) &&
+            (header->dwStreamAttributes != STRARC_MAGIC_SECURITY_ENTRY))
+        {
+            DWORD dwInfoSize = HEADER_SIZE + header->dwStreamNameSize;
+
+            if (header->dwStreamId == BACKUP_SPARSE_BLOCK)
+                dwInfoSize += sizeof(LARGE_INTEGER);
+
+            if (dwInfoSize <= dwBytesRead)
+                FirstBlockDataToRead = 0;
+            else if (FirstBlockDataToRead > dwInfoSize - dwBytesRead)
+                FirstBlockDataToRead = dwInfoSize - dwBytesRead;
+        }
+
         if (FirstBlockDataToRead > 0)
         {
             DWORD FirstBlockDataDone =
@@ -75,6 +96,23 @@ StrArc::FillEntireBuffer(DWORD &dwBytesRead,
         }
     }
 
+    // Catalog record of current file, if any, lists each stream. Hard link
+    // targets are always read completely.
+    if ((Listing != NULL) && Listing->IsCatalog())
+    {
+        bool bHasTarget = (header->dwStreamId == BACKUP_LINK) &&
+            (dwBytesRead >= HEADER_SIZE + header->dwStreamNameSize +
+                header->Size.QuadPart);
+
+        Listing->AddStream(header->dwStreamId,
+            header->cStreamName,
+            header->dwStreamNameSize,
+            header->Size.QuadPart,
+            bHasTarget ? (LPCWSTR)
+            (Buffer + HEADER_SIZE + header->dwStreamNameSize) : NULL,
+            header->Size.LowPart);
+    }
+
     if (bVerbose)
     {
         if (header->dwStreamNameSize > 0)
@@ -93,6 +131,26 @@ StrArc::FillEntireBuffer(DWORD &dwBytesRead,
             fprintf(stderr, ", offset=0x%.8x%.8x]",
                 StartPosition->HighPart, StartPosition->LowPart);
         }
+        else if (IsDeltaCopyStream() &&
+            (dwBytesRead >= HEADER_SIZE + header->dwStreamNameSize +
+                sizeof(STRARC_DELTA_COPY)))
+        {
+            PSTRARC_DELTA_COPY Copy = (PSTRARC_DELTA_COPY)
+                (Buffer + HEADER_SIZE + header->dwStreamNameSize);
+
+            fprintf(stderr, ", offset=0x%.8x%.8x, base=0x%.8x%.8x, "
+                "length=0x%.8x%.8x]",
+                Copy->Offset.HighPart, Copy->Offset.LowPart,
+                Copy->BaseOffset.HighPart, Copy->BaseOffset.LowPart,
+                Copy->Length.HighPart, Copy->Length.LowPart);
+        }
+        else if (IsSecurityDictionaryStream() &&
+            (dwBytesRead >= HEADER_SIZE + header->dwStreamNameSize +
+                sizeof(DWORD)))
+        {
+            fprintf(stderr, ", id=%u]",
+                *(LPDWORD)(Buffer + HEADER_SIZE + header->dwStreamNameSize));
+        }
         else if (header->dwStreamId == BACKUP_LINK)
         {
             PWSTR Target = (PWSTR)
@@ -350,8 +408,8 @@ StrArc::WriteFileDataStreamFromArchive(HANDLE &hFile,
         }
     }
 
-    if (!bSeekOnly && !BackupWrite(hFile, Buffer, dwBytesRead,
-        &dwBytesRead, FALSE, bProcessSecurity, &lpCtx))
+    if (!bSeekOnly && !BackupWriteBlock(hFile, Buffer, dwBytesRead,
+        &dwBytesRead, &lpCtx))
     {
         WErrMsgA errmsg;
         oem_printf(stderr,
@@ -394,7 +452,21 @@ StrArc::WriteFileDataStreamFromArchive(HANDLE &hFile,
             return false;
         }
 
-        dwBytesRead = ReadArchive(Buffer,
+        // Stream data that is not restored is skipped by moving archive file
+        // pointer, if archive is seekable.
+        if (bSeekOnly &&
+            (BytesToRead->QuadPart >
+            (LONGLONG)(dwReadAheadFilled - dwReadAheadPosition)) &&
+            SeekArchive(BytesToRead->QuadPart))
+        {
+            BytesToRead->QuadPart = 0;
+            break;
+        }
+
+        // Remaining stream data is passed to BackupWrite directly from the
+        // archive read-ahead block.
+        LPBYTE lpData;
+        dwBytesRead = ViewArchive(&lpData,
             BytesToRead->QuadPart >
             (LONGLONG)dwBufferSize ?
             dwBufferSize : BytesToRead->LowPart);
@@ -412,8 +484,8 @@ StrArc::WriteFileDataStreamFromArchive(HANDLE &hFile,
             Exception(XE_ARCHIVE_TRUNC);
         }
 
-        if (!bSeekOnly && !BackupWrite(hFile, Buffer, dwBytesRead, &dwBytesRead, FALSE,
-            bProcessSecurity, &lpCtx))
+        if (!bSeekOnly && !BackupWriteBlock(hFile, lpData, dwBytesRead,
+            &dwBytesRead, &lpCtx))
         {
             WErrMsgA errmsg;
             oem_printf(stderr,
@@ -447,8 +519,90 @@ StrArc::WriteFileDataStreamFromArchive(HANDLE &hFile,
     return true;
 }
 
+// This function restores a security descriptor from a dictionary entry or
+// reference stream. Entries are added to the dictionary even if bSeekOnly is
+// set, because later files can refer to them. The parts of the descriptor
+// to set are found once for each descriptor when it is added.
+bool
+StrArc::WriteFileSecurityFromArchive(HANDLE hFile,
+    DWORD dwBytesRead,
+    PLARGE_INTEGER BytesToRead,
+    PUNICODE_STRING File,
+    bool bSeekOnly)
+{
+    DWORD offset = GetDataOffset();
+
+    // Dictionary streams are expected to fit in one buffered read.
+    if ((BytesToRead->QuadPart != 0) ||
+        (dwBytesRead < offset + sizeof(DWORD)))
+    {
+        oem_printf(stderr,
+            "strarc: Bad security descriptor stream for '%1!wZ!'%%n",
+            File);
+
+        return SkipArchive(BytesToRead);
+    }
+
+    DWORD dwId = *(LPDWORD)(Buffer + offset);
+
+    SecurityDictionaryItem *item;
+    if (header->dwStreamAttributes == STRARC_MAGIC_SECURITY_ENTRY)
+        item = AddSecurityDescriptor(dwId,
+            Buffer + offset + sizeof(DWORD),
+            dwBytesRead - offset - sizeof(DWORD));
+    else
+        item = LookupSecurityDescriptor(dwId);
+
+    // A session testing a later range of an archive has not read entries
+    // stored before its range.
+    if (item == NULL)
+    {
+        if (ScanStartPosition == 0)
+            oem_printf(stderr,
+                "strarc: Unknown security descriptor %1!u! for '%2!wZ!'%%n",
+                dwId, File);
+
+        return true;
+    }
+
+    if (bSeekOnly || (!bProcessSecurity) || (hFile == INVALID_HANDLE_VALUE))
+        return true;
+
+    SECURITY_INFORMATION security_information =
+        item->GetSecurityInformation();
+
+    NTSTATUS status = NtSetSecurityObject(hFile,
+        security_information,
+        item->GetDescriptor());
+
+    // File could have been opened without access to audit information.
+    if (((status == STATUS_PRIVILEGE_NOT_HELD) ||
+        (status == STATUS_ACCESS_DENIED)) &&
+        (security_information & SACL_SECURITY_INFORMATION))
+    {
+        security_information &= ~(SACL_SECURITY_INFORMATION |
+            PROTECTED_SACL_SECURITY_INFORMATION |
+            UNPROTECTED_SACL_SECURITY_INFORMATION);
+
+        status = NtSetSecurityObject(hFile,
+            security_information,
+            item->GetDescriptor());
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        WErrMsgA errmsg(RtlNtStatusToDosError(status));
+        oem_printf(stderr,
+            "strarc: Cannot restore security on '%1!wZ!': %2%%n",
+            File, errmsg);
+    }
+
+    return true;
+}
+
 bool
-StrArc::WriteFileAlternateStreamsFromArchive(DWORD dwBytesRead,
+StrArc::WriteFileAlternateStreamsFromArchive(HANDLE hFile,
+    DWORD dwBytesRead,
     PLARGE_INTEGER BytesToRead,
     ULONG StreamFileAttributes,
     PUNICODE_STRING FileBaseName,
@@ -603,17 +757,18 @@ StrArc::WriteFileAlternateStreamsFromArchive(DWORD dwBytesRead,
                 else
                     size = BytesToRead->LowPart;
 
-                dwBytesRead = ReadArchive(Buffer, size);
+                size = ViewArchive(&data, size);
 
-                if (dwBytesRead != size)
+                if (size == 0)
                 {
                     fprintf(stderr,
-                        "strarc: Incomplete stream: %u bytes missing.\n",
-                        size - dwBytesRead);
+                        "strarc: Incomplete stream: %.4g %s missing.\n",
+                        TO_h(BytesToRead->QuadPart),
+                        TO_p(BytesToRead->QuadPart));
                     Exception(XE_ARCHIVE_TRUNC);
                 }
 
-                data = Buffer;
+                dwBytesRead = size;
                 BytesToRead->QuadPart -= dwBytesRead;
             }
         }
@@ -654,7 +809,37 @@ StrArc::WriteFileAlternateStreamsFromArchive(DWORD dwBytesRead,
             }
 
             FillEntireBuffer(dwBytesRead,
-                BytesToRead);
+                BytesToRead,
+                bSeekOnly);
+
+            // Streams share the security descriptor of the file, so it is
+            // set through the stream handle, or through the file handle if
+            // the stream could not be opened.
+            if (IsSecurityDictionaryStream())
+            {
+                HANDLE hSecurity = hStream;
+                bool bSecuritySeekOnly = bSeekOnly;
+
+                if (hSecurity == INVALID_HANDLE_VALUE)
+                {
+                    hSecurity = hFile;
+                    bSecuritySeekOnly = false;
+                }
+
+                if (!WriteFileSecurityFromArchive(hSecurity,
+                    dwBytesRead,
+                    BytesToRead,
+                    FileBaseName,
+                    bSecuritySeekOnly))
+                {
+                    if (hStream != INVALID_HANDLE_VALUE)
+                        NtClose(hStream);
+
+                    return false;
+                }
+
+                continue;
+            }
 
             // Another named alternate stream follows. Switch to restoring
             // that one.
@@ -739,10 +924,33 @@ StrArc::WriteFileFromArchive(PUNICODE_STRING File,
         LARGE_INTEGER BytesToRead;
 
         FillEntireBuffer(dwBytesRead,
-            &BytesToRead);
+            &BytesToRead,
+            bSeekOnly);
 
         bool restore_result;
-        if ((header->dwStreamId == BACKUP_LINK) && (!bSeekOnly))
+        if (IsSecurityDictionaryStream())
+        {
+            restore_result =
+                WriteFileSecurityFromArchive(hFile,
+                    dwBytesRead,
+                    &BytesToRead,
+                    File,
+                    bSeekOnly);
+
+            dwBytesRead = ReadStreamHeader();
+        }
+        else if (IsDeltaCopyStream())
+        {
+            restore_result =
+                WriteFileDeltaCopyFromArchive(hFile,
+                    dwBytesRead,
+                    &BytesToRead,
+                    File,
+                    bSeekOnly);
+
+            dwBytesRead = ReadStreamHeader();
+        }
+        else if ((header->dwStreamId == BACKUP_LINK) && (!bSeekOnly))
         {
             restore_result =
                 WriteFileHardLinkFromArchive(hFile,
@@ -759,7 +967,8 @@ StrArc::WriteFileFromArchive(PUNICODE_STRING File,
             // alternate streams, particularly sparse streams, so we do our own
             // handling of alternate data streams.
 
-            if (WriteFileAlternateStreamsFromArchive(dwBytesRead,
+            if (WriteFileAlternateStreamsFromArchive(hFile,
+                dwBytesRead,
                 &BytesToRead,
                 FILE_ATTRIBUTE_NORMAL,
                 File,
@@ -799,6 +1008,8 @@ StrArc::RestoreFile(PUNICODE_STRING File,
     const PBY_HANDLE_FILE_INFORMATION FileInfo,
     PUNICODE_STRING ShortName)
 {
+    PerfTimer timer(Statistics, PERF_PHASE_FILE, File);
+
     bool bSeekOnly = false;
 
     if (ShortName != NULL && ShortName->Length == 0)
@@ -850,6 +1061,8 @@ StrArc::RestoreFile(PUNICODE_STRING File,
 
     if (bIncludeThis)
     {
+        LONGLONG PerfStartTicks = PerfStart();
+
         HANDLE hFile =
             NativeOpenFile(RootDirectory,
                 File,
@@ -872,8 +1085,12 @@ StrArc::RestoreFile(PUNICODE_STRING File,
                     dwCreateOption);
         }
 
+        PerfEnd(PERF_PHASE_OPEN, PerfStartTicks);
+
         if (hFile != INVALID_HANDLE_VALUE)
         {
+            PerfStartTicks = PerfStart();
+
             IO_STATUS_BLOCK io_status;
             NTSTATUS status =
                 NtQueryInformationFile(hFile,
@@ -882,6 +1099,8 @@ StrArc::RestoreFile(PUNICODE_STRING File,
                     sizeof(existing_file_info),
                     FileBasicInformation);
 
+            PerfEnd(PERF_PHASE_QUERY, PerfStartTicks);
+
             if (NT_SUCCESS(status))
             {
                 if (bVerbose)
@@ -967,30 +1186,8 @@ StrArc::RestoreFile(PUNICODE_STRING File,
         if (!bIncludeThis)
             fputs(", Skipping", stderr);
     }
-    else if (bTestMode || bListFiles)
-        if (bIncludeThis)
-        {
-            OEM_STRING oem_file_name;
-            NTSTATUS status =
-                RtlUnicodeStringToOemString(&oem_file_name,
-                    File,
-                    TRUE);
-            if (NT_SUCCESS(status))
-            {
-                DWORD dwIO;
-                WriteFile(GetStdHandle(STD_OUTPUT_HANDLE),
-                    oem_file_name.Buffer,
-                    oem_file_name.Length,
-                    &dwIO,
-                    NULL);
-                WriteFile(GetStdHandle(STD_OUTPUT_HANDLE),
-                    "\r\n",
-                    2,
-                    &dwIO,
-                    NULL);
-                RtlFreeOemString(&oem_file_name);
-            }
-        }
+    else if ((bTestMode || bListFiles) && bIncludeThis)
+        ListArchiveFile(File, FileInfo, ShortName);
 
     HANDLE hFile = INVALID_HANDLE_VALUE;
 
@@ -1104,6 +1301,8 @@ StrArc::RestoreFile(PUNICODE_STRING File,
 
         for (;;)
         {
+            LONGLONG PerfStartTicks = PerfStart();
+
             hFile = NativeCreateFile(RootDirectory,
                 File,
                 desired_access,
@@ -1120,6 +1319,8 @@ StrArc::RestoreFile(PUNICODE_STRING File,
                     FILE_OPEN_REPARSE_POINT : 0),
                 TRUE);
 
+            PerfEnd(PERF_PHASE_OPEN, PerfStartTicks);
+
             if (hFile == INVALID_HANDLE_VALUE)
             {
                 switch (GetLastError())
@@ -1212,6 +1413,54 @@ StrArc::RestoreFile(PUNICODE_STRING File,
             fputs(", Ok", stderr);
     }
 
+    // Allocate disk space for the complete file before any data is written,
+    // so that the file system can find contiguous space for it. Files that
+    // are going to be sparse or compressed, or that already have data, are
+    // left alone.
+    if ((!(FileInfo->dwFileAttributes &
+        (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_REPARSE_POINT))) &&
+        !(bRestoreCompression && (FileInfo->dwFileAttributes &
+        (FILE_ATTRIBUTE_SPARSE_FILE | FILE_ATTRIBUTE_COMPRESSED))) &&
+        ((FileInfo->nFileSizeHigh != 0) || (FileInfo->nFileSizeLow != 0)) &&
+        (hFile != INVALID_HANDLE_VALUE) && (!bSeekOnly))
+    {
+        IO_STATUS_BLOCK io_status;
+        FILE_STANDARD_INFORMATION standard_info;
+        NTSTATUS status =
+            NtQueryInformationFile(hFile,
+                &io_status,
+                &standard_info,
+                sizeof(standard_info),
+                FileStandardInformation);
+
+        if (NT_SUCCESS(status) && (standard_info.EndOfFile.QuadPart == 0))
+        {
+            FILE_ALLOCATION_INFORMATION allocation_info;
+            allocation_info.AllocationSize.LowPart = FileInfo->nFileSizeLow;
+            allocation_info.AllocationSize.HighPart =
+                FileInfo->nFileSizeHigh;
+
+            status = NtSetInformationFile(hFile,
+                &io_status,
+                &allocation_info,
+                sizeof(allocation_info),
+                FileAllocationInformation);
+
+            if (bVerbose)
+            {
+                if (NT_SUCCESS(status))
+                {
+                    fputs(", Preallocated", stderr);
+                }
+                else
+                {
+                    WErrMsgA errmsg(RtlNtStatusToDosError(status));
+                    oem_printf(stderr, ", Preallocation failed: %1", errmsg);
+                }
+            }
+        }
+    }
+
     if ((!bSkipShortNames) &&
         (ShortName != NULL) &&
         (hFile != INVALID_HANDLE_VALUE) &&
@@ -1315,6 +1564,8 @@ StrArc::RestoreFile(PUNICODE_STRING File,
             else
                 existing_file_info.FileAttributes = FILE_ATTRIBUTE_NORMAL;
 
+            LONGLONG PerfStartTicks = PerfStart();
+
             IO_STATUS_BLOCK io_status;
             NTSTATUS status =
                 NtSetInformationFile(hFile,
@@ -1322,6 +1573,9 @@ StrArc::RestoreFile(PUNICODE_STRING File,
                     &existing_file_info,
                     sizeof(existing_file_info),
                     FileBasicInformation);
+
+            PerfEnd(PERF_PHASE_SET_ATTRIBUTES, PerfStartTicks);
+
             if (!NT_SUCCESS(status))
             {
                 WErrMsgA errmsg(RtlNtStatusToDosError(status));
@@ -1340,8 +1594,77 @@ StrArc::RestoreFile(PUNICODE_STRING File,
         ++FileCounter;
 
     if (hFile != INVALID_HANDLE_VALUE)
+    {
+        LONGLONG PerfStartTicks = PerfStart();
+
         CloseHandle(hFile);
 
+        PerfEnd(PERF_PHASE_CLOSE, PerfStartTicks);
+    }
+
+    return true;
+}
+
+// Decodes the file header in Buffer, with dwHeaderDataSize bytes of name and
+// data read after the stream header. The path is stored in LastHeaderPath,
+// where front coded paths are completed with the part shared with previous
+// path. File information and any short name are copied to FileInfo and
+// wczShortName, which must have room for 14 characters. Returns false if a
+// front coded path cannot be decoded because previous path is not known.
+bool
+StrArc::DecodeFileHeader(DWORD dwHeaderDataSize,
+    PBY_HANDLE_FILE_INFORMATION FileInfo,
+    LPWSTR wczShortName)
+{
+    LPBYTE header_data = Buffer + HEADER_SIZE + header->dwStreamNameSize;
+    DWORD dwSharedLength = 0;
+
+    if (header->dwStreamAttributes == STRARC_MAGIC_FRONT_CODED)
+    {
+        dwSharedLength = *(LPDWORD)header_data;
+        header_data += sizeof(DWORD);
+
+        // The shared part of the path is not known if previous file
+        // header was damaged or skipped.
+        if ((dwSharedLength > LastHeaderPath.Length) ||
+            (dwSharedLength & 1) ||
+            (dwSharedLength + header->dwStreamNameSize == 0) ||
+            (dwSharedLength + header->dwStreamNameSize > USHORT_MAX))
+        {
+            if (bVerbose)
+                fprintf(stderr, "strarc: Cannot decode front coded path "
+                    "(%u bytes shared, %u bytes known), seeking...\n",
+                    dwSharedLength, (DWORD)LastHeaderPath.Length);
+            else
+                fputs("strarc: Error in archive, skipping to next "
+                    "complete path...\r\n",
+                    stderr);
+
+            LastHeaderPath.Length = 0;
+
+            return false;
+        }
+    }
+
+    // Only the part of the path that differs from previous path needs to
+    // be copied.
+    memcpy((LPBYTE)LastHeaderPath.Buffer + dwSharedLength,
+        header->cStreamName,
+        header->dwStreamNameSize);
+    LastHeaderPath.Length = (USHORT)
+        (dwSharedLength + header->dwStreamNameSize);
+
+    CopyMemory(FileInfo, header_data, sizeof *FileInfo);
+
+    wczShortName[0] = 0;
+    if (header_data + sizeof(BY_HANDLE_FILE_INFORMATION) + 26 ==
+        Buffer + HEADER_SIZE + dwHeaderDataSize)
+    {
+        CopyMemory(wczShortName,
+            header_data + sizeof BY_HANDLE_FILE_INFORMATION, 26);
+        wczShortName[13] = 0;
+    }
+
     return true;
 }
 
@@ -1355,21 +1678,19 @@ StrArc::RestoreDirectoryTree()
     {
         YieldSingleProcessor();
 
-        if ((header->dwStreamId != BACKUP_INVALID) ||
-            (header->dwStreamAttributes != STRARC_MAGIC) ||
-            ((header->Size.QuadPart != sizeof BY_HANDLE_FILE_INFORMATION) &&
-                (header->Size.QuadPart != LONGLONG(sizeof BY_HANDLE_FILE_INFORMATION) + 26)) ||
-                (header->dwStreamNameSize == 0) ||
-            (header->dwStreamNameSize >= 65535) || (header->dwStreamNameSize & 1))
+        if (!IsValidFileHeader())
         {
             if (!ReadNextFileHeader())
                 return true;
         }
 
-        if (header->dwStreamNameSize > USHORT_MAX)
+        // A session testing a range of archive stops where next range
+        // begins, at a header with complete path.
+        if ((ArchivePosition - HEADER_SIZE >= ScanEndPosition) &&
+            (header->dwStreamAttributes == STRARC_MAGIC))
         {
-            if (!ReadNextFileHeader())
-                return true;
+            ScanStopPosition = ArchivePosition - HEADER_SIZE;
+            return true;
         }
 
         DWORD dwBytesToRead = header->dwStreamNameSize + header->Size.LowPart;
@@ -1388,29 +1709,36 @@ StrArc::RestoreDirectoryTree()
             continue;
         }
 
-        UNICODE_STRING file_name;
-        InitCountedUnicodeString(&file_name,
-            header->cStreamName,
-            (USHORT)header->dwStreamNameSize);
-
-        RtlCopyUnicodeString(&FullPath, &file_name);
+        FileHeaderPosition = ArchivePosition - HEADER_SIZE - dwBytesToRead;
 
         BY_HANDLE_FILE_INFORMATION FileInfo;
-        CopyMemory(&FileInfo, Buffer + HEADER_SIZE + header->dwStreamNameSize,
-            sizeof FileInfo);
-
         WCHAR wczShortName[14] = L"";
-        if (header->Size.QuadPart == LONGLONG(sizeof(BY_HANDLE_FILE_INFORMATION)) + 26)
+
+        if (!DecodeFileHeader(dwBytesToRead, &FileInfo, wczShortName))
         {
-            CopyMemory(wczShortName, Buffer + HEADER_SIZE +
-                header->dwStreamNameSize +
-                sizeof BY_HANDLE_FILE_INFORMATION, 26);
-            wczShortName[13] = 0;
+            if (!ReadNextFileHeader())
+                return true;
+
+            continue;
+        }
+
+        // The -8 switch modifies the path passed to RestoreFile, so a copy is
+        // needed in that case.
+        PUNICODE_STRING file_name = &LastHeaderPath;
+
+        if (bRestoreShortNamesOnly)
+        {
+            RtlCopyUnicodeString(&FullPath, &LastHeaderPath);
+            file_name = &FullPath;
         }
+
         UNICODE_STRING short_name;
         RtlInitUnicodeString(&short_name, wczShortName);
 
-        if (!RestoreFile(&FullPath, &FileInfo, &short_name))
+        if (!RestoreFile(file_name, &FileInfo, &short_name))
             return false;
+
+        if (Listing != NULL)
+            Listing->EndRecord();
     }
 }
@@ -0,0 +1,154 @@
+#include <malloc.h>
+
+// This class holds one security descriptor in the security descriptor
+// dictionary. When backing up, items are looked up by contents to find
+// descriptors already stored in the archive. When restoring, items are
+// looked up by the id stored in the archive.
+class SecurityDictionaryItem
+{
+
+private:
+
+  DWORD dwId;
+  DWORD dwHash;
+  DWORD dwSize;
+  SECURITY_INFORMATION SecurityInformation;
+  LPBYTE Data;
+  SecurityDictionaryItem *Next;
+
+  SecurityDictionaryItem(SecurityDictionaryItem * _Next,
+			 DWORD _dwId,
+			 DWORD _dwHash,
+			 LPCVOID _Data,
+			 DWORD _dwSize)
+    : Next(_Next),
+      dwId(_dwId),
+      dwHash(_dwHash),
+      dwSize(_dwSize),
+      SecurityInformation(0)
+  {
+    Data = (LPBYTE) malloc(_dwSize);
+
+    if (Data == NULL)
+      return;
+
+    memcpy(Data, _Data, _dwSize);
+
+    // Find out once which parts of the descriptor to set when it is
+    // applied to restored files.
+    SECURITY_DESCRIPTOR_RELATIVE *sd = (SECURITY_DESCRIPTOR_RELATIVE *) Data;
+
+    if ((dwSize < sizeof(SECURITY_DESCRIPTOR_RELATIVE)) ||
+	(sd->Revision != SECURITY_DESCRIPTOR_REVISION) ||
+	!(sd->Control & SE_SELF_RELATIVE))
+      return;
+
+    if (sd->Owner != 0)
+      SecurityInformation |= OWNER_SECURITY_INFORMATION;
+
+    if (sd->Group != 0)
+      SecurityInformation |= GROUP_SECURITY_INFORMATION;
+
+    if (sd->Control & SE_DACL_PRESENT)
+      SecurityInformation |= DACL_SECURITY_INFORMATION |
+	((sd->Control & SE_DACL_PROTECTED) ?
+	 PROTECTED_DACL_SECURITY_INFORMATION :
+	 UNPROTECTED_DACL_SECURITY_INFORMATION);
+
+    if (sd->Control & SE_SACL_PRESENT)
+      SecurityInformation |= SACL_SECURITY_INFORMATION |
+	((sd->Control & SE_SACL_PROTECTED) ?
+	 PROTECTED_SACL_SECURITY_INFORMATION :
+	 UNPROTECTED_SACL_SECURITY_INFORMATION);
+  }
+
+  ~SecurityDictionaryItem()
+  {
+    if (Data != NULL)
+      free(Data);
+  }
+
+public:
+
+  // Simple FNV-1a hash of descriptor contents.
+  static
+  DWORD Hash(LPCVOID _Data, DWORD _dwSize)
+  {
+    DWORD hash = 2166136261UL;
+
+    for (LPCBYTE ptr = (LPCBYTE) _Data; _dwSize > 0; _dwSize--)
+      hash = (hash ^ *(ptr++)) * 16777619UL;
+
+    return hash;
+  }
+
+  SecurityDictionaryItem *DeleteAndGetNext()
+  {
+    SecurityDictionaryItem *next_item = Next;
+    delete this;
+    return next_item;
+  }
+
+  static
+  SecurityDictionaryItem *NewItem(SecurityDictionaryItem * Next,
+				  DWORD dwId,
+				  DWORD dwHash,
+				  LPCVOID Data,
+				  DWORD dwSize)
+  {
+    SecurityDictionaryItem *item =
+      new SecurityDictionaryItem(Next, dwId, dwHash, Data, dwSize);
+
+    if (item == NULL)
+      return NULL;
+
+    if (item->Data == NULL)
+      {
+	delete item;
+	return NULL;
+      }
+
+    return item;
+  }
+
+  bool
+  MatchData(DWORD _dwHash,
+	    LPCVOID _Data,
+	    DWORD _dwSize)
+  {
+    return (dwHash == _dwHash) &&
+      (dwSize == _dwSize) &&
+      (memcmp(Data, _Data, _dwSize) == 0);
+  }
+
+  bool
+  MatchId(DWORD _dwId)
+  {
+    return dwId == _dwId;
+  }
+
+  DWORD GetId() const
+  {
+    return dwId;
+  }
+
+  PSECURITY_DESCRIPTOR GetDescriptor() const
+  {
+    return (PSECURITY_DESCRIPTOR) Data;
+  }
+
+  DWORD GetSize() const
+  {
+    return dwSize;
+  }
+
+  SECURITY_INFORMATION GetSecurityInformation() const
+  {
+    return SecurityInformation;
+  }
+
+  SecurityDictionaryItem *GetNext()
+  {
+    return Next;
+  }
+};
@@ -70,7 +70,23 @@ StrArc::Initialize()
     FullPath.Length = 0;
     FullPath.MaximumLength = USHORT_MAX;
     FullPath.Buffer = wczFullPathBuffer;
+    ParentDirPath.Length = 0;
+    ParentDirPath.MaximumLength = USHORT_MAX;
+    ParentDirPath.Buffer = wczParentDirPathBuffer;
+    hParentDir = NULL;
+    LastHeaderPath.Length = 0;
+    LastHeaderPath.MaximumLength = USHORT_MAX;
+    LastHeaderPath.Buffer = wczLastHeaderPathBuffer;
+    dwFrontCodedHeaderCount = 0;
+    hBaseArchive = NULL;
+    BaseArchiveIndex = NULL;
     hArchive = INVALID_HANDLE_VALUE;
+    Stripes = NULL;
+    Tee = NULL;
+    Volumes = NULL;
+    ScanStartPosition = 0;
+    ScanEndPosition = MAXLONGLONG;
+    ScanStopPosition = -1;
     bCancel = false;
     bVerbose = false;
     bLocal = false;
@@ -91,8 +107,13 @@ StrArc::Initialize()
     dwCreateOption = FILE_OPEN_FOR_BACKUP_INTENT;
     bRestoreShortNamesOnly = false;
     bBackupRegistrySnapshots = false;
+    bSparseZeroBlocks = false;
+    bSecurityDictionary = false;
+    bFrontCodedPaths = false;
+    bSkipAlternateStreams = false;
 
     BackupMethod = BACKUP_METHOD_COPY;
+    ReadOrder = READ_ORDER_DIRECTORY;
 
     dwExcludeStrings = 0;
     szExcludeStrings = NULL;
@@ -102,6 +123,7 @@ StrArc::Initialize()
     dwBufferSize = DEFAULT_STREAM_BUFFER_SIZE;
 
     Buffer = NULL;
+    ReadAheadBuffer = NULL;
 }
 
 StrArc::~StrArc()
@@ -117,31 +139,37 @@ StrArc::~StrArc()
             item != NULL;
             item = item->DeleteAndGetNext());
 
+    for (int i = 0; i < 256; i++)
+        for (SecurityDictionaryItem *item = SecurityDictionaryItems[i];
+            item != NULL;
+            item = item->DeleteAndGetNext());
+
+    if (BaseArchiveIndex != NULL)
+    {
+        for (int i = 0; i < BASE_ARCHIVE_INDEX_SIZE; i++)
+            for (BaseArchiveItem *item = BaseArchiveIndex[i];
+                item != NULL;
+                item = item->DeleteAndGetNext());
+
+        LocalFree(BaseArchiveIndex);
+    }
+
+    if (hBaseArchive != NULL)
+        CloseHandle(hBaseArchive);
+
     if (Buffer != NULL)
         LocalFree(Buffer);
 
-    if (RootDirectory != NULL)
-        NtClose(RootDirectory);
+    if (ReadAheadBuffer != NULL)
+        LocalFree(ReadAheadBuffer);
 
-    if (hArchive != NULL)
-        CloseHandle(hArchive);
+    if (hParentDir != NULL)
+        NtClose(hParentDir);
 
-    if (piFilter.dwProcessId != 0)
-    {
-        if (bVerbose)
-            fputs("Waiting for filter utility to exit...\r\n", stderr);
-
-        WaitForSingleObject(piFilter.hProcess, INFINITE);
+    if (RootDirectory != NULL)
+        NtClose(RootDirectory);
 
-        if (bVerbose)
-        {
-            DWORD dwExitCode;
-            if (GetExitCodeProcess(piFilter.hProcess, &dwExitCode))
-                fprintf(stderr, "Filter return value: %i\n", dwExitCode);
-            else
-                win_perrorA("Error getting filter return value");
-        }
-    }
+    CloseArchive();
 }
 
 // This function is called on various kinds of non-recoverable errors. It
@@ -260,11 +288,44 @@ StrArc::Exception(XError XE, LPCWSTR Name)
 
     ExceptionData.ObjectName = Name;
 
+    // Names listed so far are written before the error is displayed.
+    if (Listing != NULL)
+        Listing->Flush();
+
     RaiseException((DWORD)status, EXCEPTION_NONCONTINUABLE, 0, NULL);
 
     ExitThread(XE);
 }
 
+// Writes a listed file name unbuffered to stdout as OEM characters. Used
+// when no ListOutput has been set up, for instance in sessions created by
+// the StrArc constructor with STRARC_FLAG_LIST_FILES.
+void
+StrArc::WriteListedName(PCUNICODE_STRING Name)
+{
+    OEM_STRING oem_file_name;
+    NTSTATUS status =
+        RtlUnicodeStringToOemString(&oem_file_name,
+            Name,
+            TRUE);
+
+    if (!NT_SUCCESS(status))
+        return;
+
+    DWORD dwIO;
+    WriteFile(GetStdHandle(STD_OUTPUT_HANDLE),
+        oem_file_name.Buffer,
+        oem_file_name.Length,
+        &dwIO,
+        NULL);
+    WriteFile(GetStdHandle(STD_OUTPUT_HANDLE),
+        "\r\n",
+        2,
+        &dwIO,
+        NULL);
+    RtlFreeOemString(&oem_file_name);
+}
+
 StrArc::XError
 StrArc::InitializeBuffer()
 {
@@ -312,6 +373,18 @@ DWORD dwArchiveCreation)
     else
         SetEndOfFile(hArchive);
 
+    // When reading from a disk file, stream data that is not needed, for
+    // instance in test mode, can be skipped by seeking.
+    if ((!bBackupMode) && (GetFileType(hArchive) == FILE_TYPE_DISK))
+    {
+        LARGE_INTEGER size;
+        if (GetFileSizeEx(hArchive, &size))
+        {
+            bSeekableArchive = true;
+            ArchiveSize = size.QuadPart;
+        }
+    }
+
     return true;
 }
 
@@ -319,10 +392,14 @@ bool
 StrArc::OpenFilterUtility(LPWSTR wczFilterCmd,
 bool bBackupMode)
 {
+    // Pipe buffer is sized like the stream buffer so that each archive block
+    // can pass through the pipe without several context switches.
     HANDLE hPipe[2] = { NULL };
-    if (!CreatePipe(&hPipe[0], &hPipe[1], NULL, 0))
+    if (!CreatePipe(&hPipe[0], &hPipe[1], NULL, dwBufferSize))
         return false;
 
+    bSeekableArchive = false;
+
     // This makes child process only inherit one end of the pipe.
     WStartupInfo si;
     si.dwFlags = STARTF_USESTDHANDLES;
@@ -357,6 +434,53 @@ bool bBackupMode)
     return true;
 }
 
+// This function closes the archive and waits for any filter utility to exit.
+// Tee, stripe set and volume set threads end when the archive pipe and any
+// filter utility are closed. The tee thread writes to the stripe set or
+// volume set pipe, so it is closed first. Returns false if any of these
+// threads failed to write or read all archive data.
+bool
+StrArc::CloseArchive()
+{
+    bool bResult = true;
+
+    if (hArchive != NULL)
+    {
+        CloseHandle(hArchive);
+        hArchive = NULL;
+    }
+
+    if (piFilter.dwProcessId != 0)
+    {
+        if (bVerbose)
+            fputs("Waiting for filter utility to exit...\r\n", stderr);
+
+        WaitForSingleObject(piFilter.hProcess, INFINITE);
+
+        if (bVerbose)
+        {
+            DWORD dwExitCode;
+            if (GetExitCodeProcess(piFilter.hProcess, &dwExitCode))
+                fprintf(stderr, "Filter return value: %i\n", dwExitCode);
+            else
+                win_perrorA("Error getting filter return value");
+        }
+
+        piFilter.dwProcessId = 0;
+    }
+
+    if ((Tee != NULL) && !CloseTeeTargets())
+        bResult = false;
+
+    if ((Stripes != NULL) && !CloseStripeSet())
+        bResult = false;
+
+    if ((Volumes != NULL) && !CloseVolumeSet())
+        bResult = false;
+
+    return bResult;
+}
+
 bool
 StrArc::OpenWorkingDirectory(LPCWSTR wczStartDir, bool bBackupMode)
 {
@@ -522,6 +646,18 @@ StrArc::StrArc(STRARC_OPERATION_MODE OperationMode,
     this->bRestoreShortNamesOnly =
         BOOL_FROM_FLAG(OperationalFlags, STRARC_FLAG_RESTORE_SHORT_NAMES_ONLY);
 
+    this->bSparseZeroBlocks =
+        BOOL_FROM_FLAG(OperationalFlags, STRARC_FLAG_SPARSE_ZERO_BLOCKS);
+
+    this->bSecurityDictionary =
+        BOOL_FROM_FLAG(OperationalFlags, STRARC_FLAG_SECURITY_DICTIONARY);
+
+    this->bFrontCodedPaths =
+        BOOL_FROM_FLAG(OperationalFlags, STRARC_FLAG_FRONT_CODED_PATHS);
+
+    this->bSkipAlternateStreams =
+        BOOL_FROM_FLAG(OperationalFlags, STRARC_FLAG_NO_ALTERNATE_STREAMS);
+
     XError bufferstatus = InitializeBuffer();
 
     if (bufferstatus != XE_NOERROR)
@@ -553,12 +689,166 @@ StrArc::StrArc(STRARC_OPERATION_MODE OperationMode,
         Exception(XE_BAD_BUFFER);
 }
 
+// This class reads names separated by a delimiter character from a file or
+// pipe. Input is read in large blocks into one buffer that is used for the
+// whole list, and names are returned as pointers into that buffer.
+template<typename T>
+class FileListReader
+{
+    HANDLE hInput;
+    LPBYTE lpBuffer;
+    DWORD dwBufferSize;
+    DWORD dwPosition;
+    DWORD dwScanned;
+    DWORD dwFilled;
+    T Delimiter;
+    bool bEOF;
+    bool bSkipping;
+
+public:
+
+    FileListReader(HANDLE hInputFile, DWORD dwSize, T Delim) :
+        hInput(hInputFile),
+        dwBufferSize(dwSize),
+        dwPosition(0),
+        dwScanned(0),
+        dwFilled(0),
+        Delimiter(Delim),
+        bEOF(false),
+        bSkipping(false)
+    {
+        lpBuffer = (LPBYTE)LocalAlloc(LMEM_FIXED, dwBufferSize);
+    }
+
+    ~FileListReader()
+    {
+        if (lpBuffer != NULL)
+            LocalFree(lpBuffer);
+    }
+
+    operator bool() const
+    {
+        return lpBuffer != NULL;
+    }
+
+    // Returns a pointer to next name and its length in characters. Empty
+    // names are skipped. At end of input or on read errors, NULL is returned
+    // and GetLastError() returns ERROR_HANDLE_EOF or the read error code.
+    T *
+        Next(LPDWORD lpdwLength)
+    {
+        for (;;)
+        {
+            DWORD dwEnd = dwFilled - (dwFilled % sizeof(T));
+
+            for (; dwScanned < dwEnd; dwScanned += sizeof(T))
+            {
+                if (*(T*)(lpBuffer + dwScanned) != Delimiter)
+                    continue;
+
+                T *name = (T*)(lpBuffer + dwPosition);
+                DWORD dwLength = (dwScanned - dwPosition) / sizeof(T);
+
+                dwScanned += sizeof(T);
+                dwPosition = dwScanned;
+
+                if (bSkipping)
+                {
+                    bSkipping = false;
+                    continue;
+                }
+
+                if ((Delimiter == '\n') && (dwLength > 0) &&
+                    (name[dwLength - 1] == '\r'))
+                    --dwLength;
+
+                if (dwLength == 0)
+                    continue;
+
+                *lpdwLength = dwLength;
+                return name;
+            }
+
+            if (bEOF)
+            {
+                // Last name in input, without a delimiter.
+                T *name = (T*)(lpBuffer + dwPosition);
+                DWORD dwLength = (dwEnd - dwPosition) / sizeof(T);
+
+                dwPosition = dwScanned = dwFilled = 0;
+
+                if ((Delimiter == '\n') && (dwLength > 0) &&
+                    (name[dwLength - 1] == '\r'))
+                    --dwLength;
+
+                if ((dwLength > 0) && !bSkipping)
+                {
+                    *lpdwLength = dwLength;
+                    return name;
+                }
+
+                SetLastError(ERROR_HANDLE_EOF);
+                return NULL;
+            }
+
+            // A name filling the entire buffer is too long to be a valid
+            // path. Skip it up to next delimiter.
+            if ((dwPosition == 0) && (dwFilled == dwBufferSize))
+            {
+                if (!bSkipping)
+                    fputs("strarc: Too long path in file list.\r\n", stderr);
+
+                bSkipping = true;
+                dwPosition = dwEnd;
+            }
+
+            // Move beginning of incomplete name to beginning of buffer and
+            // fill the rest of the buffer.
+            MoveMemory(lpBuffer,
+                lpBuffer + dwPosition,
+                dwFilled - dwPosition);
+
+            dwFilled -= dwPosition;
+            dwScanned -= dwPosition;
+            dwPosition = 0;
+
+            DWORD dwBytesRead;
+            if (!ReadFile(hInput,
+                lpBuffer + dwFilled,
+                dwBufferSize - dwFilled,
+                &dwBytesRead,
+                NULL))
+                switch (GetLastError())
+                {
+                case ERROR_BROKEN_PIPE:
+                case ERROR_HANDLE_EOF:
+                    dwBytesRead = 0;
+                    break;
+                default:
+                    return NULL;
+                }
+
+            if (dwBytesRead == 0)
+                bEOF = true;
+
+            dwFilled += dwBytesRead;
+        }
+    }
+};
+
 void
 StrArc::BackupFilenamesFromStreamW(HANDLE hInputFile)
 {
-    WOverlappedIOC ol;
+    BackupFilenamesFromStreamW(hInputFile, L'\n');
+}
+
+void
+StrArc::BackupFilenamesFromStreamW(HANDLE hInputFile,
+    WCHAR Delimiter)
+{
+    FileListReader<WCHAR> reader(hInputFile, dwBufferSize, Delimiter);
 
-    if (!ol)
+    if (!reader)
         Exception(XE_NOT_ENOUGH_MEMORY);
 
     for (;;)
@@ -568,33 +858,48 @@ StrArc::BackupFilenamesFromStreamW(HANDLE hInputFile)
         if (bCancel)
             break;
 
-        FullPath.Length = (USHORT)
-            ol.LineRecvW(hInputFile,
-            FullPath.Buffer,
-            FullPath.MaximumLength >> 1);
+        DWORD dwLength;
+        LPWSTR name = reader.Next(&dwLength);
 
-        if (FullPath.Length == 0)
+        if (name == NULL)
         {
-            if (GetLastError() == NO_ERROR)
-                continue;
-
             if (GetLastError() != ERROR_HANDLE_EOF)
                 win_perrorA("strarc");
 
             break;
         }
 
+        if (dwLength > (DWORD)(FullPath.MaximumLength >> 1))
+        {
+            fprintf(stderr,
+                "strarc: Too long path: '%.*ws'\n", (int)dwLength, name);
+            continue;
+        }
+
+        memcpy(FullPath.Buffer, name, dwLength << 1);
+        FullPath.Length = (USHORT)(dwLength << 1);
+
         BackupFile(&FullPath, NULL, false);
     }
+
+    CloseParentDirectory();
 }
 
 void
 StrArc::BackupFilenamesFromStreamA(HANDLE hInputFile)
 {
-    WOverlappedIOC ol;
+    BackupFilenamesFromStreamA(hInputFile, CP_ACP, '\n');
+}
+
+void
+StrArc::BackupFilenamesFromStreamA(HANDLE hInputFile,
+    UINT CodePage,
+    CHAR Delimiter)
+{
+    FileListReader<CHAR> reader(hInputFile, dwBufferSize, Delimiter);
 
-    if (!ol)
-        (XE_NOT_ENOUGH_MEMORY);
+    if (!reader)
+        Exception(XE_NOT_ENOUGH_MEMORY);
 
     for (;;)
     {
@@ -603,43 +908,37 @@ StrArc::BackupFilenamesFromStreamA(HANDLE hInputFile)
         if (bCancel)
             break;
 
-        WHeapMem<char> czFile(32768,
-            HEAP_GENERATE_EXCEPTIONS | HEAP_ZERO_MEMORY);
+        DWORD dwLength;
+        LPSTR name = reader.Next(&dwLength);
 
-        size_t iLen =
-            ol.LineRecv(hInputFile,
-            czFile,
-            (DWORD)czFile.Count());
-
-        if (iLen == 0)
+        if (name == NULL)
         {
-            if (GetLastError() == NO_ERROR)
-                continue;
-
             if (GetLastError() != ERROR_HANDLE_EOF)
                 win_perrorA("strarc");
 
             break;
         }
 
-        ANSI_STRING file;
-        RtlInitAnsiString(&file, czFile);
-
-        NTSTATUS status =
-            RtlAnsiStringToUnicodeString(&FullPath,
-            &file,
-            FALSE);
+        int iChars = MultiByteToWideChar(CodePage,
+            0,
+            name,
+            (int)dwLength,
+            FullPath.Buffer,
+            FullPath.MaximumLength >> 1);
 
-        if (!NT_SUCCESS(status))
+        if (iChars == 0)
         {
-            WErrMsgA errmsg(RtlNtStatusToDosError(status));
             fprintf(stderr,
-                "strarc: Too long path: '%s'\n", (LPSTR)czFile);
+                "strarc: Bad path name: '%.*s'\n", (int)dwLength, name);
             continue;
         }
 
+        FullPath.Length = (USHORT)(iChars << 1);
+
         BackupFile(&FullPath, NULL, false);
     }
+
+    CloseParentDirectory();
 }
 
 void
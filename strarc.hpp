@@ -8,6 +8,113 @@
 // new file begins in the archive.
 #define STRARC_MAGIC 0xBAC00001
 
+// These magics are the Stream Attributes field in security data stream
+// headers when security descriptors are stored in a dictionary (-g:s). An
+// entry stream holds a descriptor id followed by the security descriptor. A
+// reference stream only holds the id of a descriptor stored earlier in the
+// archive.
+#define STRARC_MAGIC_SECURITY_ENTRY 0xBAC00002
+#define STRARC_MAGIC_SECURITY_REFERENCE 0xBAC00003
+
+// This magic is the Stream Attributes field in file headers with front coded
+// path names (-g:p). The stream name only holds the part of the path that
+// differs from the path in previous file header. The data part of the header
+// begins with a DWORD with the length in bytes of the part shared with the
+// previous path, followed by the same data as in STRARC_MAGIC headers.
+#define STRARC_MAGIC_FRONT_CODED 0xBAC00004
+
+// When the unnamed data stream of a file is stored as differences against
+// the same file in a base archive (-u), data that differs is stored in
+// ordinary sparse block streams. Data found in the base archive is stored as
+// copy streams, with stream id BACKUP_INVALID and this magic as the Stream
+// Attributes field. A copy stream holds a STRARC_DELTA_COPY structure
+// describing a range of data to copy from the file data in base archive.
+#define STRARC_MAGIC_DELTA_COPY 0xBAC00005
+
+// Block size used when searching for data in base archive for delta streams.
+// Only files with at least DELTA_MIN_FILE_SIZE bytes of data are stored as
+// delta streams. DELTA_WINDOW_SIZE is the size of the block of file data
+// searched at a time.
+#define DELTA_BLOCK_SIZE (16 << 10)
+#define DELTA_MIN_FILE_SIZE (1 << 20)
+#define DELTA_WINDOW_SIZE (1 << 20)
+
+// Number of hash slots for files in base archive.
+#define BASE_ARCHIVE_INDEX_SIZE 65536
+
+// Number of hash slots for files when merging archives (-y), and maximum
+// number of archives that can be merged. Security descriptor ids from each
+// merged archive are kept apart by storing the archive number in the high
+// bits of the id.
+#define MERGE_ARCHIVE_INDEX_SIZE (1 << 18)
+#define MERGE_ARCHIVE_MAX_COUNT 256
+#define MERGE_SECURITY_ID(a, id) (((a) << 24) | ((id) & 0x00FFFFFF))
+
+typedef struct _STRARC_DELTA_COPY
+{
+    LARGE_INTEGER Offset;
+    LARGE_INTEGER BaseOffset;
+    LARGE_INTEGER Length;
+    LARGE_INTEGER BaseSize;
+} STRARC_DELTA_COPY, *PSTRARC_DELTA_COPY;
+
+// Each range of an archive tested by a separate thread with -t:p is at least
+// this size.
+#define PARALLEL_TEST_MIN_RANGE_SIZE (64 << 20)
+
+// Maximum number of archive files in a stripe set written with --stripe, and
+// first line of the stripe set manifest file.
+#define STRIPE_SET_MAX_FILES 32
+#define STRIPE_SET_MANIFEST_SIGNATURE "strarc stripe set"
+
+// Each stripe file starts with a stripe header with the set id from the
+// manifest and the stripe number, starting at 1 for the first file in the
+// manifest. Data size is the number of archive bytes following the header,
+// and is written together with STRIPE_FLAG_COMPLETE when the whole archive
+// has been written.
+#define STRIPE_HEADER_SIGNATURE "strarc stripe\r\n"
+#define STRIPE_FLAG_COMPLETE 0x00000001
+
+typedef struct _STRARC_STRIPE_HEADER
+{
+    CHAR Signature[16];
+    ULONGLONG SetId;
+    ULONGLONG DataSize;
+    DWORD dwStripe;
+    DWORD dwFlags;
+} STRARC_STRIPE_HEADER, *PSTRARC_STRIPE_HEADER;
+
+// Maximum number of additional archive outputs with --tee, and number of
+// archive blocks queued for each of them before a slow output stalls the
+// archive.
+#define TEE_MAX_TARGETS 8
+#define TEE_QUEUE_BLOCKS 16
+
+// Format of volume file names with --volume. Volume numbers are appended to
+// archive name and start at 1.
+#define VOLUME_NAME_FORMAT L"%ws.%03u"
+
+// Each volume file starts with a volume header. All volumes of an archive
+// have the same set id, and the last volume has VOLUME_FLAG_LAST set. Data
+// size is the number of archive bytes following the header, and is written
+// together with the flags when the volume is complete.
+#define VOLUME_HEADER_SIGNATURE "strarc volume\r\n"
+#define VOLUME_FLAG_LAST 0x00000001
+
+typedef struct _STRARC_VOLUME_HEADER
+{
+    CHAR Signature[16];
+    ULONGLONG SetId;
+    ULONGLONG DataSize;
+    DWORD dwVolume;
+    DWORD dwFlags;
+} STRARC_VOLUME_HEADER, *PSTRARC_VOLUME_HEADER;
+
+// A file header with complete path is written at least this often when
+// writing front coded path names, so that an archive can be read again after
+// damaged parts.
+#define FRONT_CODED_RESTART_INTERVAL 1024
+
 // This is the extension added to the registry database snapshot files created
 // when backing up with the -r switch.
 #define REGISTRY_SNAPSHOT_FILE_EXTENSION L".$sards"
@@ -18,6 +125,12 @@
 #define DEFAULT_STREAM_BUFFER_SIZE (128 << 10)
 #endif
 
+// This is the size of the buffer used for each directory level when listing
+// directory contents during backup.
+#ifndef DIRECTORY_LIST_BUFFER_SIZE
+#define DIRECTORY_LIST_BUFFER_SIZE (64 << 10)
+#endif
+
 #ifndef USHORT_MAX
 #define USHORT_MAX INTSAFE_USHORT_MAX
 #endif
@@ -26,15 +139,27 @@
 // actual backed up data.
 #define HEADER_SIZE 20
 
+// This is the granularity used when searching for runs of zero bytes in file
+// data to store as sparse blocks. See description of the -g:z command line
+// switch for details.
+#define SPARSE_ZERO_BLOCK_SIZE 4096
+
 #include <ntfileio.hpp>
 #include <spsleep.h>
 
 #include "linktrack.hpp"
+#include "secdict.hpp"
+#include "pathidx.hpp"
+#include "perfstat.hpp"
+#include "listout.hpp"
+#include "arcstats.hpp"
 
 LPCSTR GetStreamIdDescription(DWORD StreamId);
 
 LPCSTR GetStreamAttributesDescription(DWORD StreamAttributesId);
 
+LPCSTR GetStrArcMagicDescription(DWORD StreamAttributes);
+
 LPCSTR GetFileAttributesDescription(DWORD FileAttributes);
 
 #ifdef _WIN64
@@ -123,6 +248,15 @@ public:
         BACKUP_METHOD_INC
     };
 
+    // Order in which entries in each directory are backed up. See description
+    // of the -p command line switch for details.
+    enum ReadOrders
+    {
+        READ_ORDER_DIRECTORY,
+        READ_ORDER_FILE_ID,
+        READ_ORDER_EXTENT
+    };
+
     // Information about currently raised exception, if any.
     struct StrArcExceptionData
     {
@@ -153,11 +287,49 @@ private:
     // nested class.
     class FileCopyContext;
 
+    // RestoreArchiveChain function runs a merge session in a separate thread
+    // using this internal class.
+    class MergeThreadContext;
+
+    // StartProgressReport function starts a thread using this internal class
+    // that periodically reports progress of current operation.
+    class ProgressReporter;
+
+    // TestArchiveRanges function tests each range of an archive in a
+    // separate thread using this internal class.
+    class RangeTestContext;
+
+    // OpenStripeSet function distributes archive blocks to stripe files, or
+    // reads them back in the same order, in separate threads using this
+    // internal class.
+    class StripeSet;
+
+    // OpenTeeTargets function copies the archive to additional outputs in
+    // separate threads using this internal class.
+    class TeeOutput;
+
+    // OpenVolumeSet function splits the archive into volume files, or reads
+    // them back, in a separate thread using this internal class.
+    class VolumeSet;
+
     WCHAR wczFullPathBuffer[32768];
 
     // Handle to the open archive the program is working with.
     HANDLE hArchive;
 
+    // Stripe set opened by OpenStripeSet(), otherwise NULL. When set, hArchive
+    // is a pipe to or from the stripe set threads.
+    StripeSet *Stripes;
+
+    // Additional archive outputs opened by OpenTeeTargets(), otherwise NULL.
+    // When set, hArchive is a pipe to the thread that writes to the archive
+    // and to each of these outputs.
+    TeeOutput *Tee;
+
+    // Volume set opened by OpenVolumeSet(), otherwise NULL. When set, hArchive
+    // is a pipe to or from the volume set thread.
+    VolumeSet *Volumes;
+
     // Handle to root directory of current backup or restore operation. Usually
     // set to NtCurrentDirectoryHandle() to make it same root directory as
     // current directory used in Win32 API calls.
@@ -170,10 +342,57 @@ private:
     // characters).
     UNICODE_STRING FullPath;
 
+    // Handle to the parent directory of last file where short name was looked
+    // up by BackupFile(), and relative path to that directory. Consecutive
+    // files in the same directory, which is usual when file names are read
+    // from a list, only need the directory to be opened once.
+    WCHAR wczParentDirPathBuffer[32768];
+    UNICODE_STRING ParentDirPath;
+    HANDLE hParentDir;
+
+    // Path in last file header written to or read from archive, used to
+    // encode and decode front coded path names.
+    WCHAR wczLastHeaderPathBuffer[32768];
+    UNICODE_STRING LastHeaderPath;
+    DWORD dwFrontCodedHeaderCount;
+
     // This is the buffer used when calling the backup API functions.
     LPBYTE Buffer;
     DWORD dwBufferSize;
 
+    // Read-ahead block used by ReadArchive(). Archive data is read from the
+    // archive handle in blocks of this size and stream headers, names and
+    // data are then served from this block. This way, restore and test
+    // operations do not need separate ReadFile calls for each header field.
+    // The block is allocated on first read from the archive.
+    LPBYTE ReadAheadBuffer;
+    DWORD dwReadAheadSize;
+    DWORD dwReadAheadPosition;
+    DWORD dwReadAheadFilled;
+
+    // Position in archive stream of next byte returned by ReadArchive(),
+    // counted from where reading started.
+    LONGLONG ArchivePosition;
+
+    // Position in archive stream of header of file currently restored or
+    // tested, as listed in catalogs.
+    LONGLONG FileHeaderPosition;
+
+    // Set when archive is read from a disk file, where stream data that is
+    // not needed can be skipped by moving the file pointer instead of reading
+    // the data. ArchiveSize is the size of such archive file.
+    bool bSeekableArchive;
+    LONGLONG ArchiveSize;
+
+    // Range of archive tested by a session created by TestArchiveRanges().
+    // RestoreDirectoryTree() stops at first file header with complete path
+    // at or after ScanEndPosition and sets ScanStopPosition to the position
+    // of that header. Security descriptors stored before ScanStartPosition
+    // are not known to the session.
+    LONGLONG ScanStartPosition;
+    LONGLONG ScanEndPosition;
+    LONGLONG ScanStopPosition;
+
     // Information about currently raised exception, if any.
     StrArcExceptionData ExceptionData;
 
@@ -194,13 +413,24 @@ private:
     // 256 slot hash table for hard link tracker
     LinkTrackerItem *LinkTrackerItems[256];
 
+    // 256 slot hash table for security descriptor dictionary, and last id
+    // assigned to a descriptor in the dictionary.
+    SecurityDictionaryItem *SecurityDictionaryItems[256];
+    DWORD dwSecurityDictionaryLastId;
+
+    // Base archive for delta streams (-u) and hash table with locations of
+    // file data in it. Both are NULL if no base archive is used.
+    HANDLE hBaseArchive;
+    BaseArchiveItem **BaseArchiveIndex;
+
     // Buffer object that holds data from last directory list operation.
     NtFileFinder finddata;
 
     void
         MEMBERCALL
         FillEntireBuffer(DWORD &dwBytesRead,
-            PLARGE_INTEGER BytesToRead);
+            PLARGE_INTEGER BytesToRead,
+            bool bSeekOnly = false);
 
     bool
         MEMBERCALL
@@ -219,7 +449,24 @@ private:
 
     bool
         MEMBERCALL
-        WriteFileAlternateStreamsFromArchive(DWORD dwBytesRead,
+        WriteFileSecurityFromArchive(HANDLE hFile,
+            DWORD dwBytesRead,
+            PLARGE_INTEGER BytesToRead,
+            PUNICODE_STRING File,
+            bool bSeekOnly);
+
+    bool
+        MEMBERCALL
+        WriteFileDeltaCopyFromArchive(HANDLE &hFile,
+            DWORD dwBytesRead,
+            PLARGE_INTEGER BytesToRead,
+            PUNICODE_STRING File,
+            bool &bSeekOnly);
+
+    bool
+        MEMBERCALL
+        WriteFileAlternateStreamsFromArchive(HANDLE hFile,
+            DWORD dwBytesRead,
             PLARGE_INTEGER BytesToRead,
             ULONG StreamAttributes,
             PUNICODE_STRING FileBaseName,
@@ -238,26 +485,95 @@ private:
             const PBY_HANDLE_FILE_INFORMATION FileInfo,
             PUNICODE_STRING ShortName);
 
+    bool
+        MEMBERCALL
+        DecodeFileHeader(DWORD dwHeaderDataSize,
+            PBY_HANDLE_FILE_INFORMATION FileInfo,
+            LPWSTR wczShortName);
+
+    bool
+        MEMBERCALL
+        FindRangeFileHeader(LONGLONG Position);
+
     void
         MEMBERCALL
         BackupDirectory(PUNICODE_STRING Path,
             HANDLE Handle);
 
+    void
+        MEMBERCALL
+        BackupDirectoryEntry(PUNICODE_STRING Path,
+            PUNICODE_STRING BasePath,
+            HANDLE Handle,
+            PFILE_ID_BOTH_DIR_INFORMATION Entry,
+            const FILE_FS_VOLUME_INFORMATION *VolumeInfo);
+
     bool
         MEMBERCALL
         BackupFile(PUNICODE_STRING File,
             PUNICODE_STRING ShortName,
-            bool bTraverseDirectories);
+            bool bTraverseDirectories,
+            HANDLE ParentDirectory = NULL,
+            PUNICODE_STRING EntryName = NULL,
+            const BY_HANDLE_FILE_INFORMATION *KnownInfo = NULL);
+
+    HANDLE
+        MEMBERCALL
+        OpenParentDirectory(PUNICODE_STRING Path);
+
+    void
+        CloseParentDirectory()
+    {
+        if (hParentDir != NULL)
+        {
+            NtClose(hParentDir);
+            hParentDir = NULL;
+        }
+
+        ParentDirPath.Length = 0;
+    }
+
+    // Returns true if a stream header is a valid file header, either with
+    // complete path or with front coded path.
+    static
+        bool
+        IsValidFileHeader(const WIN32_STREAM_ID *Header)
+    {
+        if ((Header->dwStreamId != BACKUP_INVALID) ||
+            (Header->dwStreamNameSize > 65535) ||
+            (Header->dwStreamNameSize & 1))
+            return false;
+
+        switch (Header->dwStreamAttributes)
+        {
+        case STRARC_MAGIC:
+            return (Header->dwStreamNameSize > 0) &&
+                ((Header->Size.QuadPart ==
+                    sizeof BY_HANDLE_FILE_INFORMATION) ||
+                (Header->Size.QuadPart ==
+                    sizeof BY_HANDLE_FILE_INFORMATION + 26));
+
+        case STRARC_MAGIC_FRONT_CODED:
+            return (Header->Size.QuadPart ==
+                sizeof(DWORD) + sizeof BY_HANDLE_FILE_INFORMATION) ||
+                (Header->Size.QuadPart ==
+                    sizeof(DWORD) + sizeof BY_HANDLE_FILE_INFORMATION + 26);
+
+        default:
+            return false;
+        }
+    }
+
+    bool
+        IsValidFileHeader()
+    {
+        return IsValidFileHeader(header);
+    }
 
     bool
         IsNewFileHeader()
     {
-        if ((header->dwStreamId == BACKUP_INVALID) &&
-            (header->dwStreamAttributes == STRARC_MAGIC) &&
-            ((header->Size.QuadPart == sizeof BY_HANDLE_FILE_INFORMATION) ||
-            (header->Size.QuadPart == sizeof BY_HANDLE_FILE_INFORMATION + 26))
-            && (header->dwStreamNameSize > 0)
-            && (header->dwStreamNameSize <= 65535))
+        if (IsValidFileHeader())
             return true;
 
         if (header->dwStreamNameSize & 1)
@@ -266,11 +582,130 @@ private:
         return false;
     }
 
+    // Returns true if current stream header is a delta copy stream.
+    bool
+        IsDeltaCopyStream()
+    {
+        return (header->dwStreamId == BACKUP_INVALID) &&
+            (header->dwStreamAttributes == STRARC_MAGIC_DELTA_COPY);
+    }
+
+    // Finds location of data for a file in base archive. Returns NULL if the
+    // file was not found.
+    BaseArchiveItem *
+        FindBaseArchiveFile(PUNICODE_STRING File)
+    {
+        for (BaseArchiveItem *item =
+            BaseArchiveIndex[BaseArchiveItem::Hash(File) &
+            (BASE_ARCHIVE_INDEX_SIZE - 1)];
+            item != NULL;
+            item = item->GetNext())
+            if (item->Match(File))
+                return item;
+
+        return NULL;
+    }
+
+    // Returns true if a stream is left out when merging archives (-y),
+    // because of -s:s or -s:n switches.
+    bool
+        IsMergeStreamSkipped(const WIN32_STREAM_ID *Header)
+    {
+        return ((!bProcessSecurity) &&
+            (Header->dwStreamId == BACKUP_SECURITY_DATA)) ||
+            (bSkipAlternateStreams &&
+            (Header->dwStreamId == BACKUP_ALTERNATE_DATA));
+    }
+
+    // Returns true if current stream header is a security descriptor
+    // dictionary entry or reference.
+    bool
+        IsSecurityDictionaryStream()
+    {
+        return (header->dwStreamId == BACKUP_SECURITY_DATA) &&
+            ((header->dwStreamAttributes == STRARC_MAGIC_SECURITY_ENTRY) ||
+            (header->dwStreamAttributes == STRARC_MAGIC_SECURITY_REFERENCE));
+    }
+
+    // Finds a security descriptor in the dictionary when backing up. If not
+    // found, the descriptor is added with a new id and *bAdded is set to true.
+    SecurityDictionaryItem *
+        MatchSecurityDescriptor(LPCVOID Data,
+            DWORD dwSize,
+            bool *bAdded)
+    {
+        DWORD dwHash = SecurityDictionaryItem::Hash(Data, dwSize);
+
+        for (SecurityDictionaryItem *item =
+            SecurityDictionaryItems[dwHash & 0xFF];
+            item != NULL;
+            item = item->GetNext())
+            if (item->MatchData(dwHash, Data, dwSize))
+            {
+                *bAdded = false;
+                return item;
+            }
+
+        SecurityDictionaryItem *NewItem =
+            SecurityDictionaryItem::NewItem(SecurityDictionaryItems[dwHash & 0xFF],
+                dwSecurityDictionaryLastId + 1,
+                dwHash,
+                Data,
+                dwSize);
+
+        if (NewItem == NULL)
+            Exception(XE_NOT_ENOUGH_MEMORY);
+
+        ++dwSecurityDictionaryLastId;
+        SecurityDictionaryItems[dwHash & 0xFF] = NewItem;
+
+        *bAdded = true;
+        return NewItem;
+    }
+
+    // Adds a security descriptor read from an archive dictionary entry. Any
+    // earlier descriptor with the same id is replaced.
+    SecurityDictionaryItem *
+        AddSecurityDescriptor(DWORD dwId,
+            LPCVOID Data,
+            DWORD dwSize)
+    {
+        SecurityDictionaryItem *NewItem =
+            SecurityDictionaryItem::NewItem(SecurityDictionaryItems[dwId & 0xFF],
+                dwId,
+                0,
+                Data,
+                dwSize);
+
+        if (NewItem == NULL)
+            Exception(XE_NOT_ENOUGH_MEMORY);
+
+        SecurityDictionaryItems[dwId & 0xFF] = NewItem;
+
+        return NewItem;
+    }
+
+    // Finds a security descriptor by id when restoring. Returns NULL if not
+    // found.
+    SecurityDictionaryItem *
+        LookupSecurityDescriptor(DWORD dwId)
+    {
+        for (SecurityDictionaryItem *item = SecurityDictionaryItems[dwId & 0xFF];
+            item != NULL;
+            item = item->GetNext())
+            if (item->MatchId(dwId))
+                return item;
+
+        return NULL;
+    }
+
     PUNICODE_STRING
         MatchLink(DWORD dwVolumeSerialNumber,
             LONGLONG NodeNumber,
             PUNICODE_STRING Name)
     {
+        PerfTimer timer(Statistics, PERF_PHASE_LINK_TRACK);
+
         PUNICODE_STRING LinkName = NULL;
 
         for (LinkTrackerItem * linkinfo =
@@ -308,6 +743,8 @@ private:
             bool *Excluded OPTIONAL,
             bool *Included OPTIONAL)
     {
+        PerfTimer timer(Statistics, PERF_PHASE_FILTER);
+
         // This routine does not handle empty strings correctly.
         if (Path->Length == 0)
         {
@@ -415,11 +852,97 @@ private:
             PUNICODE_STRING SourceName,
             PUNICODE_STRING TargetName);
 
-    // This function reads up to the specified block size from the archive. If
-    // EOF, it returns the number of bytes actually read.
+    // These functions read or write a complete block on a file or pipe handle
+    // used by threads that pass archive data through pipes. Reading stops
+    // early only at end of file or when the other end of a pipe is closed,
+    // and returns false on other errors.
+    static
+        bool
+        ReadHandleBlock(HANDLE hFile,
+            LPBYTE lpBuf,
+            DWORD dwSize,
+            LPDWORD lpdwRead)
+    {
+        *lpdwRead = 0;
+
+        while (dwSize > 0)
+        {
+            DWORD dwBytesRead;
+
+            if (!ReadFile(hFile, lpBuf, dwSize, &dwBytesRead, NULL))
+                switch (GetLastError())
+                {
+                case ERROR_BROKEN_PIPE:
+                case ERROR_HANDLE_EOF:
+                    dwBytesRead = 0;
+                    break;
+                default:
+                    return false;
+                }
+
+            if (dwBytesRead == 0)
+                break;
+
+            *lpdwRead += dwBytesRead;
+            dwSize -= dwBytesRead;
+            lpBuf += dwBytesRead;
+        }
+
+        return true;
+    }
+
+    static
+        bool
+        WriteHandleBlock(HANDLE hFile, LPBYTE lpBuf, DWORD dwSize)
+    {
+        while (dwSize > 0)
+        {
+            DWORD dwBytesWritten;
+
+            if (!WriteFile(hFile, lpBuf, dwSize, &dwBytesWritten, NULL))
+                return false;
+
+            dwSize -= dwBytesWritten;
+            lpBuf += dwBytesWritten;
+        }
+
+        return true;
+    }
+
+    // Returns a new id for volumes or stripe files of an archive. Time of
+    // creation and process id are enough to tell files of different
+    // archives apart.
+    static
+        ULONGLONG
+        NewArchiveSetId()
+    {
+        FILETIME CreationTime;
+        GetSystemTimeAsFileTime(&CreationTime);
+
+        return (((ULONGLONG)CreationTime.dwHighDateTime << 32) |
+            CreationTime.dwLowDateTime) ^
+            ((ULONGLONG)GetCurrentProcessId() << 48);
+    }
+
+    // A pipe closed by another thread is the normal way for such threads to
+    // learn that the session or another thread has ended.
+    static
+        bool
+        IsPipeClosedError(DWORD dwError)
+    {
+        return (dwError == ERROR_BROKEN_PIPE) || (dwError == ERROR_NO_DATA);
+    }
+
+    // This function reads up to the specified block size directly from the
+    // archive handle, bypassing the read-ahead block. If bPartial is true, it
+    // returns as soon as some data has been read. Otherwise it keeps reading
+    // until the block is complete or EOF and returns the number of bytes
+    // actually read.
     DWORD
-        ReadArchive(LPBYTE lpBuf, DWORD dwSize)
+        ReadArchiveRaw(LPBYTE lpBuf, DWORD dwSize, bool bPartial = false)
     {
+        PerfTimer timer(Statistics, PERF_PHASE_ARCHIVE_READ);
+
         DWORD dwBytesRead;
         DWORD dwTotalBytes = 0;
 
@@ -439,16 +962,127 @@ private:
                 }
 
             if (dwBytesRead == 0)
-                return dwTotalBytes;
+                break;
 
             dwTotalBytes += dwBytesRead;
             dwSize -= dwBytesRead;
             lpBuf += dwBytesRead;
+
+            if (bPartial)
+                break;
         }
 
+        timer.SetBytes(dwTotalBytes);
+
+        if (Progress != NULL)
+            Progress->AddArchiveRead(dwTotalBytes);
+
         return dwTotalBytes;
     }
 
+    // This function reads next block from archive into the read-ahead block.
+    // It returns number of bytes available in the block, which is zero on
+    // EOF.
+    DWORD
+        FillReadAheadBuffer()
+    {
+        if (ReadAheadBuffer == NULL)
+        {
+            ReadAheadBuffer = (LPBYTE)LocalAlloc(LMEM_FIXED, dwBufferSize);
+
+            if (ReadAheadBuffer == NULL)
+                Exception(XE_NOT_ENOUGH_MEMORY);
+
+            dwReadAheadSize = dwBufferSize;
+        }
+
+        dwReadAheadPosition = 0;
+        dwReadAheadFilled = ReadArchiveRaw(ReadAheadBuffer,
+            dwReadAheadSize,
+            true);
+
+        return dwReadAheadFilled;
+    }
+
+    // Discards any data in the read-ahead block, for instance when archive
+    // handle is changed or repositioned.
+    void
+        ResetReadAheadBuffer()
+    {
+        dwReadAheadPosition = 0;
+        dwReadAheadFilled = 0;
+    }
+
+    // This function reads up to the specified block size from the archive. If
+    // EOF, it returns the number of bytes actually read. Small reads are
+    // served from the read-ahead block. Reads of at least a complete buffer
+    // size go directly to the archive handle once the read-ahead block is
+    // empty.
+    DWORD
+        ReadArchive(LPBYTE lpBuf, DWORD dwSize)
+    {
+        DWORD dwTotalBytes = 0;
+
+        while (dwSize > 0)
+        {
+            DWORD dwAvailable = dwReadAheadFilled - dwReadAheadPosition;
+
+            if (dwAvailable == 0)
+            {
+                if (dwSize >= dwBufferSize)
+                {
+                    DWORD dwBytesRead = ReadArchiveRaw(lpBuf, dwSize);
+                    ArchivePosition += dwBytesRead;
+                    return dwTotalBytes + dwBytesRead;
+                }
+
+                dwAvailable = FillReadAheadBuffer();
+
+                if (dwAvailable == 0)
+                    break;
+            }
+
+            if (dwAvailable > dwSize)
+                dwAvailable = dwSize;
+
+            CopyMemory(lpBuf,
+                ReadAheadBuffer + dwReadAheadPosition,
+                dwAvailable);
+
+            dwReadAheadPosition += dwAvailable;
+            ArchivePosition += dwAvailable;
+            dwTotalBytes += dwAvailable;
+            dwSize -= dwAvailable;
+            lpBuf += dwAvailable;
+        }
+
+        return dwTotalBytes;
+    }
+
+    // This function works like ReadArchive() but instead of copying data it
+    // returns a pointer to data within the read-ahead block. It returns
+    // number of bytes available at *lpView, up to dwMaxSize, which could be
+    // less than requested even if not at EOF. Data at *lpView is valid until
+    // next read from archive.
+    DWORD
+        ViewArchive(LPBYTE *lpView, DWORD dwMaxSize)
+    {
+        DWORD dwAvailable = dwReadAheadFilled - dwReadAheadPosition;
+
+        if (dwAvailable == 0)
+            dwAvailable = FillReadAheadBuffer();
+
+        if (dwAvailable > dwMaxSize)
+            dwAvailable = dwMaxSize;
+
+        *lpView = ReadAheadBuffer + dwReadAheadPosition;
+
+        dwReadAheadPosition += dwAvailable;
+        ArchivePosition += dwAvailable;
+
+        return dwAvailable;
+    }
+
     // This function reads a stream header within a restore operation for a file.
     // There could be several streams for each file.
     // If no more stream headers exist in input archive, this function zeroes
@@ -460,6 +1094,8 @@ private:
 
         if (dwBytesRead < HEADER_SIZE)
             memset(Buffer, 0, HEADER_SIZE);
+        else if ((Statistics != NULL) && !IsValidFileHeader())
+            Statistics->AddStream(header->dwStreamId, header->Size.QuadPart);
 
         return dwBytesRead;
     }
@@ -476,15 +1112,13 @@ private:
         if (dwBytesRead < HEADER_SIZE)
             return false;
 
-        if ((header->dwStreamId == BACKUP_INVALID) &&
-            (header->dwStreamAttributes == STRARC_MAGIC) &&
-            ((header->Size.QuadPart == sizeof BY_HANDLE_FILE_INFORMATION) ||
-            (header->Size.QuadPart == sizeof BY_HANDLE_FILE_INFORMATION + 26)) &&
-            (header->dwStreamNameSize > 0) &&
-            (header->dwStreamNameSize <= 65535) &&
-            ((header->dwStreamNameSize & 1) == 0))
+        if (IsValidFileHeader())
             return true;
 
+        // Front coded paths cannot be decoded until next header with
+        // complete path.
+        LastHeaderPath.Length = 0;
+
         if (bVerbose)
             fprintf(stderr, "strarc: Invalid header "
                 "[id=%s, attr=%s, %u bytes name, size=0x%.8x%.8x], seeking...\n",
@@ -510,14 +1144,7 @@ private:
                     stderr);
                 return false;
             }
-        } while ((header->dwStreamId != BACKUP_INVALID) ||
-            (header->dwStreamAttributes != STRARC_MAGIC) ||
-            ((header->Size.QuadPart != sizeof BY_HANDLE_FILE_INFORMATION) &&
-            (header->Size.QuadPart !=
-                sizeof BY_HANDLE_FILE_INFORMATION + 26)) ||
-                (header->dwStreamNameSize == 0) ||
-            (header->dwStreamNameSize > 65535) ||
-            (header->dwStreamNameSize & 1));
+        } while (!IsValidFileHeader());
 
         return true;
     }
@@ -529,6 +1156,12 @@ private:
     void
         WriteArchive(LPBYTE lpBuf, DWORD dwSize)
     {
+        PerfTimer timer(Statistics, PERF_PHASE_ARCHIVE_WRITE);
+        timer.SetBytes(dwSize);
+
+        if (Progress != NULL)
+            Progress->AddArchiveWritten(dwSize);
+
         DWORD dwBytesWritten;
 
         while (dwSize > 0)
@@ -548,13 +1181,85 @@ private:
             }
     }
 
-    // This function skips forward in current archive, using current buffer. If
+    // This function moves archive file pointer forward past data that does
+    // not need to be read. Any data left in the read-ahead block is
+    // discarded. It returns false if archive is not seekable or if the new
+    // position would be beyond end of archive, in which case nothing is
+    // changed.
+    bool
+        SeekArchive(LONGLONG Distance)
+    {
+        if (!bSeekableArchive)
+            return false;
+
+        LONGLONG BufferedBytes = dwReadAheadFilled - dwReadAheadPosition;
+
+        LARGE_INTEGER move;
+        move.QuadPart = Distance - BufferedBytes;
+
+        LARGE_INTEGER new_position;
+        if (!SetFilePointerEx(hArchive, move, &new_position, FILE_CURRENT))
+            return false;
+
+        if (new_position.QuadPart > ArchiveSize)
+        {
+            // Archive could have grown since it was opened.
+            LARGE_INTEGER size;
+            if (GetFileSizeEx(hArchive, &size))
+                ArchiveSize = size.QuadPart;
+
+            if (new_position.QuadPart > ArchiveSize)
+            {
+                move.QuadPart = -move.QuadPart;
+                SetFilePointerEx(hArchive, move, NULL, FILE_CURRENT);
+                return false;
+            }
+        }
+
+        ResetReadAheadBuffer();
+        ArchivePosition += Distance;
+
+        if (Progress != NULL)
+            Progress->AddArchiveSkipped(move.QuadPart);
+
+        return true;
+    }
+
+    // This function moves archive file pointer to a position counted from
+    // beginning of a seekable archive. Any data in the read-ahead block is
+    // discarded.
+    bool
+        SetArchivePosition(LONGLONG Position)
+    {
+        LARGE_INTEGER position;
+        position.QuadPart = Position;
+
+        if (!SetFilePointerEx(hArchive, position, NULL, FILE_BEGIN))
+            return false;
+
+        ResetReadAheadBuffer();
+        ArchivePosition = Position;
+
+        return true;
+    }
+
+    // This function skips forward in current archive, using the read-ahead
+    // block without copying skipped data, or by moving the file pointer when
+    // archive is a seekable file and the data is not already read. If
     // cancelled, it returns false, otherwise true.
     bool
         SkipArchive(PLARGE_INTEGER BytesToRead)
     {
         DWORD dwBytesRead;
 
+        if ((BytesToRead->QuadPart >
+            (LONGLONG)(dwReadAheadFilled - dwReadAheadPosition)) &&
+            SeekArchive(BytesToRead->QuadPart))
+        {
+            BytesToRead->QuadPart = 0;
+            return true;
+        }
+
         while (BytesToRead->QuadPart > 0)
         {
             YieldSingleProcessor();
@@ -562,7 +1267,8 @@ private:
             if (bCancel)
                 return false;
 
-            dwBytesRead = ReadArchive(Buffer,
+            LPBYTE lpView;
+            dwBytesRead = ViewArchive(&lpView,
                 BytesToRead->QuadPart >
                 (LONGLONG)dwBufferSize ?
                 dwBufferSize : BytesToRead->LowPart);
@@ -584,6 +1290,63 @@ private:
         return true;
     }
 
+    // This function calls BackupWrite(), timed when statistics are enabled.
+    BOOL
+        BackupWriteBlock(HANDLE hFile,
+            LPBYTE lpBuf,
+            DWORD dwSize,
+            LPDWORD lpdwBytesWritten,
+            LPVOID *lpCtx)
+    {
+        PerfTimer timer(Statistics, PERF_PHASE_BACKUP_WRITE);
+        timer.SetBytes(dwSize);
+
+        return BackupWrite(hFile, lpBuf, dwSize, lpdwBytesWritten, FALSE,
+            bProcessSecurity, lpCtx);
+    }
+
+    // Returns start time of an operation timed with PerfEnd(), if
+    // statistics are enabled.
+    LONGLONG
+        PerfStart()
+    {
+        return Statistics != NULL ? PerfStatistics::Now() : 0;
+    }
+
+    void
+        PerfEnd(PerfPhase Phase, LONGLONG StartTicks, LONGLONG Bytes = 0)
+    {
+        if (Statistics != NULL)
+            Statistics->AddTime(Phase, StartTicks, Bytes);
+    }
+
+    // Lists a file name on stdout, buffered if Listing is set.
+    void
+        ListFileName(PCUNICODE_STRING Name)
+    {
+        if (Listing != NULL)
+            Listing->Write(Name);
+        else
+            WriteListedName(Name);
+    }
+
+    // Lists a file found in archive, either by name or as a catalog record
+    // that is completed with stream information when all streams of the
+    // file have been read.
+    void
+        ListArchiveFile(PCUNICODE_STRING File,
+            const BY_HANDLE_FILE_INFORMATION *FileInfo,
+            PCUNICODE_STRING ShortName)
+    {
+        if (Listing == NULL)
+            WriteListedName(File);
+        else if (Listing->IsCatalog())
+            Listing->BeginRecord(File, FileInfo, ShortName,
+                FileHeaderPosition);
+        else
+            Listing->Write(File);
+    }
+
     bool
         InitializeBuffer(DWORD dwSize)
     {
@@ -597,6 +1360,77 @@ private:
         ReadFileStreamsToArchive(PUNICODE_STRING File,
             HANDLE hFile);
 
+    bool
+        MEMBERCALL
+        ReadFileStreamsToArchiveByStream(PUNICODE_STRING File,
+            HANDLE hFile);
+
+    bool
+        MEMBERCALL
+        BackupReadBlock(HANDLE hFile,
+            LPBYTE lpBuf,
+            DWORD dwSize,
+            LPVOID *lpCtx);
+
+    bool
+        MEMBERCALL
+        ReadDataStreamAsSparseBlocks(PUNICODE_STRING File,
+            HANDLE hFile,
+            LPVOID *lpCtx);
+
+    bool
+        MEMBERCALL
+        ReadDataStreamAsDelta(PUNICODE_STRING File,
+            HANDLE hFile,
+            LPVOID *lpCtx,
+            BaseArchiveItem *Base);
+
+    void
+        MEMBERCALL
+        WriteDeltaLiteral(LONGLONG Offset,
+            LPBYTE lpData,
+            DWORD dwSize);
+
+    void
+        MEMBERCALL
+        WriteDeltaCopy(PSTRARC_DELTA_COPY Copy);
+
+    DWORD
+        MEMBERCALL
+        ReadArchiveAt(HANDLE hFile,
+            LONGLONG Offset,
+            LPBYTE lpBuf,
+            DWORD dwSize);
+
+    DWORD
+        ReadBaseArchive(LONGLONG Offset,
+            LPBYTE lpBuf,
+            DWORD dwSize)
+    {
+        return ReadArchiveAt(hBaseArchive, Offset, lpBuf, dwSize);
+    }
+
+    DWORD
+        MEMBERCALL
+        ReadBaseArchiveData(BaseArchiveItem *Base,
+            LONGLONG Offset,
+            LPBYTE lpBuf,
+            DWORD dwSize);
+
+    bool
+        MEMBERCALL
+        ScanMergeArchive(HANDLE hInput,
+            DWORD dwArchive,
+            LPCWSTR wczArchive,
+            MergeArchiveIndex &Index);
+
+    bool
+        MEMBERCALL
+        CopyMergeRecord(HANDLE hInput,
+            LPCWSTR wczArchive,
+            MergeArchiveItem *Item,
+            LPBYTE header_buffer);
+
     bool
         MEMBERCALL
         WriteFileFromArchive(PUNICODE_STRING File,
@@ -607,7 +1441,27 @@ private:
         __declspec(noreturn) MEMBERCALL
         Exception(XError XE, LPCWSTR Name = NULL);
 
+    void
+        MEMBERCALL
+        WriteListedName(PCUNICODE_STRING Name);
+
     LONGLONG FileCounter;
+
+    // Performance counters enabled with -q, otherwise NULL. Sessions created
+    // by TemplateNew() share the same counters.
+    PerfStatistics *Statistics;
+
+    // Counters for progress reports enabled with -h, otherwise NULL. Shared
+    // by sessions created by TemplateNew() like Statistics.
+    ProgressCounters *Progress;
+
+    // Output of file names listed with -t and -l. Set by Main() when listing.
+    ListOutput *Listing;
+
+    // Archive contents counted by ScanArchiveStatistics() with -t:s,
+    // otherwise NULL.
+    ArchiveStatistics *ContentStatistics;
+
     DWORD dwExtractCreation;
     DWORD dwCreateOption;
 
@@ -631,10 +1485,17 @@ private:
     bool bFreshenExisting;
     bool bRestoreShortNamesOnly;
     bool bBackupRegistrySnapshots;
+    bool bSparseZeroBlocks;
+    bool bSecurityDictionary;
+    bool bFrontCodedPaths;
+    bool bSkipAlternateStreams;
 
     // Backup method for this session
     BackupMethods BackupMethod;
 
+    // Order of entries within directories when backing up
+    ReadOrders ReadOrder;
+
     // Strings used by ExcludedString method
     DWORD dwExcludeStrings;
     LPWSTR szExcludeStrings;
@@ -654,10 +1515,34 @@ private:
         memset(cloned->LinkTrackerItems,
             0,
             sizeof(cloned->LinkTrackerItems));
+        memset(cloned->SecurityDictionaryItems,
+            0,
+            sizeof(cloned->SecurityDictionaryItems));
+        cloned->dwSecurityDictionaryLastId = 0;
+        cloned->hBaseArchive = NULL;
+        cloned->BaseArchiveIndex = NULL;
 
         cloned->Buffer = NULL;
+        cloned->ParentDirPath.Buffer = cloned->wczParentDirPathBuffer;
+        cloned->ParentDirPath.Length = 0;
+        cloned->hParentDir = NULL;
+        cloned->LastHeaderPath.Buffer = cloned->wczLastHeaderPathBuffer;
+        cloned->LastHeaderPath.Length = 0;
+        cloned->dwFrontCodedHeaderCount = 0;
+        cloned->ReadAheadBuffer = NULL;
+        cloned->dwReadAheadSize = 0;
+        cloned->ResetReadAheadBuffer();
+        cloned->ArchivePosition = 0;
+        cloned->bSeekableArchive = false;
         cloned->RootDirectory = NULL;
         cloned->hArchive = NULL;
+        cloned->Stripes = NULL;
+        cloned->Tee = NULL;
+        cloned->Volumes = NULL;
+
+        // Output buffer for listed names is not thread safe. Files are listed
+        // by the session that created the clone.
+        cloned->Listing = NULL;
 
         if (!cloned->InitializeBuffer(cloned->dwBufferSize))
         {
@@ -705,6 +1590,74 @@ protected:
         OpenFilterUtility(LPWSTR wczFilterCmd,
             bool bBackupMode);
 
+    bool
+        MEMBERCALL
+        CloseArchive();
+
+    bool
+        MEMBERCALL
+        OpenStripeSet(LPCWSTR wczManifest,
+            LPCWSTR wczStripeFiles,
+            bool bBackupMode);
+
+    bool
+        MEMBERCALL
+        CloseStripeSet();
+
+    bool
+        MEMBERCALL
+        OpenTeeTargets(DWORD dwTargets,
+            LPWSTR *wczTargets,
+            DWORD dwArchiveCreation);
+
+    bool
+        MEMBERCALL
+        CloseTeeTargets();
+
+    bool
+        MEMBERCALL
+        OpenVolumeSet(LPCWSTR wczArchive,
+            ULONGLONG VolumeSize,
+            bool bBackupMode);
+
+    bool
+        MEMBERCALL
+        CloseVolumeSet();
+
+    bool
+        MEMBERCALL
+        OpenBaseArchive(LPCWSTR wczBaseArchive);
+
+    bool
+        MEMBERCALL
+        MergeArchives(int iArchives,
+            LPWSTR *wczArchives);
+
+    bool
+        MEMBERCALL
+        RestoreArchiveChain(int iArchives,
+            LPWSTR *wczArchives);
+
+    bool
+        MEMBERCALL
+        TestArchiveRanges(LPCWSTR wczArchive,
+            DWORD dwThreads);
+
+    void
+        MEMBERCALL
+        ReportStatistics(bool bSummary,
+            LPCWSTR wczJsonFile,
+            LPCWSTR wczTraceFile);
+
+    ProgressReporter *
+        MEMBERCALL
+        StartProgressReport(DWORD dwInterval,
+            LPCWSTR wczStatusFile);
+
+    void
+        MEMBERCALL
+        StopProgressReport(ProgressReporter *Reporter);
+
     bool
         MEMBERCALL
         OpenWorkingDirectory(LPCWSTR wczStartDir,
@@ -822,6 +1775,8 @@ public:
 
             BackupFile((argv++)[1], true);
         }
+
+        CloseParentDirectory();
     }
 
     void
@@ -832,6 +1787,24 @@ public:
         MEMBERCALL
         BackupFilenamesFromStreamA(HANDLE hInputFile);
 
+    // Reads Unicode file names separated by Delimiter from an input stream
+    // and backs up each file. If Delimiter is L'\n', names are read as lines
+    // and any trailing L'\r' is removed from each name.
+    void
+        MEMBERCALL
+        BackupFilenamesFromStreamW(HANDLE hInputFile,
+            WCHAR Delimiter);
+
+    // Reads file names in specified code page, for example CP_ACP or CP_UTF8,
+    // separated by Delimiter from an input stream and backs up each file. If
+    // Delimiter is '\n', names are read as lines and any trailing '\r' is
+    // removed from each name.
+    void
+        MEMBERCALL
+        BackupFilenamesFromStreamA(HANDLE hInputFile,
+            UINT CodePage,
+            CHAR Delimiter);
+
     bool
         BackupCurrentDirectory()
     {
@@ -864,7 +1837,11 @@ public:
         STRARC_FLAG_OVERWRITE_ARCHIVED = 0x00002000UL,
         STRARC_FLAG_FRESHEN_EXISTING = 0x00004000UL,
         STRARC_FLAG_RESTORE_SHORT_NAMES_ONLY = 0x00008000UL,
-        STRARC_FLAG_BACKUP_REGISTRY_SNAPSHOTS = 0x00010000UL
+        STRARC_FLAG_BACKUP_REGISTRY_SNAPSHOTS = 0x00010000UL,
+        STRARC_FLAG_SPARSE_ZERO_BLOCKS = 0x00020000UL,
+        STRARC_FLAG_SECURITY_DICTIONARY = 0x00040000UL,
+        STRARC_FLAG_FRONT_CODED_PATHS = 0x00080000UL,
+        STRARC_FLAG_NO_ALTERNATE_STREAMS = 0x00100000UL
     };
 
     MEMBERCALL
@@ -916,6 +1893,12 @@ public:
     bool
         MEMBERCALL
         RestoreDirectoryTree();
+
+    // Reads headers of all files and streams in archive, skipping stream
+    // data, and counts them in ContentStatistics.
+    bool
+        MEMBERCALL
+        ScanArchiveStatistics();
 };
 
 #pragma pack(pop)
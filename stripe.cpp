@@ -0,0 +1,871 @@
+/* Stream Archive I/O utility, Copyright (C) Olof Lagerkvist 2004-2022
+*
+* stripe.cpp
+* Archive striped over several files (--stripe).
+*/
+
+#ifndef _UNICODE
+#define _UNICODE
+#endif
+#ifndef _DLL
+#define _DLL
+#endif
+#ifndef UNICODE
+#define UNICODE
+#endif
+#ifndef _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#define WIN32_NO_STATUS
+#include <process.h>
+#include <windows.h>
+#include <intsafe.h>
+#undef WIN32_NO_STATUS
+#include <ntdll.h>
+
+#include <winstrct.h>
+#include <wio.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "strarc.hpp"
+
+// Size in characters of the buffer for full paths of all stripe files, and
+// maximum size in bytes of a manifest file.
+#define STRIPE_SET_NAMES_SIZE 32768
+#define STRIPE_SET_MANIFEST_MAX_SIZE (STRIPE_SET_NAMES_SIZE * 3 + 256)
+
+// Archive data is split into blocks that are written to the stripe files in
+// turn, first block to first file, second block to second file and so on.
+// A distributor thread reads the archive from a pipe written by the session
+// and passes each block through another pipe to a thread for the stripe file
+// where it belongs, so that all stripe files are written at the same time.
+// When restoring, the stripe threads read their files and the distributor
+// thread writes blocks in the original order to the pipe that the session
+// reads. Pipes are sized to hold a complete block, so each stripe thread can
+// write or read one block ahead. Each stripe file starts with a stripe
+// header, so that a stripe file from another archive, a stripe file in the
+// wrong place in the manifest or a truncated stripe file is found when
+// reading.
+class StrArc::StripeSet
+{
+    struct StripeFile
+    {
+        StripeSet *Set;
+        LPWSTR Name;
+        HANDLE hFile;
+        HANDLE hPipe;
+        HANDLE hThread;
+        ULONGLONG DataSize;
+    };
+
+    bool bWrite;
+    DWORD dwBlockSize;
+    DWORD dwStripes;
+    ULONGLONG SetId;
+    StripeFile Files[STRIPE_SET_MAX_FILES];
+
+    // Total size of archive data in all stripe files, when reading.
+    ULONGLONG ArchiveSize;
+
+    // Set by the distributor thread when the session has written all
+    // archive data, so that stripe threads mark their files as complete.
+    volatile bool bArchiveComplete;
+
+    // Distributor ends of pipes to stripe threads.
+    HANDLE hStripePipes[STRIPE_SET_MAX_FILES];
+
+    // Distributor end of pipe to or from the session.
+    HANDLE hArchivePipe;
+    HANDLE hDistributorThread;
+
+    LPWSTR wczNames;
+
+    // Buffer for a stripe file name before it is added to wczNames.
+    LPWSTR wczNameBuffer;
+
+    static
+        unsigned
+        CALLBACK
+        StripeThread(void *lpCtx)
+    {
+        StripeFile *Stripe = (StripeFile *)lpCtx;
+        StripeSet *Set = Stripe->Set;
+
+        DWORD dwResult = NO_ERROR;
+        bool bTruncated = false;
+
+        LPBYTE lpBuf = (LPBYTE)LocalAlloc(LMEM_FIXED, Set->dwBlockSize);
+
+        if (lpBuf == NULL)
+            dwResult = GetLastError();
+        else if (Set->bWrite)
+            for (;;)
+            {
+                DWORD dwBytes;
+
+                if (!ReadHandleBlock(Stripe->hPipe, lpBuf,
+                    Set->dwBlockSize, &dwBytes))
+                {
+                    dwResult = GetLastError();
+                    break;
+                }
+
+                // Data size is written to the stripe header only when all
+                // archive data has been written to the stripe files.
+                if (dwBytes == 0)
+                {
+                    if (Set->bArchiveComplete &&
+                        !Set->WriteHeader(Stripe, STRIPE_FLAG_COMPLETE))
+                        dwResult = GetLastError();
+
+                    break;
+                }
+
+                if (!WriteHandleBlock(Stripe->hFile, lpBuf, dwBytes))
+                {
+                    dwResult = GetLastError();
+                    break;
+                }
+
+                Stripe->DataSize += dwBytes;
+            }
+        else
+            for (ULONGLONG BytesToRead = Stripe->DataSize; BytesToRead > 0;)
+            {
+                DWORD dwChunk = BytesToRead > Set->dwBlockSize ?
+                    Set->dwBlockSize : (DWORD)BytesToRead;
+
+                DWORD dwBytes;
+
+                if (!ReadHandleBlock(Stripe->hFile, lpBuf, dwChunk, &dwBytes))
+                {
+                    dwResult = GetLastError();
+                    break;
+                }
+
+                if (dwBytes != dwChunk)
+                {
+                    bTruncated = true;
+                    dwResult = ERROR_HANDLE_EOF;
+                    break;
+                }
+
+                // Distributor thread has stopped reading.
+                if (!WriteHandleBlock(Stripe->hPipe, lpBuf, dwBytes))
+                    break;
+
+                BytesToRead -= dwBytes;
+            }
+
+        if (lpBuf != NULL)
+            LocalFree(lpBuf);
+
+        // This tells the distributor thread that this stripe has ended.
+        CloseHandle(Stripe->hPipe);
+        Stripe->hPipe = NULL;
+
+        if (bTruncated)
+            oem_printf(stderr,
+                "strarc: Stripe file '%1!ws!' is truncated.%%n",
+                Stripe->Name);
+        else if ((dwResult != NO_ERROR) && !IsPipeClosedError(dwResult))
+        {
+            WErrMsgA errmsg(dwResult);
+            oem_printf(stderr,
+                "strarc: Error %1!s! stripe file '%2!ws!': %3%%n",
+                Set->bWrite ? "writing" : "reading",
+                Stripe->Name,
+                errmsg);
+        }
+
+        return dwResult;
+    }
+
+    static
+        unsigned
+        CALLBACK
+        DistributorThread(void *lpCtx)
+    {
+        StripeSet *Set = (StripeSet *)lpCtx;
+
+        DWORD dwResult = NO_ERROR;
+        ULONGLONG BytesToRead = Set->ArchiveSize;
+
+        LPBYTE lpBuf = (LPBYTE)LocalAlloc(LMEM_FIXED, Set->dwBlockSize);
+
+        if (lpBuf == NULL)
+            dwResult = GetLastError();
+        else
+            for (DWORD i = 0;; i = (i + 1) % Set->dwStripes)
+            {
+                DWORD dwBytes;
+
+                if (Set->bWrite)
+                {
+                    if (!ReadHandleBlock(Set->hArchivePipe, lpBuf,
+                        Set->dwBlockSize, &dwBytes))
+                    {
+                        dwResult = GetLastError();
+                        break;
+                    }
+
+                    if (dwBytes == 0)
+                    {
+                        Set->bArchiveComplete = true;
+                        break;
+                    }
+
+                    if (!WriteHandleBlock(Set->hStripePipes[i], lpBuf,
+                        dwBytes))
+                        break;
+                }
+                else
+                {
+                    if (BytesToRead == 0)
+                        break;
+
+                    // Only the last block of the archive is shorter than
+                    // the block size.
+                    DWORD dwChunk = BytesToRead > Set->dwBlockSize ?
+                        Set->dwBlockSize : (DWORD)BytesToRead;
+
+                    if (!ReadHandleBlock(Set->hStripePipes[i], lpBuf,
+                        dwChunk, &dwBytes))
+                    {
+                        dwResult = GetLastError();
+                        break;
+                    }
+
+                    // The stripe thread has reported why its data ended.
+                    if (dwBytes != dwChunk)
+                    {
+                        dwResult = ERROR_HANDLE_EOF;
+                        break;
+                    }
+
+                    if (!WriteHandleBlock(Set->hArchivePipe, lpBuf, dwBytes))
+                        break;
+
+                    BytesToRead -= dwBytes;
+                }
+            }
+
+        if (lpBuf != NULL)
+            LocalFree(lpBuf);
+
+        // This makes the session and all stripe threads find end of data or
+        // fail writing to their pipes.
+        CloseHandle(Set->hArchivePipe);
+        Set->hArchivePipe = NULL;
+
+        for (DWORD i = 0; i < Set->dwStripes; i++)
+        {
+            CloseHandle(Set->hStripePipes[i]);
+            Set->hStripePipes[i] = NULL;
+        }
+
+        if ((dwResult != NO_ERROR) && (dwResult != ERROR_HANDLE_EOF) &&
+            !IsPipeClosedError(dwResult))
+        {
+            WErrMsgA errmsg(dwResult);
+            oem_printf(stderr,
+                "strarc: Error in stripe set: %1%%n",
+                errmsg);
+        }
+
+        return dwResult;
+    }
+
+    // Waits for a thread to end and closes its handle. Returns false if the
+    // thread failed with another error than a closed pipe.
+    static
+        bool
+        WaitForThread(HANDLE &hThread)
+    {
+        if (hThread == NULL)
+            return true;
+
+        WaitForSingleObject(hThread, INFINITE);
+
+        DWORD dwResult;
+        if (!GetExitCodeThread(hThread, &dwResult))
+            dwResult = GetLastError();
+
+        CloseHandle(hThread);
+        hThread = NULL;
+
+        return (dwResult == NO_ERROR) || IsPipeClosedError(dwResult);
+    }
+
+    // Writes header of a stripe file at the beginning of the file. The
+    // header is first written when the file is created, and again with data
+    // size and flags when the archive is complete.
+    bool
+        WriteHeader(StripeFile *Stripe, DWORD dwFlags)
+    {
+        STRARC_STRIPE_HEADER Header;
+
+        ZeroMemory(&Header, sizeof Header);
+        memcpy(Header.Signature, STRIPE_HEADER_SIGNATURE,
+            sizeof Header.Signature);
+        Header.SetId = SetId;
+        Header.DataSize = Stripe->DataSize;
+        Header.dwStripe = (DWORD)(Stripe - Files) + 1;
+        Header.dwFlags = dwFlags;
+
+        LARGE_INTEGER StartPosition = { 0 };
+
+        return SetFilePointerEx(Stripe->hFile, StartPosition, NULL,
+            FILE_BEGIN) &&
+            WriteHandleBlock(Stripe->hFile, (LPBYTE)&Header, sizeof Header);
+    }
+
+    // Reads and checks header of a stripe file and gets its data size.
+    bool
+        ReadHeader(StripeFile *Stripe)
+    {
+        STRARC_STRIPE_HEADER Header;
+        DWORD dwStripe = (DWORD)(Stripe - Files) + 1;
+        DWORD dwBytes;
+
+        if (!ReadHandleBlock(Stripe->hFile, (LPBYTE)&Header, sizeof Header,
+            &dwBytes))
+        {
+            WErrMsgA errmsg;
+            oem_printf(stderr,
+                "strarc: Error reading stripe file '%1!ws!': %2%%n",
+                Stripe->Name,
+                errmsg);
+
+            return false;
+        }
+
+        if ((dwBytes != sizeof Header) ||
+            (memcmp(Header.Signature, STRIPE_HEADER_SIGNATURE,
+                sizeof Header.Signature) != 0) ||
+            (Header.SetId != SetId) ||
+            (Header.dwStripe != dwStripe))
+        {
+            oem_printf(stderr,
+                "strarc: '%1!ws!' is not stripe %2!u! of this stripe "
+                "set.%%n",
+                Stripe->Name, dwStripe);
+
+            SetLastError(ERROR_INVALID_DATA);
+            return false;
+        }
+
+        if (!(Header.dwFlags & STRIPE_FLAG_COMPLETE))
+        {
+            oem_printf(stderr,
+                "strarc: Stripe file '%1!ws!' is incomplete.%%n",
+                Stripe->Name);
+
+            SetLastError(ERROR_INVALID_DATA);
+            return false;
+        }
+
+        Stripe->DataSize = Header.DataSize;
+
+        return true;
+    }
+
+    // Adds full path of a stripe file to the list of stripe files.
+    bool
+        AddFile(LPCWSTR wczName)
+    {
+        if (dwStripes >= STRIPE_SET_MAX_FILES)
+        {
+            SetLastError(ERROR_TOO_MANY_NAMES);
+            return false;
+        }
+
+        LPWSTR wczPath = dwStripes == 0 ? wczNames :
+            Files[dwStripes - 1].Name + wcslen(Files[dwStripes - 1].Name) + 1;
+
+        DWORD dwSize = (DWORD)(STRIPE_SET_NAMES_SIZE - (wczPath - wczNames));
+
+        DWORD dwLength = GetFullPathName(wczName, dwSize, wczPath, NULL);
+
+        if ((dwLength == 0) || (dwLength >= dwSize))
+        {
+            if (dwLength != 0)
+                SetLastError(ERROR_FILENAME_EXCED_RANGE);
+
+            return false;
+        }
+
+        Files[dwStripes++].Name = wczPath;
+
+        return true;
+    }
+
+public:
+
+    StripeSet(bool bWrite, DWORD dwBlockSize)
+        : bWrite(bWrite),
+        dwBlockSize(dwBlockSize),
+        dwStripes(0),
+        SetId(bWrite ? NewArchiveSetId() : 0),
+        ArchiveSize(0),
+        bArchiveComplete(false),
+        hArchivePipe(NULL),
+        hDistributorThread(NULL)
+    {
+        ZeroMemory(Files, sizeof(Files));
+        ZeroMemory(hStripePipes, sizeof(hStripePipes));
+
+        wczNames = (LPWSTR)
+            LocalAlloc(LMEM_FIXED, STRIPE_SET_NAMES_SIZE * sizeof(WCHAR));
+
+        wczNameBuffer = (LPWSTR)
+            LocalAlloc(LMEM_FIXED, STRIPE_SET_NAMES_SIZE * sizeof(WCHAR));
+    }
+
+    ~StripeSet()
+    {
+        Wait();
+
+        for (DWORD i = 0; i < dwStripes; i++)
+        {
+            if (Files[i].hPipe != NULL)
+                CloseHandle(Files[i].hPipe);
+
+            if ((Files[i].hFile != NULL) &&
+                (Files[i].hFile != INVALID_HANDLE_VALUE))
+                CloseHandle(Files[i].hFile);
+        }
+
+        if (wczNames != NULL)
+            LocalFree(wczNames);
+
+        if (wczNameBuffer != NULL)
+            LocalFree(wczNameBuffer);
+    }
+
+    bool
+        IsInitialized() const
+    {
+        return (wczNames != NULL) && (wczNameBuffer != NULL);
+    }
+
+    DWORD
+        GetStripeCount() const
+    {
+        return dwStripes;
+    }
+
+    DWORD
+        GetBlockSize() const
+    {
+        return dwBlockSize;
+    }
+
+    // Adds stripe files from a comma separated list.
+    bool
+        ParseFileList(LPCWSTR wczList)
+    {
+        for (LPCWSTR wczItem = wczList; *wczItem != 0;)
+        {
+            size_t length = wcscspn(wczItem, L",");
+
+            if (length == 0 || length >= STRIPE_SET_NAMES_SIZE)
+            {
+                SetLastError(ERROR_INVALID_NAME);
+                return false;
+            }
+
+            wcsncpy(wczNameBuffer, wczItem, length);
+            wczNameBuffer[length] = 0;
+
+            if (!AddFile(wczNameBuffer))
+                return false;
+
+            wczItem += length;
+
+            if (*wczItem == L',')
+                ++wczItem;
+        }
+
+        if (dwStripes == 0)
+        {
+            SetLastError(ERROR_INVALID_NAME);
+            return false;
+        }
+
+        return true;
+    }
+
+    // The manifest is a UTF-8 text file with the signature line, a line with
+    // block size, a line with the set id in the stripe headers and then full
+    // path to each stripe file in stripe order.
+    bool
+        WriteManifest(LPCWSTR wczManifest)
+    {
+        LPSTR szManifest = (LPSTR)
+            LocalAlloc(LMEM_FIXED, STRIPE_SET_MANIFEST_MAX_SIZE);
+
+        if (szManifest == NULL)
+            return false;
+
+        int length = _snprintf(szManifest, STRIPE_SET_MANIFEST_MAX_SIZE,
+            STRIPE_SET_MANIFEST_SIGNATURE "\r\n"
+            "block size %u\r\n"
+            "set id %016I64X\r\n",
+            dwBlockSize,
+            SetId);
+
+        for (DWORD i = 0; i < dwStripes; i++)
+        {
+            length += WideCharToMultiByte(CP_UTF8, 0, Files[i].Name, -1,
+                szManifest + length, STRIPE_SET_MANIFEST_MAX_SIZE - length - 2,
+                NULL, NULL) - 1;
+
+            szManifest[length++] = '\r';
+            szManifest[length++] = '\n';
+        }
+
+        HANDLE hManifest = CreateFile(wczManifest,
+            GENERIC_WRITE,
+            FILE_SHARE_READ | FILE_SHARE_DELETE,
+            NULL,
+            CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL,
+            NULL);
+
+        bool bResult = (hManifest != INVALID_HANDLE_VALUE) &&
+            WriteHandleBlock(hManifest, (LPBYTE)szManifest, length);
+
+        DWORD dwError = GetLastError();
+
+        if (hManifest != INVALID_HANDLE_VALUE)
+            CloseHandle(hManifest);
+
+        LocalFree(szManifest);
+
+        SetLastError(dwError);
+
+        return bResult;
+    }
+
+    bool
+        ReadManifest(LPCWSTR wczManifest)
+    {
+        HANDLE hManifest = CreateFile(wczManifest,
+            GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            NULL,
+            OPEN_EXISTING,
+            FILE_FLAG_SEQUENTIAL_SCAN,
+            NULL);
+
+        if (hManifest == INVALID_HANDLE_VALUE)
+            return false;
+
+        LPSTR szManifest = (LPSTR)
+            LocalAlloc(LMEM_FIXED, STRIPE_SET_MANIFEST_MAX_SIZE + 1);
+
+        DWORD dwLength = 0;
+
+        bool bResult = (szManifest != NULL) &&
+            ReadHandleBlock(hManifest, (LPBYTE)szManifest,
+                STRIPE_SET_MANIFEST_MAX_SIZE, &dwLength);
+
+        DWORD dwError = GetLastError();
+
+        CloseHandle(hManifest);
+
+        if (!bResult)
+        {
+            if (szManifest != NULL)
+                LocalFree(szManifest);
+
+            SetLastError(dwError);
+            return false;
+        }
+
+        szManifest[dwLength] = 0;
+
+        // A manifest edited in a text editor may begin with a UTF-8 BOM.
+        LPSTR szLine = szManifest;
+        if (strncmp(szLine, "\xEF\xBB\xBF", 3) == 0)
+            szLine += 3;
+        DWORD dwLine = 0;
+
+        while (bResult && (*szLine != 0))
+        {
+            LPSTR szNext = szLine + strcspn(szLine, "\r\n");
+
+            if (*szNext != 0)
+                *szNext++ = 0;
+
+            szNext += strspn(szNext, "\r\n");
+
+            switch (dwLine++)
+            {
+            case 0:
+                bResult = strcmp(szLine, STRIPE_SET_MANIFEST_SIGNATURE) == 0;
+                break;
+
+            case 1:
+                bResult = sscanf(szLine, "block size %u", &dwBlockSize) == 1;
+                break;
+
+            case 2:
+                bResult = sscanf(szLine, "set id %I64x", &SetId) == 1;
+                break;
+
+            default:
+                bResult = (MultiByteToWideChar(CP_UTF8, 0, szLine, -1,
+                    wczNameBuffer, STRIPE_SET_NAMES_SIZE) != 0) &&
+                    AddFile(wczNameBuffer);
+
+                dwError = GetLastError();
+
+                break;
+            }
+
+            szLine = szNext;
+        }
+
+        LocalFree(szManifest);
+
+        if (bResult && ((dwStripes == 0) || (dwBlockSize == 0)))
+        {
+            bResult = false;
+            dwError = ERROR_INVALID_DATA;
+        }
+
+        if (!bResult)
+            SetLastError(dwLine > 3 ? dwError : ERROR_INVALID_DATA);
+
+        return bResult;
+    }
+
+    // Opens all stripe files. Returns name of a file that could not be
+    // opened, or NULL if all files are open.
+    LPCWSTR
+        OpenFiles()
+    {
+        for (DWORD i = 0; i < dwStripes; i++)
+        {
+            Files[i].hFile = CreateFile(Files[i].Name,
+                bWrite ? GENERIC_WRITE : GENERIC_READ,
+                FILE_SHARE_READ | FILE_SHARE_DELETE |
+                (bWrite ? 0 : FILE_SHARE_WRITE),
+                NULL,
+                bWrite ? CREATE_ALWAYS : OPEN_EXISTING,
+                (bWrite ? FILE_ATTRIBUTE_NORMAL : 0) |
+                FILE_FLAG_SEQUENTIAL_SCAN |
+                FILE_FLAG_BACKUP_SEMANTICS,
+                NULL);
+
+            if (Files[i].hFile == INVALID_HANDLE_VALUE)
+                return Files[i].Name;
+        }
+
+        return NULL;
+    }
+
+    // Writes a header without data size to each new stripe file.
+    bool
+        WriteHeaders()
+    {
+        for (DWORD i = 0; i < dwStripes; i++)
+            if (!WriteHeader(Files + i, 0))
+                return false;
+
+        return true;
+    }
+
+    // Reads headers of all stripe files. Blocks are written to the stripe
+    // files in turn, so data sizes must add up to an archive where only the
+    // last block is shorter than the block size.
+    bool
+        ReadHeaders()
+    {
+        ArchiveSize = 0;
+
+        for (DWORD i = 0; i < dwStripes; i++)
+        {
+            if (!ReadHeader(Files + i))
+                return false;
+
+            ArchiveSize += Files[i].DataSize;
+        }
+
+        ULONGLONG Blocks = ArchiveSize / dwBlockSize;
+        DWORD dwLastStripe = (DWORD)(Blocks % dwStripes);
+
+        for (DWORD i = 0; i < dwStripes; i++)
+        {
+            ULONGLONG DataSize =
+                (Blocks / dwStripes + (i < dwLastStripe ? 1 : 0)) *
+                dwBlockSize;
+
+            if (i == dwLastStripe)
+                DataSize += ArchiveSize % dwBlockSize;
+
+            if (Files[i].DataSize != DataSize)
+            {
+                oem_printf(stderr,
+                    "strarc: Size of stripe file '%1!ws!' does not match "
+                    "the stripe set.%%n",
+                    Files[i].Name);
+
+                SetLastError(ERROR_INVALID_DATA);
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Waits for the distributor thread and then for each stripe thread. If
+    // the distributor thread was never started, closing its ends of the
+    // pipes makes the stripe threads end. Returns false if any thread
+    // failed.
+    bool
+        Wait()
+    {
+        bool bResult = WaitForThread(hDistributorThread);
+
+        if (hArchivePipe != NULL)
+        {
+            CloseHandle(hArchivePipe);
+            hArchivePipe = NULL;
+        }
+
+        for (DWORD i = 0; i < dwStripes; i++)
+        {
+            if (hStripePipes[i] != NULL)
+            {
+                CloseHandle(hStripePipes[i]);
+                hStripePipes[i] = NULL;
+            }
+
+            if (!WaitForThread(Files[i].hThread))
+                bResult = false;
+        }
+
+        return bResult;
+    }
+
+    // Starts stripe threads and the distributor thread, which uses
+    // hArchive as its end of the pipe to or from the session.
+    bool
+        Start(HANDLE hArchive)
+    {
+        hArchivePipe = hArchive;
+
+        for (DWORD i = 0; i < dwStripes; i++)
+        {
+            Files[i].Set = this;
+
+            if (!CreatePipe(bWrite ? &Files[i].hPipe : &hStripePipes[i],
+                bWrite ? &hStripePipes[i] : &Files[i].hPipe,
+                NULL,
+                dwBlockSize))
+                return false;
+
+            unsigned uiThreadId;
+
+            Files[i].hThread = (HANDLE)
+                _beginthreadex(NULL, 0, StripeThread, Files + i, 0,
+                    &uiThreadId);
+
+            if (Files[i].hThread == NULL)
+                return false;
+        }
+
+        unsigned uiThreadId;
+
+        hDistributorThread = (HANDLE)
+            _beginthreadex(NULL, 0, DistributorThread, this, 0, &uiThreadId);
+
+        return hDistributorThread != NULL;
+    }
+};
+
+// This function opens an archive striped over several files. When backing
+// up, wczStripeFiles is a comma separated list of stripe files and a
+// manifest listing them is written to wczManifest. When restoring, stripe
+// files are read from the manifest and their stripe headers are checked.
+// The archive handle is then a pipe to or from the stripe set threads.
+// Raises an exception if a stripe file cannot be opened, returns false on
+// other errors.
+bool
+StrArc::OpenStripeSet(LPCWSTR wczManifest,
+    LPCWSTR wczStripeFiles,
+    bool bBackupMode)
+{
+    Stripes = new StripeSet(bBackupMode, dwBufferSize);
+
+    if (Stripes == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return false;
+    }
+
+    if (!Stripes->IsInitialized())
+        return false;
+
+    if (bBackupMode ?
+        !Stripes->ParseFileList(wczStripeFiles) ||
+        !Stripes->WriteManifest(wczManifest) :
+        !Stripes->ReadManifest(wczManifest))
+        return false;
+
+    LPCWSTR wczFailedFile = Stripes->OpenFiles();
+
+    if (wczFailedFile != NULL)
+        Exception(XE_ARCHIVE_OPEN, wczFailedFile);
+
+    if (bBackupMode ? !Stripes->WriteHeaders() : !Stripes->ReadHeaders())
+        return false;
+
+    // Session end of the pipe is inherited by any filter utility, like an
+    // archive file.
+    WSecurityAttributes sa;
+    sa.bInheritHandle = TRUE;
+
+    HANDLE hPipe[2] = { NULL };
+    if (!CreatePipe(&hPipe[0], &hPipe[1], &sa, Stripes->GetBlockSize()))
+        return false;
+
+    hArchive = bBackupMode ? hPipe[1] : hPipe[0];
+
+    SetHandleInformation(bBackupMode ? hPipe[0] : hPipe[1],
+        HANDLE_FLAG_INHERIT, 0);
+
+    if (!Stripes->Start(bBackupMode ? hPipe[0] : hPipe[1]))
+        return false;
+
+    if (bVerbose)
+        fprintf(stderr,
+            "Archive striped over %u files in blocks of %u bytes.\n",
+            Stripes->GetStripeCount(),
+            Stripes->GetBlockSize());
+
+    return true;
+}
+
+// This function waits for stripe set threads to write or read all data and
+// closes the stripe set. The session must have closed the archive pipe
+// first. Returns false if any stripe set thread failed.
+bool
+StrArc::CloseStripeSet()
+{
+    bool bResult = Stripes->Wait();
+
+    delete Stripes;
+    Stripes = NULL;
+
+    return bResult;
+}
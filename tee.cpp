@@ -0,0 +1,480 @@
+/* Stream Archive I/O utility, Copyright (C) Olof Lagerkvist 2004-2022
+*
+* tee.cpp
+* Writing archive to additional files or commands in the same pass (--tee).
+*/
+
+#ifndef _UNICODE
+#define _UNICODE
+#endif
+#ifndef _DLL
+#define _DLL
+#endif
+#ifndef UNICODE
+#define UNICODE
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#define WIN32_NO_STATUS
+#include <process.h>
+#include <windows.h>
+#include <intsafe.h>
+#undef WIN32_NO_STATUS
+#include <ntdll.h>
+
+#include <winstrct.h>
+#include <wio.h>
+
+#include "strarc.hpp"
+
+// The session writes the archive to a pipe read by a tee thread. The tee
+// thread writes each block to the archive and to a queue for each additional
+// output. Queues are pipes sized for TEE_QUEUE_BLOCKS blocks, each read by a
+// writer thread for its output, so a slow output only stalls the archive
+// when its queue is full. An output that fails is dropped and an error is
+// displayed, while the archive and other outputs are still written. The
+// dropped output then makes the session return an error.
+class StrArc::TeeOutput
+{
+    struct TeeTarget
+    {
+        TeeOutput *Tee;
+        LPWSTR Name;
+        bool bCommand;
+        HANDLE hOutput;
+        HANDLE hQueue;
+        HANDLE hThread;
+        PROCESS_INFORMATION piCommand;
+    };
+
+    DWORD dwBlockSize;
+    DWORD dwTargets;
+    TeeTarget Targets[TEE_MAX_TARGETS];
+
+    // Tee thread ends of the queue pipes.
+    HANDLE hQueueInputs[TEE_MAX_TARGETS];
+
+    // Archive handle, and tee thread end of pipe from the session.
+    HANDLE hPrimary;
+    HANDLE hArchivePipe;
+    HANDLE hTeeThread;
+
+    static
+        unsigned
+        CALLBACK
+        TargetThread(void *lpCtx)
+    {
+        TeeTarget *Target = (TeeTarget *)lpCtx;
+        TeeOutput *Tee = Target->Tee;
+
+        DWORD dwResult = NO_ERROR;
+
+        LPBYTE lpBuf = (LPBYTE)LocalAlloc(LMEM_FIXED, Tee->dwBlockSize);
+
+        if (lpBuf == NULL)
+            dwResult = GetLastError();
+        else
+            for (;;)
+            {
+                DWORD dwBytes;
+
+                if (!ReadHandleBlock(Target->hQueue, lpBuf, Tee->dwBlockSize,
+                    &dwBytes))
+                {
+                    dwResult = GetLastError();
+                    break;
+                }
+
+                if (dwBytes == 0)
+                    break;
+
+                if (!WriteHandleBlock(Target->hOutput, lpBuf, dwBytes))
+                {
+                    dwResult = GetLastError();
+                    break;
+                }
+            }
+
+        if (lpBuf != NULL)
+            LocalFree(lpBuf);
+
+        // This makes the tee thread drop this output, and a command find end
+        // of its input.
+        CloseHandle(Target->hQueue);
+        Target->hQueue = NULL;
+        CloseHandle(Target->hOutput);
+        Target->hOutput = NULL;
+
+        if (dwResult != NO_ERROR)
+        {
+            WErrMsgA errmsg(dwResult);
+            oem_printf(stderr,
+                "strarc: Error writing archive copy to '%1!ws!': %2%%n",
+                Target->Name,
+                errmsg);
+        }
+
+        return dwResult;
+    }
+
+    static
+        unsigned
+        CALLBACK
+        TeeThread(void *lpCtx)
+    {
+        TeeOutput *Tee = (TeeOutput *)lpCtx;
+
+        DWORD dwResult = NO_ERROR;
+
+        LPBYTE lpBuf = (LPBYTE)LocalAlloc(LMEM_FIXED, Tee->dwBlockSize);
+
+        if (lpBuf == NULL)
+            dwResult = GetLastError();
+        else
+            for (;;)
+            {
+                DWORD dwBytes;
+
+                if (!ReadHandleBlock(Tee->hArchivePipe, lpBuf,
+                    Tee->dwBlockSize, &dwBytes))
+                {
+                    dwResult = GetLastError();
+                    break;
+                }
+
+                if (dwBytes == 0)
+                    break;
+
+                if (!WriteHandleBlock(Tee->hPrimary, lpBuf, dwBytes))
+                {
+                    dwResult = GetLastError();
+                    break;
+                }
+
+                // Writer threads display errors for outputs that fail.
+                for (DWORD i = 0; i < Tee->dwTargets; i++)
+                    if ((Tee->hQueueInputs[i] != NULL) &&
+                        !WriteHandleBlock(Tee->hQueueInputs[i], lpBuf,
+                            dwBytes))
+                    {
+                        CloseHandle(Tee->hQueueInputs[i]);
+                        Tee->hQueueInputs[i] = NULL;
+                    }
+            }
+
+        if (lpBuf != NULL)
+            LocalFree(lpBuf);
+
+        // This makes the session fail writing if the archive failed, and
+        // writer threads find end of their queues.
+        CloseHandle(Tee->hArchivePipe);
+        Tee->hArchivePipe = NULL;
+
+        for (DWORD i = 0; i < Tee->dwTargets; i++)
+            if (Tee->hQueueInputs[i] != NULL)
+            {
+                CloseHandle(Tee->hQueueInputs[i]);
+                Tee->hQueueInputs[i] = NULL;
+            }
+
+        if (dwResult != NO_ERROR)
+        {
+            WErrMsgA errmsg(dwResult);
+            oem_printf(stderr,
+                "strarc: Error writing archive: %1%%n",
+                errmsg);
+        }
+
+        return dwResult;
+    }
+
+    // Waits for a thread to end and closes its handle. Returns false if the
+    // thread failed.
+    static
+        bool
+        WaitForThread(HANDLE &hThread)
+    {
+        if (hThread == NULL)
+            return true;
+
+        WaitForSingleObject(hThread, INFINITE);
+
+        DWORD dwResult;
+        if (!GetExitCodeThread(hThread, &dwResult))
+            dwResult = GetLastError();
+
+        CloseHandle(hThread);
+        hThread = NULL;
+
+        return dwResult == NO_ERROR;
+    }
+
+public:
+
+    TeeOutput(DWORD dwBlockSize)
+        : dwBlockSize(dwBlockSize),
+        dwTargets(0),
+        hPrimary(NULL),
+        hArchivePipe(NULL),
+        hTeeThread(NULL)
+    {
+        ZeroMemory(Targets, sizeof(Targets));
+        ZeroMemory(hQueueInputs, sizeof(hQueueInputs));
+    }
+
+    ~TeeOutput()
+    {
+        Wait();
+
+        if (hPrimary != NULL)
+            CloseHandle(hPrimary);
+    }
+
+    // Opens an output file, or starts a command if the name begins with |.
+    // Returns false if the file cannot be opened or the command cannot be
+    // started.
+    bool
+        AddTarget(LPWSTR wczName, DWORD dwArchiveCreation)
+    {
+        TeeTarget *Target = Targets + dwTargets++;
+
+        Target->Tee = this;
+        Target->bCommand = wczName[0] == L'|';
+        Target->Name = Target->bCommand ? wczName + 1 : wczName;
+
+        if (!Target->bCommand)
+        {
+            Target->hOutput = CreateFile(Target->Name,
+                GENERIC_WRITE,
+                FILE_SHARE_READ | FILE_SHARE_DELETE,
+                NULL,
+                dwArchiveCreation,
+                FILE_ATTRIBUTE_NORMAL |
+                FILE_FLAG_SEQUENTIAL_SCAN |
+                FILE_FLAG_BACKUP_SEMANTICS,
+                NULL);
+
+            if (Target->hOutput == INVALID_HANDLE_VALUE)
+                return false;
+
+            if (dwArchiveCreation == OPEN_ALWAYS)
+                SetFilePointer(Target->hOutput, 0, 0, FILE_END);
+            else
+                SetEndOfFile(Target->hOutput);
+
+            return true;
+        }
+
+        // Like a filter utility, the command only inherits the read end of
+        // the pipe as its stdin. Its stdout is stderr of this process, so
+        // that it cannot mix with an archive written to stdout.
+        WSecurityAttributes sa;
+        sa.bInheritHandle = TRUE;
+
+        HANDLE hCommandInput;
+        if (!CreatePipe(&hCommandInput, &Target->hOutput, &sa, dwBlockSize))
+            return false;
+
+        SetHandleInformation(Target->hOutput, HANDLE_FLAG_INHERIT, 0);
+
+        WStartupInfo si;
+        si.dwFlags = STARTF_USESTDHANDLES;
+        si.hStdInput = hCommandInput;
+        si.hStdOutput = GetStdHandle(STD_ERROR_HANDLE);
+        si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+
+        bool bResult = CreateProcess(NULL, Target->Name, NULL, NULL, TRUE, 0,
+            NULL, NULL, &si, &Target->piCommand) != FALSE;
+
+        DWORD dwError = GetLastError();
+        CloseHandle(hCommandInput);
+        SetLastError(dwError);
+
+        return bResult;
+    }
+
+    bool
+        IsCommand(DWORD dwTarget) const
+    {
+        return Targets[dwTarget].bCommand;
+    }
+
+    LPCWSTR
+        GetName(DWORD dwTarget) const
+    {
+        return Targets[dwTarget].Name;
+    }
+
+    // Waits for the tee thread, each writer thread and each command. If the
+    // threads were never started, closing the pipes and outputs makes the
+    // others end. Returns false if the archive or any copy of it could not
+    // be completely written, or if a command returned non-zero.
+    bool
+        Wait()
+    {
+        bool bResult = WaitForThread(hTeeThread);
+
+        if (hArchivePipe != NULL)
+        {
+            CloseHandle(hArchivePipe);
+            hArchivePipe = NULL;
+        }
+
+        for (DWORD i = 0; i < dwTargets; i++)
+        {
+            TeeTarget *Target = Targets + i;
+
+            if (hQueueInputs[i] != NULL)
+            {
+                CloseHandle(hQueueInputs[i]);
+                hQueueInputs[i] = NULL;
+            }
+
+            // A writer thread that failed has dropped its copy.
+            if (!WaitForThread(Target->hThread))
+                bResult = false;
+
+            if (Target->hQueue != NULL)
+            {
+                CloseHandle(Target->hQueue);
+                Target->hQueue = NULL;
+            }
+
+            if ((Target->hOutput != NULL) &&
+                (Target->hOutput != INVALID_HANDLE_VALUE))
+                CloseHandle(Target->hOutput);
+
+            Target->hOutput = NULL;
+
+            if (Target->piCommand.dwProcessId != 0)
+            {
+                WaitForSingleObject(Target->piCommand.hProcess, INFINITE);
+
+                DWORD dwExitCode;
+                if (!GetExitCodeProcess(Target->piCommand.hProcess,
+                    &dwExitCode))
+                    bResult = false;
+                else if (dwExitCode != 0)
+                {
+                    oem_printf(stderr,
+                        "strarc: Archive copy command '%1!ws!' returned "
+                        "%2!u!.%%n",
+                        Target->Name,
+                        dwExitCode);
+
+                    bResult = false;
+                }
+
+                CloseHandle(Target->piCommand.hProcess);
+                CloseHandle(Target->piCommand.hThread);
+                Target->piCommand.dwProcessId = 0;
+            }
+        }
+
+        return bResult;
+    }
+
+    // Starts writer threads for all outputs and the tee thread, which writes
+    // to hArchive and reads from hSessionPipe.
+    bool
+        Start(HANDLE hArchive, HANDLE hSessionPipe)
+    {
+        hPrimary = hArchive;
+        hArchivePipe = hSessionPipe;
+
+        for (DWORD i = 0; i < dwTargets; i++)
+        {
+            if (!CreatePipe(&Targets[i].hQueue, &hQueueInputs[i], NULL,
+                dwBlockSize * TEE_QUEUE_BLOCKS))
+                return false;
+
+            unsigned uiThreadId;
+
+            Targets[i].hThread = (HANDLE)
+                _beginthreadex(NULL, 0, TargetThread, Targets + i, 0,
+                    &uiThreadId);
+
+            if (Targets[i].hThread == NULL)
+                return false;
+        }
+
+        unsigned uiThreadId;
+
+        hTeeThread = (HANDLE)
+            _beginthreadex(NULL, 0, TeeThread, this, 0, &uiThreadId);
+
+        return hTeeThread != NULL;
+    }
+};
+
+// This function opens additional outputs for the archive being created, each
+// either a file name or a command to start that begins with |. The archive
+// handle is then a pipe to a thread that writes the archive both to the
+// original archive handle and to the additional outputs. Raises an exception
+// if an output cannot be opened, returns false on other errors.
+bool
+StrArc::OpenTeeTargets(DWORD dwTargets,
+    LPWSTR *wczTargets,
+    DWORD dwArchiveCreation)
+{
+    Tee = new TeeOutput(dwBufferSize);
+
+    if (Tee == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return false;
+    }
+
+    // Commands started for outputs should not inherit the archive handle.
+    SetHandleInformation(hArchive, HANDLE_FLAG_INHERIT, 0);
+
+    for (DWORD i = 0; i < dwTargets; i++)
+        if (!Tee->AddTarget(wczTargets[i], dwArchiveCreation))
+            if (Tee->IsCommand(i))
+                Exception(XE_FILTER_EXECUTE, Tee->GetName(i));
+            else
+                Exception(XE_ARCHIVE_OPEN, Tee->GetName(i));
+
+    // Session end of the pipe is inherited by any filter utility, like an
+    // archive file.
+    WSecurityAttributes sa;
+    sa.bInheritHandle = TRUE;
+
+    HANDLE hPipe[2] = { NULL };
+    if (!CreatePipe(&hPipe[0], &hPipe[1], &sa, dwBufferSize))
+        return false;
+
+    SetHandleInformation(hPipe[0], HANDLE_FLAG_INHERIT, 0);
+
+    HANDLE hPrimary = hArchive;
+    hArchive = hPipe[1];
+
+    if (!Tee->Start(hPrimary, hPipe[0]))
+        return false;
+
+    if (bVerbose)
+        fprintf(stderr,
+            "Archive is also written to %u other output%s.\n",
+            dwTargets,
+            dwTargets != 1 ? "s" : "");
+
+    return true;
+}
+
+// This function waits for all archive data to be written to the archive and
+// other outputs, and for commands started for outputs to exit. The session
+// must have closed the archive pipe first. Returns false if the archive or
+// any other output was not completely written, or if a command for an
+// output returned non-zero.
+bool
+StrArc::CloseTeeTargets()
+{
+    bool bResult = Tee->Wait();
+
+    delete Tee;
+    Tee = NULL;
+
+    return bResult;
+}
@@ -0,0 +1,586 @@
+/* Stream Archive I/O utility, Copyright (C) Olof Lagerkvist 2004-2022
+*
+* volume.cpp
+* Archive split into volume files of limited size (--volume).
+*/
+
+#ifndef _UNICODE
+#define _UNICODE
+#endif
+#ifndef _DLL
+#define _DLL
+#endif
+#ifndef UNICODE
+#define UNICODE
+#endif
+#ifndef _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#define WIN32_NO_STATUS
+#include <process.h>
+#include <windows.h>
+#include <intsafe.h>
+#undef WIN32_NO_STATUS
+#include <ntdll.h>
+
+#include <winstrct.h>
+#include <wio.h>
+
+#include <stdio.h>
+
+#include "strarc.hpp"
+
+// A volume thread reads the archive from a pipe written by the session and
+// writes it to volume files, starting a new volume when the current one has
+// reached volume size. Each volume starts with a volume header, so that a
+// missing volume, or a volume from another archive, is found when reading.
+// When reading, the volume thread reads the volumes in order and writes the
+// data in them to the pipe the session reads. Next volume is opened while
+// the current one is still read, so that a slow open, for instance on
+// network or object storage, does not stall the session.
+class StrArc::VolumeSet
+{
+    bool bWrite;
+    bool bVerbose;
+    bool bErrorReported;
+    DWORD dwBlockSize;
+    ULONGLONG VolumeDataSize;
+    ULONGLONG SetId;
+
+    LPCWSTR wczArchive;
+    LPWSTR wczVolumeName;
+    DWORD dwVolumeNameSize;
+    DWORD dwVolume;
+
+    HANDLE hVolume;
+    ULONGLONG VolumeBytes;
+    STRARC_VOLUME_HEADER VolumeHeader;
+
+    // Volume set thread end of pipe to or from the session.
+    HANDLE hArchivePipe;
+    HANDLE hVolumeThread;
+
+    LPCWSTR
+        FormatVolumeName(DWORD dwNumber)
+    {
+        _snwprintf(wczVolumeName, dwVolumeNameSize, VOLUME_NAME_FORMAT,
+            wczArchive, dwNumber);
+
+        wczVolumeName[dwVolumeNameSize - 1] = 0;
+
+        return wczVolumeName;
+    }
+
+    HANDLE
+        OpenVolume(DWORD dwNumber)
+    {
+        FormatVolumeName(dwNumber);
+
+        return CreateFile(wczVolumeName,
+            bWrite ? GENERIC_WRITE : GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_DELETE |
+            (bWrite ? 0 : FILE_SHARE_WRITE),
+            NULL,
+            bWrite ? CREATE_ALWAYS : OPEN_EXISTING,
+            (bWrite ? FILE_ATTRIBUTE_NORMAL : 0) |
+            FILE_FLAG_SEQUENTIAL_SCAN |
+            FILE_FLAG_BACKUP_SEMANTICS,
+            NULL);
+    }
+
+    void
+        ReportVolume()
+    {
+        if (bVerbose)
+            oem_printf(stderr,
+                "%1!s! volume '%2!ws!'%%n",
+                bWrite ? "Writing" : "Reading",
+                FormatVolumeName(dwVolume));
+    }
+
+    // Writes header of current volume at the beginning of the volume file.
+    // The header is first written when the volume is created, and again
+    // with data size and flags when the volume is complete.
+    bool
+        WriteVolumeHeader(DWORD dwFlags)
+    {
+        ZeroMemory(&VolumeHeader, sizeof VolumeHeader);
+        memcpy(VolumeHeader.Signature, VOLUME_HEADER_SIGNATURE,
+            sizeof VolumeHeader.Signature);
+        VolumeHeader.SetId = SetId;
+        VolumeHeader.DataSize = VolumeBytes;
+        VolumeHeader.dwVolume = dwVolume;
+        VolumeHeader.dwFlags = dwFlags;
+
+        LARGE_INTEGER StartPosition = { 0 };
+
+        return SetFilePointerEx(hVolume, StartPosition, NULL, FILE_BEGIN) &&
+            WriteHandleBlock(hVolume, (LPBYTE)&VolumeHeader,
+                sizeof VolumeHeader);
+    }
+
+    bool
+        CreateVolume()
+    {
+        hVolume = OpenVolume(dwVolume);
+
+        if (hVolume == INVALID_HANDLE_VALUE)
+        {
+            hVolume = NULL;
+            return false;
+        }
+
+        VolumeBytes = 0;
+
+        ReportVolume();
+
+        return WriteVolumeHeader(0);
+    }
+
+    bool
+        CompleteVolume(DWORD dwFlags)
+    {
+        if (!WriteVolumeHeader(dwFlags))
+            return false;
+
+        CloseHandle(hVolume);
+        hVolume = NULL;
+
+        return true;
+    }
+
+    bool
+        IsVolumeHeader(DWORD dwBytes, DWORD dwNumber) const
+    {
+        return (dwBytes == sizeof VolumeHeader) &&
+            (memcmp(VolumeHeader.Signature, VOLUME_HEADER_SIGNATURE,
+                sizeof VolumeHeader.Signature) == 0) &&
+            (VolumeHeader.dwVolume == dwNumber);
+    }
+
+    // Reads and checks header of current volume. The first volume gives the
+    // set id that the other volumes must have.
+    bool
+        ReadVolumeHeader()
+    {
+        DWORD dwBytes;
+
+        if (!ReadHandleBlock(hVolume, (LPBYTE)&VolumeHeader,
+            sizeof VolumeHeader, &dwBytes))
+            return false;
+
+        if (IsVolumeHeader(dwBytes, dwVolume) &&
+            ((dwVolume == 1) || (VolumeHeader.SetId == SetId)))
+        {
+            SetId = VolumeHeader.SetId;
+            return true;
+        }
+
+        oem_printf(stderr,
+            "strarc: '%1!ws!' is not volume %2!u! of this archive.%%n",
+            FormatVolumeName(dwVolume), dwVolume);
+
+        bErrorReported = true;
+        SetLastError(ERROR_INVALID_DATA);
+        return false;
+    }
+
+    // Writes archive data to volumes, starting next volume when the current
+    // one is full. The volume that is open at end of archive is the last one.
+    bool
+        WriteVolumes(LPBYTE lpBuf)
+    {
+        for (;;)
+        {
+            DWORD dwBytes;
+
+            if (!ReadHandleBlock(hArchivePipe, lpBuf, dwBlockSize, &dwBytes))
+                return false;
+
+            if (dwBytes == 0)
+                return CompleteVolume(VOLUME_FLAG_LAST);
+
+            for (LPBYTE lpData = lpBuf; dwBytes > 0;)
+            {
+                if (VolumeBytes == VolumeDataSize)
+                {
+                    if (!CompleteVolume(0))
+                        return false;
+
+                    ++dwVolume;
+
+                    if (!CreateVolume())
+                        return false;
+                }
+
+                DWORD dwChunk = dwBytes;
+                if (dwChunk > VolumeDataSize - VolumeBytes)
+                    dwChunk = (DWORD)(VolumeDataSize - VolumeBytes);
+
+                if (!WriteHandleBlock(hVolume, lpData, dwChunk))
+                    return false;
+
+                lpData += dwChunk;
+                dwBytes -= dwChunk;
+                VolumeBytes += dwChunk;
+            }
+        }
+    }
+
+    // Reads volumes in order until the volume marked as last. A missing
+    // volume, a volume from another archive or a volume with less data than
+    // its header says is an error, reported after data in volumes before it
+    // has been passed to the session.
+    bool
+        ReadVolumes(LPBYTE lpBuf)
+    {
+        if (!ReadVolumeHeader())
+            return false;
+
+        for (;;)
+        {
+            HANDLE hNextVolume = NULL;
+            DWORD dwNextVolumeError = NO_ERROR;
+
+            if (!(VolumeHeader.dwFlags & VOLUME_FLAG_LAST))
+            {
+                hNextVolume = OpenVolume(dwVolume + 1);
+
+                if (hNextVolume == INVALID_HANDLE_VALUE)
+                {
+                    dwNextVolumeError = GetLastError();
+                    hNextVolume = NULL;
+                }
+            }
+
+            FormatVolumeName(dwVolume);
+
+            for (ULONGLONG BytesToRead = VolumeHeader.DataSize;
+                BytesToRead > 0;)
+            {
+                DWORD dwChunk = BytesToRead > dwBlockSize ?
+                    dwBlockSize : (DWORD)BytesToRead;
+
+                DWORD dwBytes;
+                bool bRead =
+                    ReadHandleBlock(hVolume, lpBuf, dwChunk, &dwBytes);
+
+                if (!bRead || (dwBytes != dwChunk))
+                {
+                    DWORD dwReadError = GetLastError();
+
+                    if (hNextVolume != NULL)
+                        CloseHandle(hNextVolume);
+
+                    if (bRead)
+                    {
+                        oem_printf(stderr,
+                            "strarc: Volume '%1!ws!' is truncated.%%n",
+                            wczVolumeName);
+
+                        bErrorReported = true;
+                        dwReadError = ERROR_HANDLE_EOF;
+                    }
+
+                    SetLastError(dwReadError);
+                    return false;
+                }
+
+                BytesToRead -= dwBytes;
+
+                // Session has stopped reading.
+                if (!WriteHandleBlock(hArchivePipe, lpBuf, dwBytes))
+                {
+                    if (hNextVolume != NULL)
+                        CloseHandle(hNextVolume);
+
+                    return true;
+                }
+            }
+
+            CloseHandle(hVolume);
+            hVolume = NULL;
+
+            if (VolumeHeader.dwFlags & VOLUME_FLAG_LAST)
+                return true;
+
+            ++dwVolume;
+
+            if (hNextVolume == NULL)
+            {
+                FormatVolumeName(dwVolume);
+                SetLastError(dwNextVolumeError);
+                return false;
+            }
+
+            hVolume = hNextVolume;
+
+            ReportVolume();
+
+            if (!ReadVolumeHeader())
+                return false;
+        }
+    }
+
+    // Deletes volumes left from an earlier, larger archive with the same
+    // name. Only files with a volume header from another volume set are
+    // deleted.
+    void
+        DeleteOldVolumes()
+    {
+        for (DWORD dwNumber = dwVolume + 1; ; dwNumber++)
+        {
+            HANDLE hFile = CreateFile(FormatVolumeName(dwNumber),
+                GENERIC_READ,
+                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                NULL,
+                OPEN_EXISTING,
+                FILE_FLAG_BACKUP_SEMANTICS,
+                NULL);
+
+            if (hFile == INVALID_HANDLE_VALUE)
+                return;
+
+            DWORD dwBytes;
+
+            bool bOldVolume =
+                ReadHandleBlock(hFile, (LPBYTE)&VolumeHeader,
+                    sizeof VolumeHeader, &dwBytes) &&
+                IsVolumeHeader(dwBytes, dwNumber) &&
+                (VolumeHeader.SetId != SetId);
+
+            CloseHandle(hFile);
+
+            if (!bOldVolume || !DeleteFile(wczVolumeName))
+                return;
+
+            if (bVerbose)
+                oem_printf(stderr,
+                    "Deleted old volume '%1!ws!'%%n",
+                    wczVolumeName);
+        }
+    }
+
+    static
+        unsigned
+        CALLBACK
+        VolumeThread(void *lpCtx)
+    {
+        VolumeSet *Set = (VolumeSet *)lpCtx;
+
+        DWORD dwResult = NO_ERROR;
+
+        LPBYTE lpBuf = (LPBYTE)LocalAlloc(LMEM_FIXED, Set->dwBlockSize);
+
+        if ((lpBuf == NULL) ||
+            !(Set->bWrite ?
+                Set->WriteVolumes(lpBuf) :
+                Set->ReadVolumes(lpBuf)))
+            dwResult = GetLastError();
+
+        if (lpBuf != NULL)
+            LocalFree(lpBuf);
+
+        // This makes the session find end of archive or fail writing.
+        CloseHandle(Set->hArchivePipe);
+        Set->hArchivePipe = NULL;
+
+        if (Set->hVolume != NULL)
+        {
+            CloseHandle(Set->hVolume);
+            Set->hVolume = NULL;
+        }
+
+        if (Set->bWrite && (dwResult == NO_ERROR))
+            Set->DeleteOldVolumes();
+
+        if ((dwResult != NO_ERROR) && !IsPipeClosedError(dwResult) &&
+            !Set->bErrorReported)
+        {
+            WErrMsgA errmsg(dwResult);
+            oem_printf(stderr,
+                "strarc: Error %1!s! volume '%2!ws!': %3%%n",
+                Set->bWrite ? "writing" : "reading",
+                Set->wczVolumeName,
+                errmsg);
+        }
+
+        return dwResult;
+    }
+
+public:
+
+    VolumeSet(LPCWSTR wczArchive,
+        ULONGLONG VolumeSize,
+        bool bWrite,
+        bool bVerbose,
+        DWORD dwBlockSize)
+        : bWrite(bWrite),
+        bVerbose(bVerbose),
+        bErrorReported(false),
+        dwBlockSize(dwBlockSize),
+        VolumeDataSize(0),
+        SetId(0),
+        wczArchive(wczArchive),
+        dwVolume(1),
+        hVolume(NULL),
+        VolumeBytes(0),
+        hArchivePipe(NULL),
+        hVolumeThread(NULL)
+    {
+        dwVolumeNameSize = (DWORD)wcslen(wczArchive) + 16;
+
+        wczVolumeName = (LPWSTR)
+            LocalAlloc(LMEM_FIXED, dwVolumeNameSize * sizeof(WCHAR));
+
+        if (bWrite)
+        {
+            VolumeDataSize = VolumeSize - sizeof(STRARC_VOLUME_HEADER);
+            SetId = NewArchiveSetId();
+        }
+    }
+
+    ~VolumeSet()
+    {
+        Wait();
+
+        if (hArchivePipe != NULL)
+            CloseHandle(hArchivePipe);
+
+        if ((hVolume != NULL) && (hVolume != INVALID_HANDLE_VALUE))
+            CloseHandle(hVolume);
+
+        if (wczVolumeName != NULL)
+            LocalFree(wczVolumeName);
+    }
+
+    bool
+        IsInitialized() const
+    {
+        return wczVolumeName != NULL;
+    }
+
+    // Opens first volume, and writes its volume header when writing.
+    // Returns name of the volume, or NULL if it cannot be opened.
+    LPCWSTR
+        OpenFirstVolume()
+    {
+        if (bWrite)
+            return CreateVolume() ? wczVolumeName : NULL;
+
+        hVolume = OpenVolume(dwVolume);
+
+        if (hVolume == INVALID_HANDLE_VALUE)
+        {
+            hVolume = NULL;
+            return NULL;
+        }
+
+        ReportVolume();
+
+        return wczVolumeName;
+    }
+
+    LPCWSTR
+        GetVolumeName() const
+    {
+        return wczVolumeName;
+    }
+
+    // Waits for the volume thread to end. Returns false if it failed to write
+    // or read all volumes.
+    bool
+        Wait()
+    {
+        if (hVolumeThread == NULL)
+            return true;
+
+        WaitForSingleObject(hVolumeThread, INFINITE);
+
+        DWORD dwResult;
+        if (!GetExitCodeThread(hVolumeThread, &dwResult))
+            dwResult = GetLastError();
+
+        CloseHandle(hVolumeThread);
+        hVolumeThread = NULL;
+
+        return (dwResult == NO_ERROR) || IsPipeClosedError(dwResult);
+    }
+
+    // Starts the volume thread, which uses hArchive as its end of the pipe
+    // to or from the session.
+    bool
+        Start(HANDLE hArchive)
+    {
+        hArchivePipe = hArchive;
+
+        unsigned uiThreadId;
+
+        hVolumeThread = (HANDLE)
+            _beginthreadex(NULL, 0, VolumeThread, this, 0, &uiThreadId);
+
+        return hVolumeThread != NULL;
+    }
+};
+
+// This function opens an archive split into volumes named after wczArchive
+// with volume numbers appended. When backing up, a new volume is started
+// when the current one reaches VolumeSize bytes, including the volume
+// header. When restoring, volumes are read in order until the volume marked
+// as last, and a missing volume is an error. The archive handle is then
+// a pipe to or from the volume set thread. Raises an exception if first
+// volume cannot be opened, returns false on other errors.
+bool
+StrArc::OpenVolumeSet(LPCWSTR wczArchive,
+    ULONGLONG VolumeSize,
+    bool bBackupMode)
+{
+    Volumes = new VolumeSet(wczArchive, VolumeSize, bBackupMode, bVerbose,
+        dwBufferSize);
+
+    if (Volumes == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return false;
+    }
+
+    if (!Volumes->IsInitialized())
+        return false;
+
+    if (Volumes->OpenFirstVolume() == NULL)
+        Exception(XE_ARCHIVE_OPEN, Volumes->GetVolumeName());
+
+    // Session end of the pipe is inherited by any filter utility, like an
+    // archive file.
+    WSecurityAttributes sa;
+    sa.bInheritHandle = TRUE;
+
+    HANDLE hPipe[2] = { NULL };
+    if (!CreatePipe(&hPipe[0], &hPipe[1], &sa, dwBufferSize))
+        return false;
+
+    hArchive = bBackupMode ? hPipe[1] : hPipe[0];
+
+    SetHandleInformation(bBackupMode ? hPipe[0] : hPipe[1],
+        HANDLE_FLAG_INHERIT, 0);
+
+    return Volumes->Start(bBackupMode ? hPipe[0] : hPipe[1]);
+}
+
+// This function waits for the volume set thread to write or read all data
+// and closes the volume set. The session must have closed the archive pipe
+// first. Returns false if the volume set thread failed.
+bool
+StrArc::CloseVolumeSet()
+{
+    bool bResult = Volumes->Wait();
+
+    delete Volumes;
+    Volumes = NULL;
+
+    return bResult;
+}